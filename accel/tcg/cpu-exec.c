@@ -1082,6 +1082,34 @@ HumanReadableText *qmp_x_query_jit(Error **errp)
     return human_readable_text_from_str(buf);
 }
 
+JitHashTableInfo *qmp_x_query_jit_htable(Error **errp)
+{
+    JitHashTableInfo *info;
+    struct qht_stats hst;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "JIT information is only available with accel=tcg");
+        return NULL;
+    }
+
+    qht_statistics_init(&tb_ctx.htable, &hst);
+    info = g_new0(JitHashTableInfo, 1);
+    info->head_buckets = hst.head_buckets;
+    info->used_head_buckets = hst.used_head_buckets;
+    info->entries = hst.entries;
+    info->resizes = hst.resizes;
+    if (hst.used_head_buckets) {
+        info->avg_chain = qdist_avg(&hst.chain);
+        info->max_chain = qdist_xmax(&hst.chain);
+    }
+    if (hst.head_buckets) {
+        info->avg_occupancy = qdist_avg(&hst.occupancy);
+    }
+    qht_statistics_destroy(&hst);
+
+    return info;
+}
+
 HumanReadableText *qmp_x_query_opcount(Error **errp)
 {
     g_autoptr(GString) buf = g_string_new("");
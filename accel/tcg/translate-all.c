@@ -903,6 +903,11 @@ void tb_htable_init(void)
 {
     unsigned int mode = QHT_MODE_AUTO_RESIZE;
 
+#ifdef CONFIG_SOFTMMU
+    /* user-mode emulation forks, which the resize worker would not survive */
+    mode |= QHT_MODE_BACKGROUND_RESIZE;
+#endif
+
     qht_init(&tb_ctx.htable, tb_cmp, CODE_GEN_HTABLE_SIZE, mode);
 }
 
@@ -2036,6 +2041,7 @@ static void print_qht_statistics(struct qht_stats hst, GString *buf)
                            "Histogram: %s\n",
                            qdist_avg(&hst.chain), hgram);
     g_free(hgram);
+    g_string_append_printf(buf, "TB hash resizes     %zu\n", hst.resizes);
 }
 
 struct tb_tree_stats {
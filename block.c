@@ -6381,6 +6381,19 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    IO_CODE();
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp)
 {
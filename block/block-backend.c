@@ -1961,6 +1961,13 @@ bool blk_is_writable(BlockBackend *blk)
     return blk->perm & BLK_PERM_WRITE;
 }
 
+/* Whether requests on @blk are subject to I/O limits */
+bool blk_is_throttled(BlockBackend *blk)
+{
+    IO_CODE();
+    return blk->public.throttle_group_member.throttle_state != NULL;
+}
+
 bool blk_is_sg(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
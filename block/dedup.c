@@ -0,0 +1,996 @@
+/*
+ * Deduplicating filter block driver
+ *
+ * The filter fingerprints every full cluster written through it.  When a
+ * cluster with the same contents is already known to be stored in the child
+ * node, the new cluster is not written but shared with the existing one with
+ * bdrv_co_copy_range() and BDRV_REQ_NO_FALLBACK, which storage that supports
+ * it (e.g. reflink capable file systems) implements by using a single extent
+ * for both clusters.  If the child cannot do that, the cluster is written.
+ *
+ * The fingerprint index can optionally be kept in a separate node, so that it
+ * survives restarts.  Index entries are only a hint: the candidate cluster is
+ * always read and compared before it is shared, so a stale index can cost
+ * performance but never corrupts data.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "crypto/hash.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define DEDUP_DIGEST_ALG  QCRYPTO_HASH_ALG_SHA256
+#define DEDUP_DIGEST_SIZE 32
+
+#define DEDUP_DEFAULT_CLUSTER_SIZE (64 * KiB)
+#define DEDUP_MIN_CLUSTER_SIZE     (4 * KiB)
+#define DEDUP_MAX_CLUSTER_SIZE     (2 * MiB)
+
+/*
+ * On-disk index layout: a header in the first DEDUP_INDEX_HEADER_SIZE bytes,
+ * followed by one DEDUP_DIGEST_SIZE record per cluster of the child node.
+ * An all-zero record means that nothing is known about the cluster.  All
+ * header fields are big endian.
+ */
+#define DEDUP_INDEX_MAGIC       0x5145444450494458ULL /* "QEDDPIDX" */
+#define DEDUP_INDEX_VERSION     1
+#define DEDUP_INDEX_HEADER_SIZE 4096
+#define DEDUP_INDEX_PAGE_SIZE   4096
+#define DEDUP_RECORDS_PER_PAGE  (DEDUP_INDEX_PAGE_SIZE / DEDUP_DIGEST_SIZE)
+
+typedef struct QEMU_PACKED DedupIndexHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t nb_clusters;
+} DedupIndexHeader;
+
+/* A cluster of the child node that is known to hold data with @digest */
+typedef struct DedupEntry {
+    uint8_t digest[DEDUP_DIGEST_SIZE];
+    uint64_t cluster;
+} DedupEntry;
+
+typedef struct BDRVDedupState {
+    BdrvChild *index;
+
+    uint32_t cluster_size;
+    int cluster_bits;
+    uint64_t nb_clusters;
+
+    /*
+     * Protects everything below.  It is not held during I/O; a candidate
+     * cluster that is written while it is being compared and shared is
+     * detected through @gen.
+     */
+    CoMutex lock;
+
+    /* Maps a digest to the DedupEntry of a cluster holding that data */
+    GHashTable *entries;
+    /* Per cluster: the entry it owns in @entries, or NULL */
+    DedupEntry **owner;
+    /*
+     * Per cluster: bumped whenever a write to the cluster starts, so that
+     * a completing write does not index data that a later write is
+     * already replacing
+     */
+    uint32_t *gen;
+    /* Per cluster: whether its on-disk index record needs to be written */
+    unsigned long *dirty;
+
+    /* Statistics */
+    uint64_t clusters_written;
+    uint64_t clusters_deduplicated;
+    uint64_t zero_clusters;
+} BDRVDedupState;
+
+#define DEDUP_OPT_CLUSTER_SIZE "cluster-size"
+static QemuOptsList runtime_opts = {
+    .name = "dedup",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = DEDUP_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of deduplication, default 64k (or the "
+                    "cluster size of an existing index)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static guint dedup_digest_hash(gconstpointer key)
+{
+    const DedupEntry *e = key;
+    guint h;
+
+    /* The digest is a cryptographic hash, so any part of it will do */
+    memcpy(&h, e->digest, sizeof(h));
+    return h;
+}
+
+static gboolean dedup_digest_equal(gconstpointer a, gconstpointer b)
+{
+    const DedupEntry *ea = a, *eb = b;
+
+    return !memcmp(ea->digest, eb->digest, DEDUP_DIGEST_SIZE);
+}
+
+static void dedup_mark_dirty(BDRVDedupState *s, uint64_t cluster)
+{
+    if (s->index) {
+        set_bit(cluster, s->dirty);
+    }
+}
+
+/* Called with s->lock held */
+static void dedup_insert(BDRVDedupState *s, const uint8_t *digest,
+                         uint64_t cluster)
+{
+    DedupEntry *e;
+
+    assert(!s->owner[cluster]);
+
+    e = g_new(DedupEntry, 1);
+    memcpy(e->digest, digest, DEDUP_DIGEST_SIZE);
+    e->cluster = cluster;
+
+    if (!g_hash_table_add(s->entries, e)) {
+        /* Some other cluster already holds this data */
+        g_free(e);
+        return;
+    }
+
+    s->owner[cluster] = e;
+    dedup_mark_dirty(s, cluster);
+}
+
+/* Called with s->lock held */
+static void dedup_forget(BDRVDedupState *s, uint64_t cluster)
+{
+    DedupEntry *e = s->owner[cluster];
+
+    if (e) {
+        s->owner[cluster] = NULL;
+        g_hash_table_remove(s->entries, e);
+        dedup_mark_dirty(s, cluster);
+    }
+}
+
+/* Called with s->lock held, before @cluster is modified */
+static void dedup_invalidate(BDRVDedupState *s, uint64_t cluster)
+{
+    s->gen[cluster]++;
+    dedup_forget(s, cluster);
+}
+
+/*
+ * Forget what is known about the clusters touched by [offset, offset + bytes),
+ * before that range is modified by anything else than a full cluster write.
+ */
+static void coroutine_fn dedup_invalidate_range(BDRVDedupState *s,
+                                                int64_t offset, int64_t bytes)
+{
+    uint64_t first = offset >> s->cluster_bits;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, s->cluster_size);
+    uint64_t i;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = first; i < MIN(end, s->nb_clusters); i++) {
+        dedup_invalidate(s, i);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static int dedup_resize(BDRVDedupState *s, int64_t length)
+{
+    uint64_t nb_clusters = DIV_ROUND_UP(length, s->cluster_size);
+    DedupEntry **owner;
+    uint32_t *gen;
+    uint64_t i;
+
+    if (nb_clusters <= s->nb_clusters) {
+        /*
+         * Keep the arrays; clusters beyond the new end are simply never
+         * looked at again until the node grows back.
+         */
+        for (i = nb_clusters; i < s->nb_clusters; i++) {
+            dedup_invalidate(s, i);
+        }
+        return 0;
+    }
+
+    owner = g_try_renew(DedupEntry *, s->owner, nb_clusters);
+    if (!owner) {
+        return -ENOMEM;
+    }
+    s->owner = owner;
+
+    gen = g_try_renew(uint32_t, s->gen, nb_clusters);
+    if (!gen) {
+        return -ENOMEM;
+    }
+    s->gen = gen;
+
+    memset(s->owner + s->nb_clusters, 0,
+           (nb_clusters - s->nb_clusters) * sizeof(*s->owner));
+    memset(s->gen + s->nb_clusters, 0,
+           (nb_clusters - s->nb_clusters) * sizeof(*s->gen));
+    if (s->index) {
+        s->dirty = bitmap_zero_extend(s->dirty, s->nb_clusters, nb_clusters);
+    }
+    s->nb_clusters = nb_clusters;
+
+    return 0;
+}
+
+static int dedup_write_index_header(BDRVDedupState *s)
+{
+    DedupIndexHeader header = {
+        .magic = cpu_to_be64(DEDUP_INDEX_MAGIC),
+        .version = cpu_to_be32(DEDUP_INDEX_VERSION),
+        .cluster_bits = cpu_to_be32(s->cluster_bits),
+        .nb_clusters = cpu_to_be64(s->nb_clusters),
+    };
+
+    return bdrv_pwrite(s->index, 0, &header, sizeof(header));
+}
+
+/*
+ * Write the index records of all dirty clusters, a page at a time.  Records
+ * are rebuilt from the in-memory state, so a page may as well be written in
+ * full.
+ *
+ * Called with s->lock held, or when no requests can be in flight.
+ */
+static int dedup_write_index(BDRVDedupState *s)
+{
+    g_autofree uint8_t *page = NULL;
+    uint64_t cluster;
+    int ret = 0;
+
+    if (!s->index) {
+        return 0;
+    }
+
+    page = g_malloc(DEDUP_INDEX_PAGE_SIZE);
+
+    for (cluster = find_first_bit(s->dirty, s->nb_clusters);
+         cluster < s->nb_clusters;
+         cluster = find_next_bit(s->dirty, s->nb_clusters, cluster))
+    {
+        uint64_t start = QEMU_ALIGN_DOWN(cluster, DEDUP_RECORDS_PER_PAGE);
+        uint64_t end = MIN(start + DEDUP_RECORDS_PER_PAGE, s->nb_clusters);
+        uint64_t i;
+
+        memset(page, 0, DEDUP_INDEX_PAGE_SIZE);
+        for (i = start; i < end; i++) {
+            if (s->owner[i]) {
+                memcpy(page + (i - start) * DEDUP_DIGEST_SIZE,
+                       s->owner[i]->digest, DEDUP_DIGEST_SIZE);
+            }
+        }
+        bitmap_clear(s->dirty, start, end - start);
+
+        ret = bdrv_pwrite(s->index,
+                          DEDUP_INDEX_HEADER_SIZE + start * DEDUP_DIGEST_SIZE,
+                          page, (end - start) * DEDUP_DIGEST_SIZE);
+        if (ret < 0) {
+            bitmap_set(s->dirty, start, end - start);
+            return ret;
+        }
+        cluster = end;
+    }
+
+    return 0;
+}
+
+/*
+ * Check the header of the index node.  Returns the cluster size the index was
+ * created with, 0 if the index is empty and still needs to be initialized,
+ * or a negative errno.
+ */
+static int64_t dedup_read_index_header(BDRVDedupState *s, Error **errp)
+{
+    DedupIndexHeader header;
+    uint32_t bits;
+    int64_t len;
+    int ret;
+
+    len = bdrv_getlength(s->index->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the index");
+        return len;
+    }
+    if (len < DEDUP_INDEX_HEADER_SIZE) {
+        return 0;
+    }
+
+    ret = bdrv_pread(s->index, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the index header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != DEDUP_INDEX_MAGIC) {
+        if (buffer_is_zero(&header, sizeof(header))) {
+            return 0;
+        }
+        error_setg(errp, "The index node does not contain a dedup index");
+        return -EINVAL;
+    }
+    if (be32_to_cpu(header.version) != DEDUP_INDEX_VERSION) {
+        error_setg(errp, "Unsupported dedup index version %" PRIu32,
+                   be32_to_cpu(header.version));
+        return -ENOTSUP;
+    }
+
+    bits = be32_to_cpu(header.cluster_bits);
+    if (bits < ctz32(DEDUP_MIN_CLUSTER_SIZE) ||
+        bits > ctz32(DEDUP_MAX_CLUSTER_SIZE)) {
+        error_setg(errp, "Invalid cluster size in the dedup index");
+        return -EINVAL;
+    }
+
+    return 1ULL << bits;
+}
+
+/* Fill the in-memory index from the records stored in the index node */
+static int dedup_load_index(BDRVDedupState *s, Error **errp)
+{
+    g_autofree uint8_t *buf = NULL;
+    uint64_t nb_records, done, i;
+    int64_t len;
+    int ret;
+
+    len = bdrv_getlength(s->index->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the index");
+        return len;
+    }
+
+    nb_records = MIN(s->nb_clusters,
+                     (len - DEDUP_INDEX_HEADER_SIZE) / DEDUP_DIGEST_SIZE);
+    buf = g_malloc(1 * MiB);
+
+    for (done = 0; done < nb_records; ) {
+        uint64_t n = MIN(nb_records - done, 1 * MiB / DEDUP_DIGEST_SIZE);
+
+        ret = bdrv_pread(s->index,
+                         DEDUP_INDEX_HEADER_SIZE + done * DEDUP_DIGEST_SIZE,
+                         buf, n * DEDUP_DIGEST_SIZE);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the index");
+            return ret;
+        }
+
+        for (i = 0; i < n; i++) {
+            uint8_t *digest = buf + i * DEDUP_DIGEST_SIZE;
+
+            if (!buffer_is_zero(digest, DEDUP_DIGEST_SIZE)) {
+                dedup_insert(s, digest, done + i);
+            }
+        }
+        done += n;
+    }
+
+    /* Records just loaded do not need to be written back */
+    bitmap_zero(s->dirty, s->nb_clusters);
+
+    return 0;
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    ERRP_GUARD();
+    BDRVDedupState *s = bs->opaque;
+    QemuOpts *opts;
+    bool cluster_size_set;
+    int64_t len, index_cluster_size = 0;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    s->index = bdrv_open_child(NULL, options, "index", bs, &child_of_bds,
+                               BDRV_CHILD_METADATA, true, errp);
+    if (*errp) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    cluster_size_set = qemu_opt_get(opts, DEDUP_OPT_CLUSTER_SIZE);
+    s->cluster_size = qemu_opt_get_size(opts, DEDUP_OPT_CLUSTER_SIZE,
+                                        DEDUP_DEFAULT_CLUSTER_SIZE);
+    qemu_opts_del(opts);
+
+    if (s->index) {
+        index_cluster_size = dedup_read_index_header(s, errp);
+        if (index_cluster_size < 0) {
+            return index_cluster_size;
+        }
+        if (index_cluster_size && index_cluster_size != s->cluster_size) {
+            if (cluster_size_set) {
+                error_setg(errp, "The index was created with a cluster size "
+                           "of %" PRId64 " bytes", index_cluster_size);
+                return -EINVAL;
+            }
+            s->cluster_size = index_cluster_size;
+        }
+        if (!index_cluster_size && bdrv_is_read_only(bs)) {
+            error_setg(errp, "Cannot initialize a read-only dedup index");
+            return -EACCES;
+        }
+    }
+
+    if (!is_power_of_2(s->cluster_size) ||
+        s->cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+        s->cluster_size > DEDUP_MAX_CLUSTER_SIZE) {
+        error_setg(errp, "cluster-size must be a power of two between "
+                   "%d and %d", DEDUP_MIN_CLUSTER_SIZE, DEDUP_MAX_CLUSTER_SIZE);
+        return -EINVAL;
+    }
+    s->cluster_bits = ctz32(s->cluster_size);
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the child");
+        return len;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    s->entries = g_hash_table_new_full(dedup_digest_hash, dedup_digest_equal,
+                                       g_free, NULL);
+
+    ret = dedup_resize(s, len);
+    if (ret < 0) {
+        error_setg(errp, "Could not allocate the fingerprint index");
+        return ret;
+    }
+
+    if (s->index) {
+        if (index_cluster_size) {
+            ret = dedup_load_index(s, errp);
+        } else {
+            ret = dedup_write_index_header(s);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not initialize the index");
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    trace_dedup_open(bs, s->cluster_size, s->nb_clusters,
+                     g_hash_table_size(s->entries));
+
+    return 0;
+}
+
+static int dedup_inactivate(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    if (!s->index || bdrv_is_read_only(bs)) {
+        return 0;
+    }
+
+    ret = dedup_write_index(s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return dedup_write_index_header(s);
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    if (s->entries && !(bs->open_flags & BDRV_O_INACTIVE)) {
+        dedup_inactivate(bs);
+    }
+
+    if (s->entries) {
+        g_hash_table_destroy(s->entries);
+    }
+    g_free(s->owner);
+    g_free(s->gen);
+    g_free(s->dirty);
+}
+
+static void dedup_child_perm(BlockDriverState *bs, BdrvChild *c,
+                             BdrvChildRole role,
+                             BlockReopenQueue *reopen_queue,
+                             uint64_t perm, uint64_t shared,
+                             uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    if (role & BDRV_CHILD_FILTERED && perm & BLK_PERM_WRITE) {
+        /*
+         * A cluster must not change between being compared with new data
+         * and being copied, so keep other writers away.
+         */
+        *nshared &= ~BLK_PERM_WRITE;
+    }
+}
+
+static int64_t dedup_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coroutine_fn dedup_co_preadv_part(BlockDriverState *bs,
+                                             int64_t offset, int64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset,
+                                             BdrvRequestFlags flags)
+{
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+static bool dedup_qiov_equal(QEMUIOVector *qiov, size_t qiov_offset,
+                             const uint8_t *buf, size_t bytes)
+{
+    QEMUIOVector slice;
+    size_t done = 0;
+    bool equal = true;
+    int i;
+
+    qemu_iovec_init_slice(&slice, qiov, qiov_offset, bytes);
+    for (i = 0; i < slice.niov && equal; i++) {
+        equal = !memcmp(slice.iov[i].iov_base, buf + done,
+                        slice.iov[i].iov_len);
+        done += slice.iov[i].iov_len;
+    }
+    qemu_iovec_destroy(&slice);
+
+    return equal;
+}
+
+/*
+ * Try to store @cluster, whose data is @qiov at @qiov_offset, by sharing an
+ * existing cluster with the same @digest.  Returns 1 if that worked, 0 if
+ * the data must be written normally and a negative errno on I/O errors.
+ *
+ * Only a copy that the child can do without duplicating the data (e.g. a
+ * reflink) counts; a physical copy would gain nothing over a plain write.
+ *
+ * Called with s->lock held.  The lock is dropped while the candidate
+ * cluster is read and shared; if the candidate is written in the meantime,
+ * whatever was copied may be wrong, so the data is then written normally,
+ * replacing it.
+ */
+static int coroutine_fn dedup_co_share(BlockDriverState *bs, uint64_t cluster,
+                                       const uint8_t *digest,
+                                       QEMUIOVector *qiov, size_t qiov_offset,
+                                       uint8_t *buf)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupEntry key, *e;
+    uint64_t candidate;
+    uint32_t candidate_gen;
+    bool equal = false;
+    int ret;
+
+    memcpy(key.digest, digest, DEDUP_DIGEST_SIZE);
+    e = g_hash_table_lookup(s->entries, &key);
+    if (!e) {
+        return 0;
+    }
+    assert(e->cluster != cluster);
+    candidate = e->cluster;
+    candidate_gen = s->gen[candidate];
+
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_pread(bs->file, candidate << s->cluster_bits,
+                        s->cluster_size, buf, 0);
+    if (ret >= 0) {
+        equal = dedup_qiov_equal(qiov, qiov_offset, buf, s->cluster_size);
+    }
+    if (equal) {
+        ret = bdrv_co_copy_range(bs->file, candidate << s->cluster_bits,
+                                 bs->file, cluster << s->cluster_bits,
+                                 s->cluster_size, 0, BDRV_REQ_NO_FALLBACK);
+    }
+    qemu_co_mutex_lock(&s->lock);
+
+    if (s->gen[candidate] != candidate_gen) {
+        /* The candidate changed under our feet, its entry is gone */
+        return 0;
+    }
+    if (!equal) {
+        if (ret < 0) {
+            return ret;
+        }
+        /* The index is stale, or (very unlikely) two digests collide */
+        trace_dedup_mismatch(bs, candidate, cluster);
+        dedup_forget(s, candidate);
+        return 0;
+    }
+    if (ret < 0) {
+        /* The child cannot share the data, so just write it */
+        return 0;
+    }
+
+    trace_dedup_share(bs, candidate, cluster);
+    return 1;
+}
+
+static int coroutine_fn dedup_co_pwritev_part(BlockDriverState *bs,
+                                              int64_t offset, int64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset,
+                                              BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    int64_t start = QEMU_ALIGN_UP(offset, s->cluster_size);
+    int64_t end = QEMU_ALIGN_DOWN(offset + bytes, s->cluster_size);
+    uint64_t first, nb, i, run_start;
+    g_autofree uint8_t (*digests)[DEDUP_DIGEST_SIZE] = NULL;
+    g_autofree uint32_t *gens = NULL;
+    g_autofree bool *stored = NULL;
+    g_autofree bool *zero = NULL;
+    uint8_t *buf = NULL;
+    bool shared_any = false;
+    int ret = 0;
+
+    /* Only full clusters within the part of the node we track qualify */
+    end = MIN(end, (int64_t)s->nb_clusters << s->cluster_bits);
+    if (start >= end || (flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        dedup_invalidate_range(s, offset, bytes);
+        return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                    qiov_offset, flags);
+    }
+
+    first = start >> s->cluster_bits;
+    nb = (end - start) >> s->cluster_bits;
+    digests = g_new(uint8_t[DEDUP_DIGEST_SIZE], nb);
+    gens = g_new(uint32_t, nb);
+    stored = g_new0(bool, nb);
+    zero = g_new(bool, nb);
+
+    /* Fingerprint outside of the lock, this is the expensive part */
+    for (i = 0; i < nb; i++) {
+        size_t cluster_qiov_offset = qiov_offset + (start - offset) +
+                                     (i << s->cluster_bits);
+        QEMUIOVector local_qiov;
+        g_autofree uint8_t *result = NULL;
+        size_t result_len;
+
+        zero[i] = qemu_iovec_is_zero(qiov, cluster_qiov_offset,
+                                     s->cluster_size);
+        if (zero[i]) {
+            /* Zero clusters are never looked up in the index */
+            continue;
+        }
+
+        qemu_iovec_init_slice(&local_qiov, qiov, cluster_qiov_offset,
+                              s->cluster_size);
+        ret = qcrypto_hash_bytesv(DEDUP_DIGEST_ALG, local_qiov.iov,
+                                  local_qiov.niov, &result, &result_len,
+                                  NULL);
+        qemu_iovec_destroy(&local_qiov);
+        if (ret < 0) {
+            /* No fingerprinting available, write everything as-is */
+            dedup_invalidate_range(s, offset, bytes);
+            return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                        qiov_offset, flags);
+        }
+        assert(result_len == DEDUP_DIGEST_SIZE);
+        memcpy(digests[i], result, DEDUP_DIGEST_SIZE);
+    }
+
+    /* Head and tail partial clusters are written normally */
+    dedup_invalidate_range(s, offset, start - offset);
+    dedup_invalidate_range(s, end, offset + bytes - end);
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb; i++) {
+        uint64_t cluster = first + i;
+        size_t cluster_qiov_offset = qiov_offset + (start - offset) +
+                                     (i << s->cluster_bits);
+
+        dedup_invalidate(s, cluster);
+        gens[i] = s->gen[cluster];
+        s->clusters_written++;
+
+        if (zero[i]) {
+            continue;
+        }
+
+        ret = dedup_co_share(bs, cluster, digests[i], qiov,
+                             cluster_qiov_offset, buf);
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto out;
+        }
+        if (ret > 0) {
+            stored[i] = true;
+            shared_any = true;
+            s->clusters_deduplicated++;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Write the head and every run of clusters that could not be shared */
+    if (start > offset) {
+        ret = bdrv_co_pwritev_part(bs->file, offset, start - offset, qiov,
+                                   qiov_offset, flags);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nb; i = run_start) {
+        size_t run_qiov_offset;
+        uint64_t run_end;
+
+        for (run_start = i; run_start < nb && stored[run_start]; run_start++) {
+            /* skip clusters that were shared */
+        }
+        if (run_start == nb) {
+            break;
+        }
+
+        run_qiov_offset = qiov_offset + (start - offset) +
+                          (run_start << s->cluster_bits);
+        for (run_end = run_start + 1; run_end < nb && !stored[run_end] &&
+             zero[run_end] == zero[run_start];
+             run_end++)
+        {
+            /* extend the run */
+        }
+
+        if (zero[run_start]) {
+            /* All-zero data is best stored by not allocating it at all */
+            ret = bdrv_co_pwrite_zeroes(bs->file,
+                                        (first + run_start) << s->cluster_bits,
+                                        (run_end - run_start) <<
+                                        s->cluster_bits,
+                                        BDRV_REQ_MAY_UNMAP |
+                                        (flags & BDRV_REQ_FUA));
+            if (ret >= 0) {
+                qemu_co_mutex_lock(&s->lock);
+                s->zero_clusters += run_end - run_start;
+                qemu_co_mutex_unlock(&s->lock);
+            }
+        } else {
+            ret = bdrv_co_pwritev_part(bs->file,
+                                       (first + run_start) << s->cluster_bits,
+                                       (run_end - run_start) << s->cluster_bits,
+                                       qiov, run_qiov_offset, flags);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (!zero[run_start]) {
+            uint64_t j;
+
+            qemu_co_mutex_lock(&s->lock);
+            for (j = run_start; j < run_end; j++) {
+                uint64_t cluster = first + j;
+
+                if (s->gen[cluster] == gens[j] && !s->owner[cluster]) {
+                    dedup_insert(s, digests[j], cluster);
+                }
+            }
+            qemu_co_mutex_unlock(&s->lock);
+        }
+        run_start = run_end;
+    }
+
+    if (end < offset + bytes) {
+        ret = bdrv_co_pwritev_part(bs->file, end, offset + bytes - end, qiov,
+                                   qiov_offset + (end - offset), flags);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (shared_any && (flags & BDRV_REQ_FUA)) {
+        ret = bdrv_co_flush(bs->file->bs);
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn dedup_co_pwrite_zeroes(BlockDriverState *bs,
+                                               int64_t offset, int64_t bytes,
+                                               BdrvRequestFlags flags)
+{
+    dedup_invalidate_range(bs->opaque, offset, bytes);
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn dedup_co_pdiscard(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes)
+{
+    dedup_invalidate_range(bs->opaque, offset, bytes);
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn dedup_co_truncate(BlockDriverState *bs, int64_t offset,
+                                          bool exact, PreallocMode prealloc,
+                                          BdrvRequestFlags flags, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    int64_t len;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the child");
+        return len;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_resize(s, len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        error_setg(errp, "Could not resize the fingerprint index");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn dedup_co_flush(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_write_index(s);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+    if (s->index) {
+        ret = bdrv_co_flush(s->index->bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static BlockStatsSpecific *dedup_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificDedup *d = &stats->u.dedup;
+    uint64_t stored;
+
+    stats->driver = BLOCKDEV_DRIVER_DEDUP;
+
+    d->clusters_written = s->clusters_written;
+    d->clusters_deduplicated = s->clusters_deduplicated;
+    d->zero_clusters = s->zero_clusters;
+
+    /* Logical clusters written per cluster that actually took up space */
+    stored = s->clusters_written - s->clusters_deduplicated -
+             s->zero_clusters;
+    d->dedup_ratio = s->clusters_written ?
+                     (double)s->clusters_written / MAX(stored, 1) : 1.0;
+
+    d->index_entries = g_hash_table_size(s->entries);
+    /* Per-entry cost includes the GHashTable's key, value and hash slots */
+    d->index_memory = d->index_entries * (sizeof(DedupEntry) +
+                                          2 * sizeof(gpointer) +
+                                          sizeof(guint)) +
+                      s->nb_clusters * (sizeof(*s->owner) + sizeof(*s->gen)) +
+                      (s->dirty ? BITS_TO_LONGS(s->nb_clusters) *
+                                  sizeof(unsigned long) : 0);
+
+    return stats;
+}
+
+static void dedup_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void dedup_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static const char *const dedup_strong_runtime_opts[] = {
+    DEDUP_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name                        = "dedup",
+    .instance_size                      = sizeof(BDRVDedupState),
+
+    .bdrv_open                          = dedup_open,
+    .bdrv_close                         = dedup_close,
+    .bdrv_inactivate                    = dedup_inactivate,
+    .bdrv_child_perm                    = dedup_child_perm,
+
+    .bdrv_getlength                     = dedup_getlength,
+
+    .bdrv_co_preadv_part                = dedup_co_preadv_part,
+    .bdrv_co_pwritev_part               = dedup_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = dedup_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = dedup_co_pdiscard,
+    .bdrv_co_truncate                   = dedup_co_truncate,
+    .bdrv_co_flush                      = dedup_co_flush,
+
+    .bdrv_get_specific_stats            = dedup_get_specific_stats,
+
+    .bdrv_eject                         = dedup_eject,
+    .bdrv_lock_medium                   = dedup_lock_medium,
+
+    .strong_runtime_opts                = dedup_strong_runtime_opts,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
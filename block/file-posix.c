@@ -211,6 +211,7 @@ typedef struct RawPosixAIOData {
         struct {
             int aio_fd2;
             off_t aio_offset2;
+            bool clone;
         } copy_range;
         struct {
             PreallocMode prealloc;
@@ -1801,6 +1802,42 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+/*
+ * Make the destination range share the extents of the source range, without
+ * copying any data.  Returns -ENOTSUP if the file system cannot do that.
+ */
+static int handle_aiocb_clone_range(RawPosixAIOData *aiocb)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range range = {
+        .src_fd = aiocb->aio_fildes,
+        .src_offset = aiocb->aio_offset,
+        .src_length = aiocb->aio_nbytes,
+        .dest_offset = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        switch (errno) {
+        case EOPNOTSUPP:
+        case EXDEV:
+        case EINVAL:
+        case ENOTTY:
+            return -ENOTSUP;
+        default:
+            return -errno;
+        }
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -1808,6 +1845,10 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+    if (aiocb->copy_range.clone) {
+        return handle_aiocb_clone_range(aiocb);
+    }
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -3083,6 +3124,17 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int raw_get_host_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* O_DIRECT descriptors cannot be read at arbitrary offsets */
+    if (bdrv_is_sg(bs) || s->needs_alignment) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -3276,6 +3328,11 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
         .copy_range     = {
             .aio_fd2        = s->fd,
             .aio_offset2    = dst_offset,
+            /*
+             * copy_file_range() may copy the data, which is the slow
+             * fallback that BDRV_REQ_NO_FALLBACK rules out
+             */
+            .clone          = write_flags & BDRV_REQ_NO_FALLBACK,
         },
     };
 
@@ -3316,6 +3373,7 @@ BlockDriver bdrv_file = {
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = raw_get_specific_stats,
@@ -3688,6 +3746,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = hdev_get_specific_stats,
@@ -981,6 +981,33 @@ bool coroutine_fn bdrv_make_request_serialising(BdrvTrackedRequest *req,
     return waited;
 }
 
+/*
+ * Keep writes, discards and truncations that overlap [@offset, @offset +
+ * @bytes) of @bs (rounded to the cluster size) from running until
+ * bdrv_co_unlock_range() is called on @req.  This is meant for users that
+ * access the data of the range below the block layer, e.g. through the host
+ * file descriptor, and must not see it change or be reallocated meanwhile.
+ */
+void coroutine_fn bdrv_co_lock_range(BlockDriverState *bs,
+                                     BdrvTrackedRequest *req,
+                                     int64_t offset, int64_t bytes)
+{
+    IO_CODE();
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_make_request_serialising(req, bdrv_get_cluster_size(bs));
+}
+
+void coroutine_fn bdrv_co_unlock_range(BdrvTrackedRequest *req)
+{
+    BlockDriverState *bs = req->bs;
+    IO_CODE();
+
+    tracked_request_end(req);
+    bdrv_dec_in_flight(bs);
+}
+
 int bdrv_check_qiov_request(int64_t offset, int64_t bytes,
                             QEMUIOVector *qiov, size_t qiov_offset,
                             Error **errp)
@@ -3387,9 +3414,8 @@ static int coroutine_fn bdrv_co_copy_range_internal(
     BdrvTrackedRequest req;
     int ret;
 
-    /* TODO We can support BDRV_REQ_NO_FALLBACK here */
+    /* BDRV_REQ_NO_FALLBACK is passed on to the driver in @write_flags */
     assert(!(read_flags & BDRV_REQ_NO_FALLBACK));
-    assert(!(write_flags & BDRV_REQ_NO_FALLBACK));
     assert(!(read_flags & BDRV_REQ_NO_WAIT));
     assert(!(write_flags & BDRV_REQ_NO_WAIT));
 
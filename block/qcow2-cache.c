@@ -445,6 +445,11 @@ void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
     return NULL;
 }
 
+int qcow2_cache_get_num_tables(Qcow2Cache *c)
+{
+    return c->size;
+}
+
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
@@ -741,6 +741,187 @@ fail:
     return ret;
 }
 
+/*
+ * Loads the L2 slice that maps the guest @offset into the L2 cache, unless
+ * it is cached already or not allocated at all.
+ *
+ * Invalid L1 entries are silently skipped; they are reported by the request
+ * that actually needs them.
+ *
+ * Must be called with s->lock held.
+ */
+static int coroutine_fn qcow2_co_load_l2_slice(BlockDriverState *bs,
+                                               uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    int start_of_slice;
+    int ret;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return 0;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    if (qcow2_cache_is_table_offset(s->l2_table_cache,
+                                    l2_offset + start_of_slice)) {
+        return 0;
+    }
+
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
+typedef struct Qcow2L2PrefetchCo {
+    BlockDriverState *bs;
+    uint64_t offset;
+} Qcow2L2PrefetchCo;
+
+static void coroutine_fn qcow2_co_l2_prefetch_entry(void *opaque)
+{
+    Qcow2L2PrefetchCo *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_co_load_l2_slice(bs, p->offset);
+    qemu_co_mutex_unlock(&s->lock);
+
+    trace_qcow2_l2_prefetch_done(bs, p->offset, ret);
+
+    bdrv_dec_in_flight(bs);
+    g_free(p);
+}
+
+/*
+ * qcow2_l2_readahead
+ *
+ * Feeds the guest request [@offset, @offset + @bytes) to the access pattern
+ * detector. Once enough requests in a row were sequential or had the same
+ * stride, the L2 slice that the stream is going to need next is loaded in
+ * the background, so that the stream does not stall on metadata I/O when
+ * it crosses the slice boundary.
+ */
+void coroutine_fn qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2L2Readahead *ra = &s->l2_readahead;
+    uint64_t slice_bytes = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    int64_t stride = offset - ra->last_offset;
+    uint64_t next;
+    Qcow2L2PrefetchCo *p;
+    Coroutine *co;
+
+    if (!s->l2_prefetch || !bytes) {
+        return;
+    }
+
+    if (offset == ra->last_end || (stride > 0 && stride == ra->stride)) {
+        if (ra->hits < QCOW2_L2_READAHEAD_THRESHOLD) {
+            ra->hits++;
+        }
+    } else {
+        ra->hits = 0;
+    }
+    ra->stride = stride;
+    ra->last_offset = offset;
+    ra->last_end = offset + bytes;
+
+    if (ra->hits < QCOW2_L2_READAHEAD_THRESHOLD) {
+        return;
+    }
+
+    /*
+     * Prefetch the slice the next request is expected to hit, but at least
+     * the one following the current slice
+     */
+    next = QEMU_ALIGN_DOWN(offset + MAX(stride, (int64_t) bytes), slice_bytes);
+    next = MAX(next, QEMU_ALIGN_DOWN(offset, slice_bytes) + slice_bytes);
+    if (next == ra->next_slice || next >= bs->total_sectors * BDRV_SECTOR_SIZE) {
+        return;
+    }
+    ra->next_slice = next;
+
+    trace_qcow2_l2_prefetch(bs, next);
+
+    p = g_new(Qcow2L2PrefetchCo, 1);
+    *p = (Qcow2L2PrefetchCo) {
+        .bs = bs,
+        .offset = next,
+    };
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_co_l2_prefetch_entry, p);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+static void coroutine_fn qcow2_co_l2_warmup_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    uint64_t offset = s->l2_warmup_offset;
+    uint64_t end = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int max_slices = qcow2_cache_get_num_tables(s->l2_table_cache);
+    int i;
+    int ret = 0;
+
+    if (offset < end) {
+        end = MIN(end, offset + MIN(s->l2_warmup_size, end - offset));
+    }
+
+    /*
+     * Take the lock for each slice, so that guest requests are not held
+     * up behind the whole warm-up.
+     */
+    offset = QEMU_ALIGN_DOWN(offset, slice_bytes);
+    for (i = 0; offset < end && i < max_slices; offset += slice_bytes, i++) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_co_load_l2_slice(bs, offset);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    trace_qcow2_l2_warmup(bs, offset, i, ret);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * qcow2_l2_warmup
+ *
+ * Starts loading the L2 slices that map the guest range set with the
+ * l2-warmup-offset and l2-warmup-size options into the L2 cache. Loading
+ * happens in the background and stops early once the cache is full, as
+ * anything beyond that would only evict slices that were just loaded.
+ *
+ * This is only an optimization: errors stop the warm-up, but are otherwise
+ * left for the guest requests that need the same L2 slices to report.
+ */
+void qcow2_l2_warmup(BlockDriverState *bs)
+{
+    Coroutine *co;
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_co_l2_warmup_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
 /*
  * get_cluster_table
  *
@@ -2285,6 +2285,16 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* compression dictionary */
+    if (s->compression_dict_header.length) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->compression_dict_header.offset,
+                                       s->compression_dict_header.length);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
@@ -3037,6 +3047,16 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
+    if ((chk & QCOW2_OL_COMPRESSION_DICT) &&
+        s->compression_dict_header.length)
+    {
+        if (overlaps_with(s->compression_dict_header.offset,
+                          s->compression_dict_header.length))
+        {
+            return QCOW2_OL_COMPRESSION_DICT;
+        }
+    }
+
     return 0;
 }
 
@@ -3050,6 +3070,7 @@ static const char *metadata_ol_names[] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]        = "inactive L1 table",
     [QCOW2_OL_INACTIVE_L2_BITNR]        = "inactive L2 table",
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR]   = "bitmap directory",
+    [QCOW2_OL_COMPRESSION_DICT_BITNR]   = "compression dictionary",
 };
 QEMU_BUILD_BUG_ON(QCOW2_OL_MAX_BITNR != ARRAY_SIZE(metadata_ol_names));
 
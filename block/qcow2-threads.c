@@ -33,6 +33,7 @@
 #include <zstd_errors.h>
 #endif
 
+#include "qapi/error.h"
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
@@ -66,9 +67,11 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  * Compression
  */
 
-typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+typedef ssize_t (*Qcow2CompressFunc)(BDRVQcow2State *s,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size);
 typedef struct Qcow2CompressData {
+    BDRVQcow2State *s;
     void *dest;
     size_t dest_size;
     const void *src;
@@ -83,6 +86,7 @@ typedef struct Qcow2CompressData {
  *
  * Compress @src_size bytes of data using zlib compression method
  *
+ * @s - image state (unused by zlib)
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
@@ -90,7 +94,8 @@ typedef struct Qcow2CompressData {
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+static ssize_t qcow2_zlib_compress(BDRVQcow2State *s,
+                                   void *dest, size_t dest_size,
                                    const void *src, size_t src_size)
 {
     ssize_t ret;
@@ -131,13 +136,15 @@ static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
  * Decompress some data (not more than @src_size bytes) to produce exactly
  * @dest_size bytes using zlib compression method
  *
+ * @s - image state (unused by zlib)
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
  * Returns: 0 on success
  *          -EIO on fail
  */
-static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+static ssize_t qcow2_zlib_decompress(BDRVQcow2State *s,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size)
 {
     int ret;
@@ -174,19 +181,28 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
 #ifdef CONFIG_ZSTD
 
 /*
- * qcow2_zstd_compress()
+ * Compression level used for clusters of images with a dictionary when the
+ * dictionary does not pay off for a cluster
+ */
+#define QCOW2_ZSTD_FAST_LEVEL 1
+
+/*
+ * qcow2_zstd_compress_frame()
  *
- * Compress @src_size bytes of data using zstd compression method
+ * Compress @src_size bytes of data into a single zstd frame
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @cdict - digested dictionary to compress with, or NULL
+ * @level - compression level, ignored if @cdict is given
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+static ssize_t qcow2_zstd_compress_frame(void *dest, size_t dest_size,
+                                         const void *src, size_t src_size,
+                                         const ZSTD_CDict *cdict, int level)
 {
     ssize_t ret;
     size_t zstd_ret;
@@ -205,6 +221,17 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
     if (!cctx) {
         return -EIO;
     }
+
+    if (cdict) {
+        zstd_ret = ZSTD_CCtx_refCDict(cctx, cdict);
+    } else {
+        zstd_ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    }
+    if (ZSTD_isError(zstd_ret)) {
+        ret = -EIO;
+        goto out;
+    }
+
     /*
      * Use the zstd streamed interface for symmetry with decompression,
      * where streaming is essential since we don't record the exact
@@ -241,21 +268,80 @@ out:
     return ret;
 }
 
+/*
+ * qcow2_zstd_compress()
+ *
+ * Compress @src_size bytes of data using zstd compression method
+ *
+ * If the image has a compression dictionary, the cluster is compressed both
+ * with the dictionary and with a fast level without it, and the smaller
+ * frame is kept.  Clusters that compress well on their own thus do not pay
+ * the dictionary's cost on decompression, while small clusters that look
+ * alike benefit from the shared context.
+ *
+ * @s - image state
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+static ssize_t qcow2_zstd_compress(BDRVQcow2State *s,
+                                   void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    g_autofree void *dict_buf = NULL;
+    ssize_t ret, dict_ret;
+
+    if (!s->zstd_cdict) {
+        return qcow2_zstd_compress_frame(dest, dest_size, src, src_size,
+                                         NULL, ZSTD_CLEVEL_DEFAULT);
+    }
+
+    ret = qcow2_zstd_compress_frame(dest, dest_size, src, src_size,
+                                    NULL, QCOW2_ZSTD_FAST_LEVEL);
+    if (ret == -EIO) {
+        return ret;
+    }
+
+    dict_buf = g_malloc(dest_size);
+    dict_ret = qcow2_zstd_compress_frame(dict_buf, dest_size, src, src_size,
+                                         s->zstd_cdict, 0);
+    if (dict_ret == -EIO) {
+        return dict_ret;
+    }
+
+    if (dict_ret >= 0 && (ret < 0 || dict_ret < ret)) {
+        memcpy(dest, dict_buf, dict_ret);
+        ret = dict_ret;
+    }
+
+    return ret;
+}
+
 /*
  * qcow2_zstd_decompress()
  *
  * Decompress some data (not more than @src_size bytes) to produce exactly
  * @dest_size bytes using zstd compression method
  *
+ * Frames that carry a dictionary ID are decompressed with the image
+ * compression dictionary.
+ *
+ * @s - image state
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
  *
  * Returns: 0 on success
  *          -EIO on any error
  */
-static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+static ssize_t qcow2_zstd_decompress(BDRVQcow2State *s,
+                                     void *dest, size_t dest_size,
                                      const void *src, size_t src_size)
 {
+    unsigned dict_id = ZSTD_getDictID_fromFrame(src, src_size);
+
     size_t zstd_ret = 0;
     ssize_t ret = 0;
     ZSTD_outBuffer output = {
@@ -274,6 +360,14 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
         return -EIO;
     }
 
+    if (dict_id) {
+        if (!s->zstd_ddict || dict_id != s->compression_dict_id ||
+            ZSTD_isError(ZSTD_DCtx_refDDict(dctx, s->zstd_ddict))) {
+            ZSTD_freeDCtx(dctx);
+            return -EIO;
+        }
+    }
+
     /*
      * The compressed stream from the input buffer may consist of more
      * than one zstd frame. So we iterate until we get a fully
@@ -329,7 +423,7 @@ static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
-    data->ret = data->func(data->dest, data->dest_size,
+    data->ret = data->func(data->s, data->dest, data->dest_size,
                            data->src, data->src_size);
 
     return 0;
@@ -340,6 +434,7 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
     Qcow2CompressData arg = {
+        .s = bs->opaque,
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
@@ -425,6 +520,71 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
     return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
+/*
+ * qcow2_compression_dict_init()
+ *
+ * Digest the image compression dictionary so that it can be shared by
+ * all compression and decompression threads
+ *
+ * @s - image state
+ * @dict - dictionary content, @dict_size bytes
+ *
+ * Returns: 0 on success
+ *          -EINVAL if the dictionary is not usable with the image
+ *          -ENOMEM if the dictionary could not be loaded
+ */
+int qcow2_compression_dict_init(BDRVQcow2State *s, const void *dict,
+                                size_t dict_size, Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    unsigned dict_id;
+
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "Compression dictionaries are only supported with "
+                   "the zstd compression type");
+        return -EINVAL;
+    }
+
+    /*
+     * Frames compressed with a dictionary are told apart from plain ones by
+     * the dictionary ID, so a raw content dictionary (which has none) will
+     * not do.
+     */
+    dict_id = ZSTD_getDictID_fromDict(dict, dict_size);
+    if (!dict_id) {
+        error_setg(errp, "Compression dictionary is not a zstd dictionary");
+        return -EINVAL;
+    }
+
+    qcow2_compression_dict_cleanup(s);
+
+    s->zstd_cdict = ZSTD_createCDict(dict, dict_size, ZSTD_CLEVEL_DEFAULT);
+    s->zstd_ddict = ZSTD_createDDict(dict, dict_size);
+    if (!s->zstd_cdict || !s->zstd_ddict) {
+        qcow2_compression_dict_cleanup(s);
+        error_setg(errp, "Could not load compression dictionary");
+        return -ENOMEM;
+    }
+    s->compression_dict_id = dict_id;
+
+    return 0;
+#else
+    error_setg(errp, "Compression dictionaries require zstd support");
+    return -EINVAL;
+#endif
+}
+
+void qcow2_compression_dict_cleanup(BDRVQcow2State *s)
+{
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCDict(s->zstd_cdict);
+    ZSTD_freeDDict(s->zstd_ddict);
+#endif
+    s->zstd_cdict = NULL;
+    s->zstd_ddict = NULL;
+    s->compression_dict_id = 0;
+}
+
 
 /*
  * Cryptography
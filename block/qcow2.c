@@ -72,6 +72,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION_DICT 0x7a646963
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -428,6 +429,69 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_DICT:
+        {
+            g_autofree void *dict = NULL;
+
+            if (ext.len != sizeof(s->compression_dict_header)) {
+                error_setg(errp, "Compression dictionary header extension "
+                           "size %u, but expected size %zu", ext.len,
+                           sizeof(s->compression_dict_header));
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &s->compression_dict_header,
+                             ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read compression "
+                                 "dictionary header extension");
+                return ret;
+            }
+            s->compression_dict_header.offset =
+                be64_to_cpu(s->compression_dict_header.offset);
+            s->compression_dict_header.length =
+                be64_to_cpu(s->compression_dict_header.length);
+
+            if (offset_into_cluster(s, s->compression_dict_header.offset)) {
+                error_setg(errp, "Compression dictionary offset '%" PRIu64
+                           "' is not a multiple of cluster size '%u'",
+                           s->compression_dict_header.offset,
+                           s->cluster_size);
+                return -EINVAL;
+            }
+
+            if (s->compression_dict_header.length == 0 ||
+                s->compression_dict_header.length >
+                QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+                error_setg(errp, "Compression dictionary size %" PRIu64
+                           " is invalid (must be between 1 and %d bytes)",
+                           s->compression_dict_header.length,
+                           QCOW2_MAX_COMPRESSION_DICT_SIZE);
+                return -EINVAL;
+            }
+
+            dict = g_malloc(s->compression_dict_header.length);
+            ret = bdrv_pread(bs->file, s->compression_dict_header.offset,
+                             dict, s->compression_dict_header.length);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret,
+                                 "Could not read compression dictionary");
+                return ret;
+            }
+
+            ret = qcow2_compression_dict_init(s, dict,
+                                              s->compression_dict_header.length,
+                                              errp);
+            if (ret < 0) {
+                return ret;
+            }
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got compression dictionary id %" PRIu32 "\n",
+                   s->compression_dict_id);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -693,11 +757,13 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_OVERLAP_INACTIVE_L1,
     QCOW2_OPT_OVERLAP_INACTIVE_L2,
     QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
     QCOW2_OPT_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_L2_PREFETCH,
     NULL
 };
 
@@ -783,6 +849,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into the bitmap directory",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the compression "
+                    "dictionary",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -809,6 +881,23 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_L2_PREFETCH,
+            .type = QEMU_OPT_BOOL,
+            .help = "Load L2 tables ahead of sequential or strided requests",
+        },
+        {
+            .name = QCOW2_OPT_L2_WARMUP_OFFSET,
+            .type = QEMU_OPT_SIZE,
+            .help = "Start of the guest range whose L2 tables are loaded "
+                    "on open",
+        },
+        {
+            .name = QCOW2_OPT_L2_WARMUP_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the guest range whose L2 tables are loaded "
+                    "on open",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -825,6 +914,7 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L2,
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    [QCOW2_OL_COMPRESSION_DICT_BITNR] = QCOW2_OPT_OVERLAP_COMPRESSION_DICT,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -970,6 +1060,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    bool l2_prefetch;
+    uint64_t l2_warmup_offset;
+    uint64_t l2_warmup_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1071,6 +1164,12 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* L2 table readahead and warm-up */
+    r->l2_prefetch = qemu_opt_get_bool(opts, QCOW2_OPT_L2_PREFETCH, false);
+    r->l2_warmup_offset = qemu_opt_get_size(opts, QCOW2_OPT_L2_WARMUP_OFFSET,
+                                            0);
+    r->l2_warmup_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_WARMUP_SIZE, 0);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1216,6 +1315,11 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
 
+    s->l2_prefetch = r->l2_prefetch;
+    s->l2_readahead = (Qcow2L2Readahead) {};
+    s->l2_warmup_offset = r->l2_warmup_offset;
+    s->l2_warmup_size = r->l2_warmup_size;
+
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
     }
@@ -1664,6 +1768,13 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    if ((s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION_DICT) &&
+        !s->zstd_ddict) {
+        error_setg(errp, "Missing compression dictionary");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* qcow2_read_extension may have set up the crypto context
      * if the crypt method needs a header region, some methods
      * don't need header extensions, so must check here
@@ -1838,6 +1949,11 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 
     qemu_co_queue_init(&s->thread_task_queue);
 
+    /* Preload the L2 tables of the requested range */
+    if (s->l2_warmup_size && !(flags & BDRV_O_INACTIVE)) {
+        qcow2_l2_warmup(bs);
+    }
+
     return ret;
 
  fail:
@@ -1862,6 +1978,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
+    qcow2_compression_dict_cleanup(s);
     return ret;
 }
 
@@ -2327,6 +2444,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
+    qcow2_l2_readahead(bs, offset, bytes);
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
@@ -2615,6 +2734,8 @@ static coroutine_fn int qcow2_co_pwritev_part(
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
+    qcow2_l2_readahead(bs, offset, bytes);
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
         l2meta = NULL;
@@ -2737,6 +2858,8 @@ static void qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
 
+    qcow2_compression_dict_cleanup(s);
+
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
@@ -2964,6 +3087,21 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression dictionary pointer extension */
+    if (s->compression_dict_header.offset != 0) {
+        Qcow2CompressionDictHeaderExtension dict_header = {
+            .offset = cpu_to_be64(s->compression_dict_header.offset),
+            .length = cpu_to_be64(s->compression_dict_header.length),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_DICT,
+                             &dict_header, sizeof(dict_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /*
      * Feature table.  A mere 8 feature names occupies 392 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
@@ -2999,6 +3137,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
+                .name = "compression dictionary",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3163,6 +3306,83 @@ static int qcow2_set_up_encryption(BlockDriverState *bs,
     return ret;
 }
 
+static int qcow2_set_up_compression_dict(BlockDriverState *bs,
+                                         BlockDriverState *dict_bs,
+                                         Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockBackend *dict_blk;
+    g_autofree char *dict = NULL;
+    int64_t dict_size;
+    int64_t offset;
+    int64_t clusterlen;
+    int ret;
+
+    dict_size = bdrv_getlength(dict_bs);
+    if (dict_size < 0) {
+        error_setg_errno(errp, -dict_size, "Could not get the size of the "
+                         "compression dictionary");
+        return dict_size;
+    }
+
+    if (dict_size == 0 || dict_size > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+        error_setg(errp, "Compression dictionary size %" PRId64 " is invalid "
+                   "(must be between 1 and %d bytes)",
+                   dict_size, QCOW2_MAX_COMPRESSION_DICT_SIZE);
+        return -EINVAL;
+    }
+
+    dict_blk = blk_new_with_bs(dict_bs, BLK_PERM_CONSISTENT_READ, BLK_PERM_ALL,
+                               errp);
+    if (!dict_blk) {
+        return -EPERM;
+    }
+    dict = g_malloc(dict_size);
+    ret = blk_pread(dict_blk, 0, dict, dict_size);
+    blk_unref(dict_blk);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read compression dictionary");
+        return ret;
+    }
+
+    /* Make sure the dictionary is usable before committing it to the image */
+    ret = qcow2_compression_dict_init(s, dict, dict_size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    offset = qcow2_alloc_clusters(bs, dict_size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Cannot allocate clusters for "
+                         "compression dictionary");
+        return offset;
+    }
+
+    clusterlen = size_to_clusters(s, dict_size) * s->cluster_size;
+    assert(qcow2_pre_write_overlap_check(bs, 0, offset, clusterlen,
+                                         false) == 0);
+    ret = bdrv_pwrite_zeroes(bs->file, offset, clusterlen, 0);
+    if (ret >= 0) {
+        ret = bdrv_pwrite(bs->file, offset, dict, dict_size);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write compression dictionary");
+        return ret;
+    }
+
+    s->compression_dict_header.offset = offset;
+    s->compression_dict_header.length = dict_size;
+    s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION_DICT;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        return ret;
+    }
+
+    return 0;
+}
+
 /**
  * Preallocates metadata structures for data clusters between @offset (in the
  * guest disk) and @new_length (which is thus generally the new guest disk
@@ -3616,6 +3836,14 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         compression_type = qcow2_opts->compression_type;
     }
 
+    if (qcow2_opts->compression_dict &&
+        compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression dictionaries are only supported with "
+                   "the zstd compression type");
+        ret = -EINVAL;
+        goto out;
+    }
+
     /* Create BlockBackend to write to the image */
     blk = blk_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
                           errp);
@@ -3766,6 +3994,22 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         }
     }
 
+    /* Want a shared compression dictionary? There you go. */
+    if (qcow2_opts->compression_dict) {
+        BlockDriverState *dict_bs;
+
+        dict_bs = bdrv_open_blockdev_ref(qcow2_opts->compression_dict, errp);
+        if (dict_bs == NULL) {
+            ret = -EIO;
+            goto out;
+        }
+        ret = qcow2_set_up_compression_dict(blk_bs(blk), dict_bs, errp);
+        bdrv_unref(dict_bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     blk_unref(blk);
     blk = NULL;
 
@@ -3807,6 +4051,7 @@ static int coroutine_fn qcow2_co_create_opts(BlockDriver *drv,
     Visitor *v;
     BlockDriverState *bs = NULL;
     BlockDriverState *data_bs = NULL;
+    BlockDriverState *dict_bs = NULL;
     const char *val;
     int ret;
 
@@ -3892,6 +4137,19 @@ static int coroutine_fn qcow2_co_create_opts(BlockDriver *drv,
         qdict_put_str(qdict, "data-file", data_bs->node_name);
     }
 
+    /* Open the compression dictionary (protocol layer, read-only) */
+    val = qdict_get_try_str(qdict, BLOCK_OPT_COMPRESSION_DICT);
+    if (val) {
+        dict_bs = bdrv_open(val, NULL, NULL, BDRV_O_PROTOCOL, errp);
+        if (dict_bs == NULL) {
+            ret = -EIO;
+            goto finish;
+        }
+
+        qdict_del(qdict, BLOCK_OPT_COMPRESSION_DICT);
+        qdict_put_str(qdict, "compression-dict", dict_bs->node_name);
+    }
+
     /* Set 'driver' and 'node' options */
     qdict_put_str(qdict, "driver", "qcow2");
     qdict_put_str(qdict, "file", bs->node_name);
@@ -3927,6 +4185,7 @@ finish:
     qobject_unref(qdict);
     bdrv_unref(bs);
     bdrv_unref(data_bs);
+    bdrv_unref(dict_bs);
     qapi_free_BlockdevCreateOptions(create_options);
     return ret;
 }
@@ -4919,11 +5178,13 @@ static int qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
+        !s->compression_dict_header.length &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
+         * LUKS header, compression dictionary or persistent bitmaps),
+         * because it completely
          * empties the image.  Furthermore, the L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. It
@@ -6006,6 +6267,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Compression method used for image cluster "        \
                     "compression",                                      \
             .def_value_str = "zlib"                                     \
+        },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_COMPRESSION_DICT,                         \
+            .type = QEMU_OPT_STRING,                                    \
+            .help = "File name of a zstd dictionary shared by "         \
+                    "compressed clusters",                              \
         },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
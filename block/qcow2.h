@@ -64,6 +64,9 @@
 /* Maximum amount of extra data per snapshot table entry to accept */
 #define QCOW_MAX_SNAPSHOT_EXTRA_DATA 1024
 
+/* Maximum size of a compression dictionary we are willing to load */
+#define QCOW2_MAX_COMPRESSION_DICT_SIZE (1 * MiB)
+
 /* Bitmap header extension constraints */
 #define QCOW2_MAX_BITMAPS 65535
 #define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
@@ -144,11 +147,15 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY "overlap-check.bitmap-directory"
+#define QCOW2_OPT_OVERLAP_COMPRESSION_DICT "overlap-check.compression-dict"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_L2_PREFETCH "l2-prefetch"
+#define QCOW2_OPT_L2_WARMUP_OFFSET "l2-warmup-offset"
+#define QCOW2_OPT_L2_WARMUP_SIZE "l2-warmup-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -235,6 +242,11 @@ typedef struct Qcow2CryptoHeaderExtension {
     uint64_t length;
 } QEMU_PACKED Qcow2CryptoHeaderExtension;
 
+typedef struct Qcow2CompressionDictHeaderExtension {
+    uint64_t offset;
+    uint64_t length;
+} QEMU_PACKED Qcow2CompressionDictHeaderExtension;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -255,17 +267,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION_DICT = 1 << QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_COMPRESSION_DICT,
 };
 
 /* Compatible feature bits */
@@ -323,6 +338,20 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+/*
+ * Number of consecutive requests that must follow the same sequential or
+ * strided pattern before the next L2 slice is loaded ahead of time
+ */
+#define QCOW2_L2_READAHEAD_THRESHOLD 3
+
+typedef struct Qcow2L2Readahead {
+    uint64_t last_offset;   /* start of the previous request */
+    uint64_t last_end;      /* end of the previous request */
+    int64_t stride;         /* distance between the last two requests */
+    unsigned int hits;      /* consecutive requests following the pattern */
+    uint64_t next_slice;    /* guest offset of the last prefetched slice */
+} Qcow2L2Readahead;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -347,6 +376,11 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    bool l2_prefetch;
+    Qcow2L2Readahead l2_readahead;
+    uint64_t l2_warmup_offset;
+    uint64_t l2_warmup_size;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -419,6 +453,16 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /*
+     * Optional zstd dictionary shared by all compressed clusters.  The
+     * dictionary is loaded on open and digested once into compression
+     * and decompression contexts that are used by the worker threads.
+     */
+    Qcow2CompressionDictHeaderExtension compression_dict_header;
+    uint32_t compression_dict_id;
+    struct ZSTD_CDict_s *zstd_cdict;
+    struct ZSTD_DDict_s *zstd_ddict;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -554,8 +598,9 @@ typedef enum QCow2MetadataOverlap {
     QCOW2_OL_INACTIVE_L1_BITNR      = 6,
     QCOW2_OL_INACTIVE_L2_BITNR      = 7,
     QCOW2_OL_BITMAP_DIRECTORY_BITNR = 8,
+    QCOW2_OL_COMPRESSION_DICT_BITNR = 9,
 
-    QCOW2_OL_MAX_BITNR              = 9,
+    QCOW2_OL_MAX_BITNR              = 10,
 
     QCOW2_OL_NONE             = 0,
     QCOW2_OL_MAIN_HEADER      = (1 << QCOW2_OL_MAIN_HEADER_BITNR),
@@ -569,12 +614,14 @@ typedef enum QCow2MetadataOverlap {
      * reads. */
     QCOW2_OL_INACTIVE_L2      = (1 << QCOW2_OL_INACTIVE_L2_BITNR),
     QCOW2_OL_BITMAP_DIRECTORY = (1 << QCOW2_OL_BITMAP_DIRECTORY_BITNR),
+    QCOW2_OL_COMPRESSION_DICT = (1 << QCOW2_OL_COMPRESSION_DICT_BITNR),
 } QCow2MetadataOverlap;
 
 /* Perform all overlap checks which can be done in constant time */
 #define QCOW2_OL_CONSTANT \
     (QCOW2_OL_MAIN_HEADER | QCOW2_OL_ACTIVE_L1 | QCOW2_OL_REFCOUNT_TABLE | \
-     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY)
+     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY | \
+     QCOW2_OL_COMPRESSION_DICT)
 
 /* Perform all overlap checks which don't require disk access */
 #define QCOW2_OL_CACHED \
@@ -908,6 +955,9 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+void coroutine_fn qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes);
+void qcow2_l2_warmup(BlockDriverState *bs);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -975,6 +1025,7 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
+int qcow2_cache_get_num_tables(Qcow2Cache *c);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
 /* qcow2-bitmap.c functions */
@@ -1007,6 +1058,9 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
+int qcow2_compression_dict_init(BDRVQcow2State *s, const void *dict,
+                                size_t dict_size, Error **errp);
+void qcow2_compression_dict_cleanup(BDRVQcow2State *s);
 int coroutine_fn
 qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
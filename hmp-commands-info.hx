@@ -673,6 +673,36 @@ SRST
     Show iothread's identifiers.
 ERST
 
+    {
+        .name       = "coroutine-pool",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show coroutine pool statistics",
+        .cmd        = hmp_info_coroutine_pool,
+        .flags      = "p",
+    },
+
+SRST
+  ``info coroutine-pool``
+    Show how many coroutines were created, reused from the pool and
+    deleted, and the size of the global coroutine pool.
+ERST
+
+    {
+        .name       = "rcu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show RCU statistics",
+        .cmd        = hmp_info_rcu,
+        .flags      = "p",
+    },
+
+SRST
+  ``info rcu``
+    Show how many RCU grace periods were run or shared with concurrent
+    callers, their latency, and how many RCU callbacks are pending.
+ERST
+
     {
         .name       = "rocker",
         .args_type  = "name:s",
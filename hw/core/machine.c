@@ -16,6 +16,7 @@
 #include "sysemu/replay.h"
 #include "qemu/units.h"
 #include "hw/boards.h"
+#include "exec/address-spaces.h"
 #include "hw/loader.h"
 #include "qapi/error.h"
 #include "qapi/qapi-visit-common.h"
@@ -363,6 +364,30 @@ static void machine_set_phandle_start(Object *obj, Visitor *v,
     ms->phandle_start = value;
 }
 
+static void machine_get_max_bounce_buffer_size(Object *obj, Visitor *v,
+                                               const char *name,
+                                               void *opaque, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint64_t value = ms->max_bounce_buffer_size;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void machine_set_max_bounce_buffer_size(Object *obj, Visitor *v,
+                                               const char *name,
+                                               void *opaque, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint64_t value;
+
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+
+    ms->max_bounce_buffer_size = value;
+}
+
 static char *machine_get_dt_compatible(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -1008,6 +1033,14 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "firmware",
         "Firmware image");
 
+    object_class_property_add(oc, "x-max-bounce-buffer-size", "size",
+        machine_get_max_bounce_buffer_size,
+        machine_set_max_bounce_buffer_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "x-max-bounce-buffer-size",
+        "Maximum size of the bounce buffers used for DMA to non-RAM memory "
+        "in the system memory address space");
+
     object_class_property_add_bool(oc, "suppress-vmdesc",
         machine_get_suppress_vmdesc, machine_set_suppress_vmdesc);
     object_class_property_set_description(oc, "suppress-vmdesc",
@@ -1068,6 +1101,7 @@ static void machine_initfn(Object *obj)
     ms->dump_guest_core = true;
     ms->mem_merge = true;
     ms->enable_graphics = true;
+    ms->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
     ms->kernel_cmdline = g_strdup("");
     ms->ram_size = mc->default_ram_size;
     ms->maxram_size = mc->default_ram_size;
@@ -1423,6 +1457,9 @@ void machine_run_board_init(MachineState *machine, const char *mem_path, Error *
                                    "on", false);
     }
 
+    address_space_memory.max_bounce_buffer_size =
+        machine->max_bounce_buffer_size;
+
     accel_init_interfaces(ACCEL_GET_CLASS(machine->accelerator));
     machine_class->init(machine);
     phase_advance(PHASE_MACHINE_INITIALIZED);
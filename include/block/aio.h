@@ -19,6 +19,8 @@
 #endif
 #include "qemu/coroutine.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
+#include "qapi/qapi-types-misc.h"
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
@@ -48,6 +50,11 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef QLIST_HEAD(, AioHandler) AioHandlerList;
 typedef void QEMUBHFunc(void *opaque);
+
+#define AIO_POLL_HISTOGRAM_BUCKETS 6
+
+/* Period over which the polling time is checked against its CPU budget */
+#define AIO_POLL_BUDGET_WINDOW_NS (100 * SCALE_MS)
 typedef bool AioPollFn(void *opaque);
 typedef void IOHandler(void *opaque);
 
@@ -189,6 +196,20 @@ struct AioContext {
     bool notified;
     EventNotifier notifier;
 
+    /*
+     * Set by the first aio_notify() that writes the EventNotifier, and
+     * cleared whenever notify_me is raised before a blocking wait and by
+     * aio_notify_accept().  Until then the wait is already being kicked,
+     * so further aio_notify() calls can skip event_notifier_set.  Several
+     * threads may wait at once and any of them may consume the kick, so
+     * each of them clears the flag when it wakes up.
+     */
+    bool notify_kicked;
+
+    /* Number of aio_notify() calls that did and did not write notifier */
+    Stat64 notify_sent;
+    Stat64 notify_suppressed;
+
     QSLIST_HEAD(, Coroutine) scheduled_coroutines;
     QEMUBH *co_schedule_bh;
 
@@ -216,6 +237,7 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+    bool fdmon_io_uring_multishot; /* is IORING_POLL_ADD_MULTI supported? */
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -233,6 +255,24 @@ struct AioContext {
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
+    int64_t poll_cpu_budget; /* max % of time spent polling, 0 = no limit */
+
+    /* Polling time in the current CPU budget window, see aio_poll() */
+    int64_t poll_window_start;
+    int64_t poll_window_ns;
+    bool poll_over_budget;
+
+    /*
+     * Polling statistics, only updated by the AioContext's thread.
+     * poll_histogram counts the polling phases by duration, in buckets of
+     * [0, 1us), [1us, 4us), [4us, 16us), ..., [256us, inf).
+     */
+    Stat64 poll_count;
+    Stat64 poll_success;
+    Stat64 poll_time_ns;
+    Stat64 poll_histogram[AIO_POLL_HISTOGRAM_BUCKETS];
+    Stat64 wait_count;
+    Stat64 wait_time_ns;
 
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
@@ -756,6 +796,21 @@ void aio_context_destroy(AioContext *ctx);
 /* Used internally, do not call outside AioContext code */
 void aio_context_use_g_source(AioContext *ctx);
 
+/**
+ * aio_context_set_fdmon:
+ * @ctx: the aio context
+ * @name: "poll", "epoll" or "io_uring"
+ *
+ * Select how @ctx monitors file descriptors instead of picking the fastest
+ * available implementation.  "epoll" is only used once enough file
+ * descriptors are monitored, as usual.  This is meant for benchmarks and
+ * tests; it must be called from the home thread of @ctx, outside aio_poll().
+ */
+void aio_context_set_fdmon(AioContext *ctx, const char *name, Error **errp);
+
+/* Used internally by aio_context_get_poll_stats() */
+IOThreadHandlerStatsList *aio_context_get_handler_stats(AioContext *ctx);
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -769,6 +824,26 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_poll_cpu_budget:
+ * @ctx: the aio context
+ * @budget: maximum percentage of time to spend busy polling, 0 means that
+ *          polling time is only limited by the poll parameters
+ *
+ * When over the budget, the polling time shrinks and stops growing.
+ */
+void aio_context_set_poll_cpu_budget(AioContext *ctx, int64_t budget,
+                                     Error **errp);
+
+/**
+ * aio_context_get_poll_stats:
+ * @ctx: the aio context
+ *
+ * Return the polling, waiting and dispatching statistics of @ctx.  Can be
+ * called from any thread.
+ */
+IOThreadPollStats *aio_context_get_poll_stats(AioContext *ctx);
+
 /**
  * aio_context_set_aio_params:
  * @ctx: the aio context
@@ -114,6 +114,7 @@ const char *bdrv_get_node_name(const BlockDriverState *bs);
 const char *bdrv_get_device_name(const BlockDriverState *bs);
 const char *bdrv_get_device_or_node_name(const BlockDriverState *bs);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
+int bdrv_get_host_fd(BlockDriverState *bs);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp);
 BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
@@ -219,6 +220,10 @@ bool bdrv_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
  *                               recursion.
  *         BDRV_REQ_NO_SERIALISING - do not serialize with other overlapping
  *                                   requests currently in flight.
+ *         BDRV_REQ_NO_FALLBACK - (in @write_flags) only succeed if @dst can
+ *                                share the storage of @src (e.g. through a
+ *                                reflink) instead of receiving a copy of
+ *                                the data; return -ENOTSUP otherwise.
  *
  * Returns: 0 if succeeded; negative error code if failed.
  **/
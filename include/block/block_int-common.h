@@ -60,6 +60,7 @@
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_COMPRESSION_DICT  "compression_dict"
 #define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
@@ -680,6 +681,14 @@ struct BlockDriver {
 
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
 
+    /*
+     * Return a host file descriptor from which the data of @bs can be read
+     * directly, at the offsets that bdrv_co_block_status() reports for it.
+     * Return -ENOTSUP if the node has no such descriptor or if it cannot
+     * be read at arbitrary offsets (e.g. because of O_DIRECT).
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
+
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs,
                                                  Error **errp);
     BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
@@ -75,6 +75,10 @@ static inline int coroutine_fn bdrv_co_pwrite(BdrvChild *child,
 
 bool coroutine_fn bdrv_make_request_serialising(BdrvTrackedRequest *req,
                                                 uint64_t align);
+void coroutine_fn bdrv_co_lock_range(BlockDriverState *bs,
+                                     BdrvTrackedRequest *req,
+                                     int64_t offset, int64_t bytes);
+void coroutine_fn bdrv_co_unlock_range(BdrvTrackedRequest *req);
 BdrvTrackedRequest *coroutine_fn bdrv_co_get_self_request(BlockDriverState *bs);
 
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
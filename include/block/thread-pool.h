@@ -19,6 +19,7 @@
 #define QEMU_THREAD_POOL_H
 
 #include "block/block.h"
+#include "qapi/qapi-types-misc.h"
 
 #define THREAD_POOL_MAX_THREADS_DEFAULT         64
 
@@ -37,4 +38,10 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
 
+/*
+ * Return the statistics of @pool.  Can be called from any thread, the
+ * values are read without synchronizing with the workers.
+ */
+ThreadPoolStats *thread_pool_get_stats(ThreadPool *pool);
+
 #endif
@@ -71,6 +71,22 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * Bitmap of the pages present in a fixed-ram migration file, and the
+     * file offsets of that bitmap and of the page area of this block.
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+
+    /*
+     * Pages of this block newly dirtied since the last migration bitmap
+     * sync period, and whether the adaptive convergence controller
+     * considers the block hot and sends it last in each pass.
+     */
+    uint64_t dirty_pages_period;
+    bool migration_hot;
 };
 #endif
 #endif
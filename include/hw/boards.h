@@ -339,6 +339,8 @@ struct MachineState {
     bool iommu;
     bool suppress_vmdesc;
     bool enable_graphics;
+    /* Bounce buffer budget of address_space_memory */
+    uint64_t max_bounce_buffer_size;
     ConfidentialGuestSupport *cgs;
     HostMemoryBackend *memdev;
     /*
@@ -182,6 +182,14 @@ struct VMStateDescription {
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
+    /*
+     * With the parallel-load capability, the state may be loaded by a
+     * worker thread without the BQL, concurrently with the loads of other
+     * such descriptions of the same priority.  Only set it when pre_load,
+     * post_load and the fields, including subsections, only touch the
+     * state of this device.
+     */
+    bool parallel_load;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
     int (*pre_save)(void *opaque);
@@ -353,9 +353,27 @@ void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size);
 
 /**
  * Decrease coroutine pool size
+ *
+ * Coroutines that the global pool can no longer hold are freed.
  */
 void qemu_coroutine_dec_pool_size(unsigned int additional_pool_size);
 
+typedef struct CoroutinePoolStats {
+    uint64_t created;   /* coroutines allocated with a new stack */
+    uint64_t reused;    /* coroutines taken from a pool */
+    uint64_t deleted;   /* coroutines whose stack was freed */
+    unsigned int pool_max_size;
+    unsigned int release_pool_size; /* coroutines in the global pool */
+} CoroutinePoolStats;
+
+/**
+ * Get coroutine pool statistics
+ *
+ * Reuses are counted per thread and only added up from time to time, so
+ * @reused may lag behind for threads other than the caller's.
+ */
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
 #include "qemu/lockable.h"
 
 /**
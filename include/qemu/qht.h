@@ -18,6 +18,13 @@ struct qht {
     qht_cmp_func_t cmp;
     QemuMutex lock; /* serializes setters of ht->map */
     unsigned int mode;
+    /* fields below are protected by @lock */
+    QemuThread resize_thread;
+    QemuCond resize_cond; /* wakes up resize_thread */
+    bool resize_thread_started;
+    bool resize_pending;
+    bool resize_exit;
+    unsigned int n_resizes;
 };
 
 /**
@@ -25,6 +32,7 @@ struct qht {
  * @head_buckets: number of head buckets
  * @used_head_buckets: number of non-empty head buckets
  * @entries: total number of entries
+ * @resizes: number of times the hash table has been resized
  * @chain: frequency distribution representing the number of buckets in each
  *         chain, excluding empty chains.
  * @occupancy: frequency distribution representing chain occupancy rate.
@@ -38,6 +46,7 @@ struct qht_stats {
     size_t head_buckets;
     size_t used_head_buckets;
     size_t entries;
+    size_t resizes;
     struct qdist chain;
     struct qdist occupancy;
 };
@@ -48,6 +57,12 @@ typedef bool (*qht_iter_bool_func_t)(void *p, uint32_t h, void *up);
 
 #define QHT_MODE_AUTO_RESIZE 0x1 /* auto-resize when heavily loaded */
 #define QHT_MODE_RAW_MUTEXES 0x2 /* bypass the profiler (QSP) */
+/*
+ * With AUTO_RESIZE, resize from a worker thread instead of the inserter.
+ * The worker is started on the first resize and lives until qht_destroy();
+ * do not use this mode in processes that fork.
+ */
+#define QHT_MODE_BACKGROUND_RESIZE 0x4
 
 /**
  * qht_init - Initialize a QHT
@@ -121,6 +121,13 @@ static inline void rcu_read_unlock(void)
 
 extern void synchronize_rcu(void);
 
+/*
+ * Like synchronize_rcu(), but ask readers that are stuck in a long
+ * read-side critical section to leave it through their force-RCU notifiers,
+ * instead of waiting for them to get there on their own.
+ */
+extern void synchronize_rcu_expedited(void);
+
 /*
  * Reader thread registration.
  */
@@ -144,6 +151,23 @@ struct rcu_head {
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 extern void drain_call_rcu(void);
 
+/*
+ * Cumulative counters since startup.  Grace periods that are shared were
+ * requested by a synchronize_rcu() caller but satisfied by a grace period
+ * that another caller ran concurrently.  The callback backlog is
+ * callbacks_queued - callbacks_invoked.
+ */
+struct rcu_stats {
+    uint64_t grace_periods;
+    uint64_t shared_grace_periods;
+    uint64_t gp_total_ns;
+    uint64_t gp_max_ns;
+    uint64_t callbacks_queued;
+    uint64_t callbacks_invoked;
+};
+
+extern void rcu_get_stats(struct rcu_stats *stats);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
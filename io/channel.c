@@ -489,6 +489,96 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
     return klass->io_seek(ioc, offset, whence, errp);
 }
 
+int qio_channel_pwritev_all(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+    int ret = -1;
+    struct iovec *local_iov;
+    struct iovec *local_iov_head;
+    unsigned int nlocal_iov = niov;
+
+    if (!klass->io_pwritev) {
+        error_setg(errp, "Channel does not support positioned writes");
+        return -1;
+    }
+
+    local_iov = local_iov_head = g_new(struct iovec, niov);
+    nlocal_iov = iov_copy(local_iov, nlocal_iov,
+                          iov, niov,
+                          0, iov_size(iov, niov));
+
+    while (nlocal_iov > 0) {
+        ssize_t len;
+
+        len = klass->io_pwritev(ioc, local_iov, nlocal_iov, offset, errp);
+        if (len < 0) {
+            goto cleanup;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unable to write to channel at offset %lld",
+                       (long long int)offset);
+            goto cleanup;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+        offset += len;
+    }
+
+    ret = 0;
+ cleanup:
+    g_free(local_iov_head);
+    return ret;
+}
+
+int qio_channel_preadv_all(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+    int ret = -1;
+    struct iovec *local_iov;
+    struct iovec *local_iov_head;
+    unsigned int nlocal_iov = niov;
+
+    if (!klass->io_preadv) {
+        error_setg(errp, "Channel does not support positioned reads");
+        return -1;
+    }
+
+    local_iov = local_iov_head = g_new(struct iovec, niov);
+    nlocal_iov = iov_copy(local_iov, nlocal_iov,
+                          iov, niov,
+                          0, iov_size(iov, niov));
+
+    while (nlocal_iov > 0) {
+        ssize_t len;
+
+        len = klass->io_preadv(ioc, local_iov, nlocal_iov, offset, errp);
+        if (len < 0) {
+            goto cleanup;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unexpected end-of-file before all data "
+                       "were read");
+            goto cleanup;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+        offset += len;
+    }
+
+    ret = 0;
+ cleanup:
+    g_free(local_iov_head);
+    return ret;
+}
+
 int qio_channel_flush(QIOChannel *ioc,
                                 Error **errp)
 {
@@ -17,6 +17,7 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/event-loop-base.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
@@ -171,6 +172,12 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
         return;
     }
 
+    aio_context_set_poll_cpu_budget(iothread->ctx, iothread->poll_cpu_budget,
+                                    errp);
+    if (*errp) {
+        return;
+    }
+
     aio_context_set_aio_params(iothread->ctx,
                                iothread->parent_obj.aio_max_batch,
                                errp);
@@ -225,16 +232,20 @@ static void iothread_init(EventLoopBase *base, Error **errp)
 typedef struct {
     const char *name;
     ptrdiff_t offset; /* field's byte offset in IOThread struct */
+    int64_t max;
 } IOThreadParamInfo;
 
 static IOThreadParamInfo poll_max_ns_info = {
-    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+    "poll-max-ns", offsetof(IOThread, poll_max_ns), INT64_MAX,
 };
 static IOThreadParamInfo poll_grow_info = {
-    "poll-grow", offsetof(IOThread, poll_grow),
+    "poll-grow", offsetof(IOThread, poll_grow), INT64_MAX,
 };
 static IOThreadParamInfo poll_shrink_info = {
-    "poll-shrink", offsetof(IOThread, poll_shrink),
+    "poll-shrink", offsetof(IOThread, poll_shrink), INT64_MAX,
+};
+static IOThreadParamInfo poll_cpu_budget_info = {
+    "poll-cpu-budget", offsetof(IOThread, poll_cpu_budget), 100,
 };
 
 static void iothread_get_param(Object *obj, Visitor *v,
@@ -257,9 +268,9 @@ static bool iothread_set_param(Object *obj, Visitor *v,
         return false;
     }
 
-    if (value < 0) {
+    if (value < 0 || value > info->max) {
         error_setg(errp, "%s value must be in range [0, %" PRId64 "]",
-                   info->name, INT64_MAX);
+                   info->name, info->max);
         return false;
     }
 
@@ -281,6 +292,7 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
 {
     IOThread *iothread = IOTHREAD(obj);
     IOThreadParamInfo *info = opaque;
+    ERRP_GUARD();
 
     if (!iothread_set_param(obj, v, name, info, errp)) {
         return;
@@ -292,6 +304,11 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
                                     iothread->poll_grow,
                                     iothread->poll_shrink,
                                     errp);
+        if (*errp) {
+            return;
+        }
+        aio_context_set_poll_cpu_budget(iothread->ctx,
+                                        iothread->poll_cpu_budget, errp);
     }
 }
 
@@ -314,6 +331,10 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "poll-cpu-budget", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_cpu_budget_info);
 }
 
 static const TypeInfo iothread_info = {
@@ -347,6 +368,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    ThreadPool *pool;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -359,7 +381,15 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_cpu_budget = iothread->poll_cpu_budget;
+    info->poll_stats = aio_context_get_poll_stats(iothread->ctx);
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
+    info->notify_sent = stat64_get(&iothread->ctx->notify_sent);
+    info->notify_suppressed = stat64_get(&iothread->ctx->notify_suppressed);
+    pool = qatomic_read(&iothread->ctx->thread_pool);
+    if (pool) {
+        info->thread_pool = thread_pool_get_stats(pool);
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
@@ -0,0 +1,175 @@
+/*
+ * Breakdown of the migration downtime
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/timer.h"
+#include "downtime.h"
+#include "trace.h"
+
+/* Amount of state handlers reported by migration_downtime_stats() */
+#define MIGRATION_DOWNTIME_DEVICES 10
+
+typedef struct {
+    char *idstr;
+    uint32_t instance_id;
+    int64_t ns;
+} MigrationDowntimeEntry;
+
+static void migration_downtime_entry_clear(gpointer data)
+{
+    MigrationDowntimeEntry *e = data;
+
+    g_free(e->idstr);
+}
+
+void migration_downtime_init(MigrationDowntime *d)
+{
+    qemu_mutex_init(&d->lock);
+    d->devices = g_array_new(false, false, sizeof(MigrationDowntimeEntry));
+    g_array_set_clear_func(d->devices, migration_downtime_entry_clear);
+    migration_downtime_reset(d);
+}
+
+void migration_downtime_destroy(MigrationDowntime *d)
+{
+    g_array_free(d->devices, true);
+    qemu_mutex_destroy(&d->lock);
+}
+
+static void migration_downtime_reset_locked(MigrationDowntime *d)
+{
+    int i;
+
+    d->active = false;
+    d->recorded = false;
+    for (i = 0; i < MIGRATION_DOWNTIME_PHASE__MAX; i++) {
+        d->phase_ns[i] = -1;
+    }
+    g_array_set_size(d->devices, 0);
+    memset(d->histogram, 0, sizeof(d->histogram));
+}
+
+void migration_downtime_reset(MigrationDowntime *d)
+{
+    QEMU_LOCK_GUARD(&d->lock);
+    migration_downtime_reset_locked(d);
+}
+
+void migration_downtime_start(MigrationDowntime *d)
+{
+    QEMU_LOCK_GUARD(&d->lock);
+    migration_downtime_reset_locked(d);
+    d->active = true;
+    d->recorded = true;
+}
+
+void migration_downtime_stop(MigrationDowntime *d)
+{
+    QEMU_LOCK_GUARD(&d->lock);
+    d->active = false;
+}
+
+void migration_downtime_phase(MigrationDowntime *d,
+                              MigrationDowntimePhase phase,
+                              int64_t start_ns)
+{
+    int64_t ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+    QEMU_LOCK_GUARD(&d->lock);
+    if (!d->active) {
+        return;
+    }
+    /* Some phases, like loading the devices, are made of several steps */
+    d->phase_ns[phase] = MAX(d->phase_ns[phase], 0) + ns;
+    trace_migration_downtime_phase(MigrationDowntimePhase_str(phase), ns);
+}
+
+void migration_downtime_device(MigrationDowntime *d, const char *idstr,
+                               uint32_t instance_id, int64_t start_ns)
+{
+    int64_t ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+    MigrationDowntimeEntry e;
+    int64_t limit = 10 * SCALE_US;
+    int bucket = 0;
+
+    QEMU_LOCK_GUARD(&d->lock);
+    if (!d->active) {
+        return;
+    }
+
+    e.idstr = g_strdup(idstr);
+    e.instance_id = instance_id;
+    e.ns = ns;
+    g_array_append_val(d->devices, e);
+
+    while (bucket < MIGRATION_DOWNTIME_BUCKETS - 1 && ns >= limit) {
+        limit *= 10;
+        bucket++;
+    }
+    d->histogram[bucket]++;
+    trace_migration_downtime_device(idstr, instance_id, ns);
+}
+
+static gint migration_downtime_entry_cmp(gconstpointer a, gconstpointer b)
+{
+    const MigrationDowntimeEntry *ea = a, *eb = b;
+
+    /* Slowest first */
+    return ea->ns < eb->ns ? 1 : (ea->ns > eb->ns ? -1 : 0);
+}
+
+MigrationDowntimeStats *migration_downtime_stats(MigrationDowntime *d)
+{
+    MigrationDowntimeStats *stats;
+    MigrationDowntimePhaseTimeList **phase_tail;
+    MigrationDowntimeDeviceList **device_tail;
+    intList **histogram_tail;
+    g_autofree MigrationDowntimeEntry *sorted = NULL;
+    guint i, n;
+
+    QEMU_LOCK_GUARD(&d->lock);
+    if (!d->recorded || d->active) {
+        return NULL;
+    }
+
+    stats = g_new0(MigrationDowntimeStats, 1);
+    phase_tail = &stats->phases;
+    device_tail = &stats->devices;
+    histogram_tail = &stats->histogram;
+
+    for (i = 0; i < MIGRATION_DOWNTIME_PHASE__MAX; i++) {
+        MigrationDowntimePhaseTime *p;
+
+        if (d->phase_ns[i] < 0) {
+            continue;
+        }
+        p = g_new0(MigrationDowntimePhaseTime, 1);
+        p->phase = i;
+        p->time = d->phase_ns[i] / SCALE_US;
+        QAPI_LIST_APPEND(phase_tail, p);
+    }
+
+    n = d->devices->len;
+    sorted = g_memdup2(d->devices->data, n * sizeof(MigrationDowntimeEntry));
+    qsort(sorted, n, sizeof(MigrationDowntimeEntry),
+          migration_downtime_entry_cmp);
+    for (i = 0; i < MIN(n, MIGRATION_DOWNTIME_DEVICES); i++) {
+        MigrationDowntimeDevice *dev = g_new0(MigrationDowntimeDevice, 1);
+
+        dev->name = g_strdup(sorted[i].idstr);
+        dev->instance_id = sorted[i].instance_id;
+        dev->time = sorted[i].ns / SCALE_US;
+        QAPI_LIST_APPEND(device_tail, dev);
+    }
+
+    for (i = 0; i < MIGRATION_DOWNTIME_BUCKETS; i++) {
+        QAPI_LIST_APPEND(histogram_tail, d->histogram[i]);
+    }
+
+    return stats;
+}
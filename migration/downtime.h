@@ -0,0 +1,54 @@
+/*
+ * Breakdown of the migration downtime
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DOWNTIME_H
+#define QEMU_MIGRATION_DOWNTIME_H
+
+#include "qapi/qapi-types-migration.h"
+#include "qemu/thread.h"
+
+/* Buckets of the histogram: < 10us, < 100us, ... < 100ms, more */
+#define MIGRATION_DOWNTIME_BUCKETS 6
+
+typedef struct MigrationDowntime {
+    QemuMutex lock;
+    /* Timings are only recorded between start and stop */
+    bool active;
+    /* Something was recorded since the last reset */
+    bool recorded;
+    /* Time spent in each phase in ns, -1 if it was not reached */
+    int64_t phase_ns[MIGRATION_DOWNTIME_PHASE__MAX];
+    /* MigrationDowntimeEntry of each state handler */
+    GArray *devices;
+    uint64_t histogram[MIGRATION_DOWNTIME_BUCKETS];
+} MigrationDowntime;
+
+void migration_downtime_init(MigrationDowntime *d);
+void migration_downtime_destroy(MigrationDowntime *d);
+
+/* Forget the last downtime, e.g. when a new migration starts */
+void migration_downtime_reset(MigrationDowntime *d);
+
+/* The downtime starts, drop the previous timings and record the next */
+void migration_downtime_start(MigrationDowntime *d);
+void migration_downtime_stop(MigrationDowntime *d);
+
+/*
+ * Account the time since @start_ns, taken from QEMU_CLOCK_REALTIME, to
+ * @phase or to the state handler @idstr/@instance_id.  Nothing is
+ * recorded unless the downtime was started.
+ */
+void migration_downtime_phase(MigrationDowntime *d,
+                              MigrationDowntimePhase phase,
+                              int64_t start_ns);
+void migration_downtime_device(MigrationDowntime *d, const char *idstr,
+                               uint32_t instance_id, int64_t start_ns);
+
+/* Returns NULL unless a downtime was recorded and has ended */
+MigrationDowntimeStats *migration_downtime_stats(MigrationDowntime *d);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "exec/target_page.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+#ifdef CONFIG_LINUX
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+/* Used to open the extra channels of a fixed-ram migration */
+static char *outgoing_filename;
+
+/*
+ * O_DIRECT requires the file offset, the length and the buffer of each
+ * request to be aligned to the logical block size of the device.  The
+ * channels write whole target pages at page-aligned offsets, so check
+ * that a target page is a multiple of that size.
+ */
+static bool file_check_direct_io_alignment(int fd, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    struct stat st;
+    unsigned int align;
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Unable to stat migration file");
+        return false;
+    }
+    align = st.st_blksize;
+#ifdef BLKSSZGET
+    if (S_ISBLK(st.st_mode)) {
+        int sector_size;
+
+        if (ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+            align = sector_size;
+        }
+    }
+#endif
+
+    trace_migration_file_direct_io_alignment(align);
+    if (align && page_size % align) {
+        error_setg(errp, "direct-io needs the target page size (%zu) to be "
+                   "a multiple of the block size of the file (%u)",
+                   page_size, align);
+        return false;
+    }
+    return true;
+}
+
+QIOChannel *file_send_channel_create(Error **errp)
+{
+    QIOChannelFile *fioc;
+    int flags = O_WRONLY;
+
+    if (migrate_use_direct_io()) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        error_setg(errp, "O_DIRECT is not supported on this host");
+        return NULL;
+#endif
+    }
+
+    fioc = qio_channel_file_new_path(outgoing_filename, flags, 0, errp);
+    if (!fioc) {
+        return NULL;
+    }
+
+    if (migrate_use_direct_io() &&
+        !file_check_direct_io_alignment(fioc->fd, errp)) {
+        object_unref(OBJECT(fioc));
+        return NULL;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-channel");
+    return QIO_CHANNEL(fioc);
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(filename);
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(outgoing_filename);
+    outgoing_filename = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
@@ -0,0 +1,480 @@
+/*
+ * Lazy restore of guest RAM from a fixed-ram migration file
+ *
+ * With fixed-ram every page of a RAMBlock has a fixed offset in the file,
+ * so the destination can start the guest before reading any of them.  The
+ * RAM is registered with userfaultfd: a fault thread reads the host pages
+ * that are accessed, and a prefetch thread reads all the others in large
+ * chunks.  Each host page is claimed by exactly one of the two threads,
+ * which places it with a single UFFDIO_COPY.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "io/channel-file.h"
+#include "sysemu/sysemu.h"
+#include "lazy-restore.h"
+#include "ram.h"
+#include "trace.h"
+
+#ifdef CONFIG_LINUX
+#include <poll.h>
+#include "qemu/event_notifier.h"
+#include "qemu/userfaultfd.h"
+
+/* Amount of RAM read at once by the prefetch thread */
+#define LAZY_RESTORE_CHUNK_SIZE (1 * MiB)
+
+typedef struct {
+    RAMBlock *rb;
+    uint8_t *host;
+    size_t pagesize;
+    /* number of host pages */
+    unsigned long pages;
+    /* offset of the page area of the block in the file */
+    uint64_t pages_offset;
+    /* target pages present in the file, the others are zero */
+    unsigned long *file_bmap;
+    /* host pages that no thread has claimed yet, protected by lock */
+    unsigned long *todo;
+    /* UFFDIO_ZEROPAGE is supported on this block */
+    bool zeroable;
+    bool registered;
+} LazyRestoreBlock;
+
+typedef struct {
+    /* our own copy of the migration file, which is closed after loading */
+    QIOChannel *ioc;
+    int userfault_fd;
+    EventNotifier quit;
+    QemuMutex lock;
+
+    LazyRestoreBlock *blocks;
+    unsigned int nr_blocks;
+
+    QemuThread fault_thread;
+    QemuThread prefetch_thread;
+    /* one host page for the fault thread, a chunk for the prefetch one */
+    uint8_t *fault_buf;
+    uint8_t *prefetch_buf;
+    size_t prefetch_buf_size;
+
+    int64_t start_time;
+} LazyRestoreState;
+
+/*
+ * A page that cannot be restored leaves the vCPU touching it blocked in
+ * the fault for ever, so there is no way to carry on.
+ */
+static G_NORETURN void lazy_restore_abort(Error *err)
+{
+    if (err) {
+        error_report_err(err);
+    }
+    error_report("Lazy restore of guest RAM failed");
+    exit(EXIT_FAILURE);
+}
+
+/* Claim host page @page of @lb; false if another thread has claimed it */
+static bool lazy_restore_claim_page(LazyRestoreState *s, LazyRestoreBlock *lb,
+                                    unsigned long page)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!test_bit(page, lb->todo)) {
+        return false;
+    }
+    clear_bit(page, lb->todo);
+    return true;
+}
+
+/*
+ * Claim the first run of unclaimed host pages of @lb from *@page on, at
+ * most @max of them.  Returns the number of pages claimed and their start
+ * in *@page, or 0 once all pages of the block are claimed.
+ */
+static unsigned long lazy_restore_claim_run(LazyRestoreState *s,
+                                            LazyRestoreBlock *lb,
+                                            unsigned long *page,
+                                            unsigned long max)
+{
+    unsigned long first, end;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    first = find_next_bit(lb->todo, lb->pages, *page);
+    if (first >= lb->pages) {
+        return 0;
+    }
+    end = find_next_zero_bit(lb->todo, MIN(first + max, lb->pages), first);
+    bitmap_clear(lb->todo, first, end - first);
+
+    *page = first;
+    return end - first;
+}
+
+/*
+ * Read the @npages host pages of @lb starting at @page from the file and
+ * place them in the guest, waking up the threads faulting on them.  The
+ * caller has claimed the pages and @buf is large enough for them.
+ */
+static void lazy_restore_place(LazyRestoreState *s, LazyRestoreBlock *lb,
+                               unsigned long page, unsigned long npages,
+                               uint8_t *buf)
+{
+    size_t tps = qemu_target_page_size();
+    ram_addr_t offset = (ram_addr_t)page * lb->pagesize;
+    size_t len = npages * lb->pagesize;
+    unsigned long first = offset / tps;
+    unsigned long last = (offset + len) / tps;
+    unsigned long set, clear;
+    Error *local_err = NULL;
+
+    set = find_next_bit(lb->file_bmap, last, first);
+    if (set >= last) {
+        /* Nothing in the file, the pages are zero */
+        if (lb->zeroable) {
+            if (uffd_zero_page(s->userfault_fd, lb->host + offset, len,
+                               false)) {
+                lazy_restore_abort(NULL);
+            }
+            return;
+        }
+        memset(buf, 0, len);
+    } else {
+        struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+        if (qio_channel_preadv_all(s->ioc, &iov, 1,
+                                   lb->pages_offset + offset,
+                                   &local_err) < 0) {
+            lazy_restore_abort(local_err);
+        }
+
+        /*
+         * Pages missing from the file are zero, whatever an older pass
+         * may have left at their offset.
+         */
+        clear = find_next_zero_bit(lb->file_bmap, last, first);
+        while (clear < last) {
+            set = find_next_bit(lb->file_bmap, last, clear);
+            memset(buf + (clear - first) * tps, 0, (set - clear) * tps);
+            clear = find_next_zero_bit(lb->file_bmap, last, set);
+        }
+    }
+
+    if (uffd_copy_page(s->userfault_fd, lb->host + offset, buf, len, false)) {
+        lazy_restore_abort(NULL);
+    }
+}
+
+static LazyRestoreBlock *lazy_restore_find_block(LazyRestoreState *s,
+                                                 uint8_t *addr)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        LazyRestoreBlock *lb = &s->blocks[i];
+
+        if (addr >= lb->host && addr < lb->host + lb->rb->used_length) {
+            return lb;
+        }
+    }
+    return NULL;
+}
+
+static void lazy_restore_fault(LazyRestoreState *s, uint8_t *addr)
+{
+    LazyRestoreBlock *lb = lazy_restore_find_block(s, addr);
+    unsigned long page;
+
+    if (!lb) {
+        error_report("%s: fault outside of guest RAM at %p", __func__, addr);
+        lazy_restore_abort(NULL);
+    }
+
+    page = (addr - lb->host) / lb->pagesize;
+    trace_lazy_restore_fault(lb->rb->idstr, addr - lb->host);
+
+    /*
+     * A page claimed by the prefetch thread is being placed already, and
+     * placing it wakes us up.
+     */
+    if (lazy_restore_claim_page(s, lb, page)) {
+        lazy_restore_place(s, lb, page, 1, s->fault_buf);
+    }
+}
+
+static void *lazy_restore_fault_thread(void *opaque)
+{
+    LazyRestoreState *s = opaque;
+    struct pollfd pfd[2];
+
+    pfd[0].fd = s->userfault_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(&s->quit);
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        struct uffd_msg msg;
+        int ret;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll: %s", __func__, strerror(errno));
+            lazy_restore_abort(NULL);
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = uffd_read_events(s->userfault_fd, &msg, 1);
+        if (ret < 0) {
+            lazy_restore_abort(NULL);
+        }
+        if (ret == 0) {
+            continue;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: unexpected event %d", __func__, msg.event);
+            continue;
+        }
+
+        lazy_restore_fault(s, (uint8_t *)(uintptr_t)msg.arg.pagefault.address);
+    }
+
+    return NULL;
+}
+
+/* Called with the BQL held */
+static void lazy_restore_free(LazyRestoreState *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        LazyRestoreBlock *lb = &s->blocks[i];
+
+        if (lb->registered) {
+            uffd_unregister_memory(s->userfault_fd, lb->host,
+                                   lb->rb->used_length);
+        }
+        memory_region_unref(lb->rb->mr);
+        g_free(lb->file_bmap);
+        g_free(lb->todo);
+    }
+    g_free(s->blocks);
+
+    if (s->userfault_fd >= 0) {
+        uffd_close_fd(s->userfault_fd);
+    }
+    event_notifier_cleanup(&s->quit);
+    qemu_mutex_destroy(&s->lock);
+    if (s->ioc) {
+        object_unref(OBJECT(s->ioc));
+    }
+    qemu_vfree(s->fault_buf);
+    qemu_vfree(s->prefetch_buf);
+    ram_block_discard_disable(false);
+    g_free(s);
+}
+
+static void lazy_restore_cleanup_bh(void *opaque)
+{
+    LazyRestoreState *s = opaque;
+
+    qemu_thread_join(&s->prefetch_thread);
+    lazy_restore_free(s);
+}
+
+static void *lazy_restore_prefetch_thread(void *opaque)
+{
+    LazyRestoreState *s = opaque;
+    unsigned int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        LazyRestoreBlock *lb = &s->blocks[i];
+        unsigned long max = s->prefetch_buf_size / lb->pagesize;
+        unsigned long page = 0, npages;
+
+        while ((npages = lazy_restore_claim_run(s, lb, &page, max))) {
+            lazy_restore_place(s, lb, page, npages, s->prefetch_buf);
+            page += npages;
+        }
+    }
+
+    /*
+     * Every page is claimed; the fault thread places the last ones it
+     * claimed before it sees the notifier.
+     */
+    event_notifier_set(&s->quit);
+    qemu_thread_join(&s->fault_thread);
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        LazyRestoreBlock *lb = &s->blocks[i];
+
+        uffd_unregister_memory(s->userfault_fd, lb->host, lb->rb->used_length);
+        lb->registered = false;
+    }
+
+    trace_lazy_restore_complete(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                s->start_time);
+
+    /* The memory regions can only be unreferenced under the BQL */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), lazy_restore_cleanup_bh,
+                            s);
+    return NULL;
+}
+
+static int lazy_restore_add_block(LazyRestoreState *s, LazyRestoreBlock *lb,
+                                  RAMBlock *rb, Error **errp)
+{
+    uint64_t ioctls;
+
+    lb->rb = rb;
+    memory_region_ref(rb->mr);
+    lb->host = qemu_ram_get_host_addr(rb);
+    lb->pagesize = qemu_ram_pagesize(rb);
+    lb->pages = rb->used_length / lb->pagesize;
+    lb->pages_offset = rb->pages_offset;
+    lb->file_bmap = g_steal_pointer(&rb->file_bmap);
+    lb->todo = bitmap_new(lb->pages);
+    bitmap_set(lb->todo, 0, lb->pages);
+
+    if (!lb->file_bmap) {
+        error_setg(errp, "No fixed-ram data for RAM block %s", rb->idstr);
+        return -1;
+    }
+
+    /*
+     * Another process writing to shared memory would allocate the pages
+     * behind our back.
+     */
+    if (qemu_ram_is_shared(rb)) {
+        error_setg(errp, "Lazy restore does not support shared RAM block %s",
+                   rb->idstr);
+        return -1;
+    }
+
+    /* Only pages that are missing raise faults */
+    if (ram_discard_range(rb->idstr, 0, rb->used_length)) {
+        error_setg(errp, "Could not discard RAM block %s", rb->idstr);
+        return -1;
+    }
+
+    if (uffd_register_memory(s->userfault_fd, lb->host, rb->used_length,
+                             UFFDIO_REGISTER_MODE_MISSING, &ioctls)) {
+        error_setg(errp, "Could not register RAM block %s with userfaultfd",
+                   rb->idstr);
+        return -1;
+    }
+    lb->registered = true;
+
+    if (!(ioctls & BIT(_UFFDIO_COPY))) {
+        error_setg(errp, "RAM block %s does not support UFFDIO_COPY",
+                   rb->idstr);
+        return -1;
+    }
+    lb->zeroable = ioctls & BIT(_UFFDIO_ZEROPAGE);
+
+    return 0;
+}
+
+int lazy_restore_start(QIOChannel *ioc, Error **errp)
+{
+    LazyRestoreState *s;
+    size_t max_pagesize = qemu_ram_pagesize_largest();
+    RAMBlock *rb;
+    int fd, ret;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "Lazy restore requires a file: URI");
+        return -1;
+    }
+    if (enable_mlock) {
+        error_setg(errp, "Lazy restore is not compatible with mem-lock");
+        return -1;
+    }
+
+    /*
+     * Discarding a page that was already restored would leave a hole
+     * that nothing fills again.
+     */
+    ret = ram_block_discard_disable(true);
+    if (ret) {
+        error_setg_errno(errp, -ret, "Lazy restore cannot disable RAM "
+                         "discards");
+        return -1;
+    }
+
+    s = g_new0(LazyRestoreState, 1);
+    qemu_mutex_init(&s->lock);
+    event_notifier_init(&s->quit, false);
+    s->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    s->userfault_fd = uffd_create_fd(0, true);
+    if (s->userfault_fd < 0) {
+        error_setg(errp, "Could not open userfaultfd");
+        goto fail;
+    }
+
+    fd = dup(QIO_CHANNEL_FILE(ioc)->fd);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not duplicate the migration "
+                         "file descriptor");
+        goto fail;
+    }
+    s->ioc = QIO_CHANNEL(qio_channel_file_new_fd(fd));
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            s->nr_blocks++;
+        }
+        s->blocks = g_new0(LazyRestoreBlock, s->nr_blocks);
+        s->nr_blocks = 0;
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            if (lazy_restore_add_block(s, &s->blocks[s->nr_blocks++], rb,
+                                       errp)) {
+                goto fail;
+            }
+        }
+    }
+
+    s->fault_buf = qemu_memalign(qemu_real_host_page_size(), max_pagesize);
+    s->prefetch_buf_size = MAX(LAZY_RESTORE_CHUNK_SIZE, max_pagesize);
+    s->prefetch_buf = qemu_memalign(qemu_real_host_page_size(),
+                                    s->prefetch_buf_size);
+
+    trace_lazy_restore_start(s->nr_blocks);
+    qemu_thread_create(&s->fault_thread, "lazy-restore/fault",
+                       lazy_restore_fault_thread, s, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&s->prefetch_thread, "lazy-restore",
+                       lazy_restore_prefetch_thread, s, QEMU_THREAD_JOINABLE);
+    return 0;
+
+fail:
+    lazy_restore_free(s);
+    return -1;
+}
+
+#else
+
+int lazy_restore_start(QIOChannel *ioc, Error **errp)
+{
+    error_setg(errp, "Lazy restore is only supported on Linux");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Lazy restore of guest RAM from a fixed-ram migration file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_LAZY_RESTORE_H
+#define QEMU_MIGRATION_LAZY_RESTORE_H
+
+#include "io/channel.h"
+
+/*
+ * Start serving the guest RAM from the fixed-ram file behind @ioc.
+ *
+ * Must be called once the fixed-ram header and bitmap of every RAMBlock
+ * have been read, and before anything touches guest RAM.  The RAM is
+ * emptied and registered with userfaultfd; pages are then read when they
+ * are first accessed, and a background thread reads the others.
+ *
+ * Returns 0 on success, -1 on error with @errp set.
+ */
+int lazy_restore_start(QIOChannel *ioc, Error **errp);
+
+#endif
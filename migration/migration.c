@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -96,6 +97,8 @@
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS 1
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 1
 #define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
 /* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
@@ -163,7 +166,21 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_COMPRESS,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
-    MIGRATION_CAPABILITY_VALIDATE_UUID);
+    MIGRATION_CAPABILITY_VALIDATE_UUID,
+    MIGRATION_CAPABILITY_FIXED_RAM,
+    MIGRATION_CAPABILITY_ADAPTIVE_CONVERGENCE);
+
+/* Fixed-ram compatibility check list */
+static const
+INITIALIZE_MIGRATE_CAPS_SET(check_caps_fixed_ram,
+    MIGRATION_CAPABILITY_POSTCOPY_RAM,
+    MIGRATION_CAPABILITY_RELEASE_RAM,
+    MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+    MIGRATION_CAPABILITY_COMPRESS,
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_X_COLO,
+    MIGRATION_CAPABILITY_X_IGNORE_SHARED,
+    MIGRATION_CAPABILITY_BLOCK);
 
 /* When we add fault tolerance, we could have several
    migrations at once.  For now we don't need to add
@@ -218,8 +235,10 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_qemufile_dst_done, 0);
     qemu_mutex_init(&current_incoming->page_request_mutex);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
+    migration_downtime_init(&current_incoming->downtime_stats);
 
     migration_object_check(current_migration, &error_fatal);
 
@@ -308,6 +327,11 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        migration_ioc_unregister_yank_from_file(mis->postcopy_qemufile_dst);
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -343,16 +367,15 @@ static bool migrate_late_block_activate(void)
 
 /*
  * Send a message on the return channel back to the source
- * of the migration.
+ * of the migration.  Must be called with rp_mutex held.
  */
-static int migrate_send_rp_message(MigrationIncomingState *mis,
-                                   enum mig_rp_message_type message_type,
-                                   uint16_t len, void *data)
+static int migrate_send_rp_message_locked(MigrationIncomingState *mis,
+                                          enum mig_rp_message_type message_type,
+                                          uint16_t len, void *data)
 {
     int ret = 0;
 
     trace_migrate_send_rp_message((int)message_type, len);
-    QEMU_LOCK_GUARD(&mis->rp_mutex);
 
     /*
      * It's possible that the file handle got lost due to network
@@ -374,6 +397,19 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return ret;
 }
 
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static int migrate_send_rp_message(MigrationIncomingState *mis,
+                                   enum mig_rp_message_type message_type,
+                                   uint16_t len, void *data)
+{
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+
+    return migrate_send_rp_message_locked(mis, message_type, len, data);
+}
+
 /* Request one page from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
@@ -393,10 +429,11 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
 
     /*
-     * We maintain the last ramblock that we requested for page.  Note that we
-     * don't need locking because this function will only be called within the
-     * postcopy ram fault thread.
+     * We maintain the last ramblock that we requested for page.  There can
+     * be several fault threads, so the check and the message must be done
+     * under rp_mutex for last_rb to match what the source saw last.
      */
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
     if (rb != mis->last_rb) {
         mis->last_rb = rb;
 
@@ -413,7 +450,7 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
         msg_type = MIG_RP_MSG_REQ_PAGES;
     }
 
-    return migrate_send_rp_message(mis, msg_type, msglen, bufc);
+    return migrate_send_rp_message_locked(mis, msg_type, msglen, bufc);
 }
 
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
@@ -481,6 +518,11 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p = NULL;
 
+    if (migrate_use_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram migration requires a file: URI");
+        return;
+    }
+
     migrate_protocol_allow_multi_channels(false); /* reset it anyway */
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (strstart(uri, "tcp:", &p) ||
@@ -496,6 +538,9 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        migrate_protocol_allow_multi_channels(migrate_use_fixed_ram());
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -505,6 +550,7 @@ static void process_incoming_migration_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     /* If capability late_block_activate is set:
      * Only fire up the block code now if we're going to restart the
@@ -559,6 +605,9 @@ static void process_incoming_migration_bh(void *opaque)
      * observer sees this event they might start to prod at the VM assuming
      * it's ready to use.
      */
+    migration_downtime_phase(&mis->downtime_stats,
+                             MIGRATION_DOWNTIME_PHASE_START, start);
+    migration_downtime_stop(&mis->downtime_stats);
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_COMPLETED);
     qemu_bh_delete(mis->bh);
@@ -578,6 +627,8 @@ static void process_incoming_migration_co(void *opaque)
     postcopy_state_set(POSTCOPY_INCOMING_NONE);
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
+    /* The device state is only sent once the source is stopped */
+    migration_downtime_start(&mis->downtime_stats);
     ret = qemu_loadvm_state(mis->from_src_file);
 
     ps = postcopy_state_get();
@@ -730,9 +781,18 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd needs more than one channel, we wait;
+         * except with fixed-ram where pages are read from the file
+         * in place.
+         */
+        start_migration = !migrate_use_multifd() || migrate_use_fixed_ram();
+    } else if (migrate_postcopy_preempt()) {
+        /*
+         * The postcopy preempt channel, connected by the source right
+         * after the main channel.  The main channel was already started.
          */
-        start_migration = !migrate_use_multifd();
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        return;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -765,6 +825,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -904,6 +968,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->block_incremental = s->parameters.block_incremental;
     params->has_multifd_channels = true;
     params->multifd_channels = s->parameters.multifd_channels;
+    params->has_postcopy_fault_threads = true;
+    params->postcopy_fault_threads = s->parameters.postcopy_fault_threads;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
     params->has_multifd_compression = true;
     params->multifd_compression = s->parameters.multifd_compression;
     params->has_multifd_zlib_level = true;
@@ -913,6 +981,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
 #ifdef CONFIG_LINUX
     params->has_zero_copy_send = true;
     params->zero_copy_send = s->parameters.zero_copy_send;
+    params->has_direct_io = true;
+    params->direct_io = s->parameters.direct_io;
 #endif
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
@@ -1013,6 +1083,12 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
                            s->start_time;
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
+        if (migrate_adaptive_convergence()) {
+            info->has_projected_downtime = true;
+            info->projected_downtime = s->projected_downtime;
+            info->has_convergence_action = true;
+            info->convergence_action = s->convergence_action;
+        }
     }
 }
 
@@ -1031,6 +1107,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->normal_bytes = ram_counters.normal * page_size;
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = ram_counters.dirty_sync_count;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
     info->ram->postcopy_requests = ram_counters.postcopy_requests;
     info->ram->page_size = page_size;
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
@@ -1063,6 +1140,11 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
                                     compression_counters.compression_rate;
     }
 
+    if (migrate_use_multifd()) {
+        info->multifd_channel_stats = multifd_channel_stats();
+        info->has_multifd_channel_stats = !!info->multifd_channel_stats;
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
@@ -1074,6 +1156,18 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     }
 }
 
+static void populate_downtime_info(MigrationInfo *info, MigrationDowntime *d)
+{
+    MigrationDowntimeStats *stats = migration_downtime_stats(d);
+
+    if (stats) {
+        /* An incoming migration that later migrated out reports the latter */
+        qapi_free_MigrationDowntimeStats(info->downtime_stats);
+        info->has_downtime_stats = true;
+        info->downtime_stats = stats;
+    }
+}
+
 static void populate_disk_info(MigrationInfo *info)
 {
     if (blk_mig_active()) {
@@ -1138,6 +1232,7 @@ static void fill_source_migration_info(MigrationInfo *info)
         populate_time_info(info, s);
         populate_ram_info(info, s);
         populate_vfio_info(info);
+        populate_downtime_info(info, &s->downtime_stats);
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -1242,6 +1337,28 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * The extra channel would be taken for a multifd channel, and
+         * requested pages cannot be compressed by the shared compression
+         * threads while the background pages are.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with multifd");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "compress");
+            return false;
+        }
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1275,6 +1392,31 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+        int idx;
+
+        for (idx = 0; idx < check_caps_fixed_ram.size; idx++) {
+            int incomp_cap = check_caps_fixed_ram.caps[idx];
+            if (cap_list[incomp_cap]) {
+                error_setg(errp,
+                        "Fixed-ram is not compatible with %s",
+                        MigrationCapability_str(incomp_cap));
+                return false;
+            }
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_LAZY_RESTORE]) {
+#ifndef CONFIG_LINUX
+        error_setg(errp, "Lazy restore is only supported on Linux");
+        return false;
+#endif
+        if (!cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+            error_setg(errp, "Lazy restore requires fixed-ram");
+            return false;
+        }
+    }
+
     /* incoming side only */
     if (runstate_check(RUN_STATE_INMIGRATE) &&
         !migrate_multi_channels_is_allowed() &&
@@ -1283,6 +1425,14 @@ static bool migrate_caps_check(bool *cap_list,
         return false;
     }
 
+    if (runstate_check(RUN_STATE_INMIGRATE) &&
+        !migrate_multi_channels_is_allowed() &&
+        cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        error_setg(errp, "postcopy-preempt is not supported by current "
+                   "protocol");
+        return false;
+    }
+
     return true;
 }
 
@@ -1313,6 +1463,7 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        populate_downtime_info(info, &mis->downtime_stats);
         break;
     }
     info->status = mis->state;
@@ -1430,6 +1581,22 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_postcopy_fault_threads &&
+        (params->postcopy_fault_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_fault_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
+    if (params->has_dirty_sync_threads &&
+        (params->dirty_sync_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_sync_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
     if (params->has_multifd_zlib_level &&
         (params->multifd_zlib_level > 9)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zlib_level",
@@ -1577,6 +1744,12 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_channels) {
         dest->multifd_channels = params->multifd_channels;
     }
+    if (params->has_postcopy_fault_threads) {
+        dest->postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
     if (params->has_multifd_compression) {
         dest->multifd_compression = params->multifd_compression;
     }
@@ -1584,6 +1757,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_zero_copy_send) {
         dest->zero_copy_send = params->zero_copy_send;
     }
+    if (params->has_direct_io) {
+        dest->direct_io = params->direct_io;
+    }
 #endif
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
@@ -1694,6 +1870,12 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_channels) {
         s->parameters.multifd_channels = params->multifd_channels;
     }
+    if (params->has_postcopy_fault_threads) {
+        s->parameters.postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
     if (params->has_multifd_compression) {
         s->parameters.multifd_compression = params->multifd_compression;
     }
@@ -1701,6 +1883,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_zero_copy_send) {
         s->parameters.zero_copy_send = params->zero_copy_send;
     }
+    if (params->has_direct_io) {
+        s->parameters.direct_io = params->direct_io;
+    }
 #endif
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
@@ -1861,6 +2046,7 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        postcopy_preempt_cleanup(s);
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -1943,6 +2129,10 @@ static void migrate_fd_cancel(MigrationState *s)
             /* shutdown the rp socket, so causing the rp thread to shutdown */
             qemu_file_shutdown(s->rp_state.from_dst_file);
         }
+        if (s->postcopy_qemufile_src) {
+            /* The migration thread may be stuck sending a requested page */
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
     }
 
     do {
@@ -2092,6 +2282,9 @@ void migrate_init(MigrationState *s)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    s->projected_downtime = 0;
+    s->convergence_action = MIGRATION_CONVERGENCE_ACTION_NONE;
+    migration_downtime_reset(&s->downtime_stats);
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
@@ -2207,6 +2400,9 @@ void qmp_migrate_pause(Error **errp)
         /* Source side, during postcopy */
         qemu_mutex_lock(&ms->qemu_file_lock);
         ret = qemu_file_shutdown(ms->to_dst_file);
+        if (ms->postcopy_qemufile_src) {
+            qemu_file_shutdown(ms->postcopy_qemufile_src);
+        }
         qemu_mutex_unlock(&ms->qemu_file_lock);
         if (ret) {
             error_setg(errp, "Failed to pause source migration");
@@ -2336,6 +2532,23 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p = NULL;
 
+    if (migrate_use_fixed_ram()) {
+        if (!strstart(uri, "file:", NULL)) {
+            error_setg(errp, "fixed-ram migration requires a file: URI");
+            return;
+        }
+        if (migrate_use_multifd() &&
+            migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "fixed-ram migration does not support "
+                       "multifd compression");
+            return;
+        }
+        if (migrate_use_tls()) {
+            error_setg(errp, "fixed-ram migration does not support TLS");
+            return;
+        }
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2362,6 +2575,9 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        migrate_protocol_allow_multi_channels(migrate_use_fixed_ram());
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2418,6 +2634,15 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -2432,6 +2657,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_adaptive_convergence(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ADAPTIVE_CONVERGENCE];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -2540,6 +2774,42 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_use_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE];
+}
+
+bool migrate_parallel_load(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_LOAD];
+}
+
+bool migrate_use_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2559,6 +2829,24 @@ int migrate_multifd_channels(void)
     return s->parameters.multifd_channels;
 }
 
+int migrate_postcopy_fault_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_fault_threads;
+}
+
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.dirty_sync_threads;
+}
+
 MultiFDCompression migrate_multifd_compression(void)
 {
     MigrationState *s;
@@ -2595,6 +2883,15 @@ bool migrate_use_zero_copy_send(void)
 
     return s->parameters.zero_copy_send;
 }
+
+bool migrate_use_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.direct_io;
+}
 #endif
 
 int migrate_use_tls(void)
@@ -3008,6 +3305,14 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+    int64_t stop_start;
+
+    /* Without the BQL, the channel is connected from the main loop */
+    if (postcopy_preempt_wait_channel(ms)) {
+        migrate_set_state(&ms->state, ms->state, MIGRATION_STATUS_FAILED);
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3019,10 +3324,14 @@ static int postcopy_start(MigrationState *ms)
 
     qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
     global_state_store();
+    migration_downtime_start(&ms->downtime_stats);
+    stop_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
     if (ret < 0) {
         goto fail;
     }
+    migration_downtime_phase(&ms->downtime_stats,
+                             MIGRATION_DOWNTIME_PHASE_VM_STOP, stop_start);
 
     ret = migration_maybe_pause(ms, &cur_state,
                                 MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3125,6 +3434,7 @@ static int postcopy_start(MigrationState *ms)
     notifier_list_notify(&migration_state_notifiers, ms);
 
     ms->downtime =  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+    migration_downtime_stop(&ms->downtime_stats);
 
     qemu_mutex_unlock_iothread();
 
@@ -3230,9 +3540,15 @@ static void migration_completion(MigrationState *s)
         s->vm_was_running = runstate_is_running();
         ret = global_state_store();
 
+        migration_downtime_start(&s->downtime_stats);
+
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            migration_downtime_phase(&s->downtime_stats,
+                                     MIGRATION_DOWNTIME_PHASE_VM_STOP, start);
             trace_migration_completion_vm_stop(ret);
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
@@ -3271,14 +3587,18 @@ static void migration_completion(MigrationState *s)
      * a SHUT command).
      */
     if (s->rp_state.rp_thread_created) {
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         int rp_error;
         trace_migration_return_path_end_before();
         rp_error = await_return_path_close_on_source(s);
+        migration_downtime_phase(&s->downtime_stats,
+                                 MIGRATION_DOWNTIME_PHASE_RETURN_PATH, start);
         trace_migration_return_path_end_after(rp_error);
         if (rp_error) {
             goto fail_invalidate;
         }
     }
+    migration_downtime_stop(&s->downtime_stats);
 
     if (qemu_file_get_error(s->to_dst_file)) {
         trace_migration_completion_file_err();
@@ -3431,6 +3751,12 @@ static MigThrError postcopy_pause(MigrationState *s)
 {
     assert(s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
 
+    /*
+     * Requested pages go through the main channel after a recovery, so
+     * the destination sees the preempt channel close here.
+     */
+    postcopy_preempt_close(s);
+
     while (true) {
         QEMUFile *file;
 
@@ -4162,6 +4488,15 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (postcopy_preempt_setup(s, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4240,6 +4575,12 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-channels", MigrationState,
                       parameters.multifd_channels,
                       DEFAULT_MIGRATE_MULTIFD_CHANNELS),
+    DEFINE_PROP_UINT8("postcopy-fault-threads", MigrationState,
+                      parameters.postcopy_fault_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
     DEFINE_PROP_MULTIFD_COMPRESSION("multifd-compression", MigrationState,
                       parameters.multifd_compression,
                       DEFAULT_MIGRATE_MULTIFD_COMPRESSION),
@@ -4252,6 +4593,8 @@ static Property migration_properties[] = {
 #ifdef CONFIG_LINUX
     DEFINE_PROP_BOOL("zero_copy_send", MigrationState,
                       parameters.zero_copy_send, false),
+    DEFINE_PROP_BOOL("direct-io", MigrationState,
+                      parameters.direct_io, false),
 #endif
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
@@ -4279,15 +4622,24 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
     DEFINE_PROP_MIG_CAP("x-rdma-pin-all", MIGRATION_CAPABILITY_RDMA_PIN_ALL),
     DEFINE_PROP_MIG_CAP("x-auto-converge", MIGRATION_CAPABILITY_AUTO_CONVERGE),
+    DEFINE_PROP_MIG_CAP("x-adaptive-convergence",
+            MIGRATION_CAPABILITY_ADAPTIVE_CONVERGENCE),
     DEFINE_PROP_MIG_CAP("x-zero-blocks", MIGRATION_CAPABILITY_ZERO_BLOCKS),
     DEFINE_PROP_MIG_CAP("x-compress", MIGRATION_CAPABILITY_COMPRESS),
     DEFINE_PROP_MIG_CAP("x-events", MIGRATION_CAPABILITY_EVENTS),
     DEFINE_PROP_MIG_CAP("x-postcopy-ram", MIGRATION_CAPABILITY_POSTCOPY_RAM),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
     DEFINE_PROP_MIG_CAP("x-colo", MIGRATION_CAPABILITY_X_COLO),
     DEFINE_PROP_MIG_CAP("x-release-ram", MIGRATION_CAPABILITY_RELEASE_RAM),
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+            MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_MIG_CAP("x-fixed-ram", MIGRATION_CAPABILITY_FIXED_RAM),
+    DEFINE_PROP_MIG_CAP("x-lazy-restore", MIGRATION_CAPABILITY_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("x-parallel-load", MIGRATION_CAPABILITY_PARALLEL_LOAD),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
 
@@ -4317,6 +4669,8 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
+    migration_downtime_destroy(&ms->downtime_stats);
     error_free(ms->error);
 }
 
@@ -4330,6 +4684,7 @@ static void migration_instance_init(Object *obj)
     ms->pages_per_second = -1;
     qemu_sem_init(&ms->pause_sem, 0);
     qemu_mutex_init(&ms->error_mutex);
+    migration_downtime_init(&ms->downtime_stats);
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
@@ -4347,11 +4702,14 @@ static void migration_instance_init(Object *obj)
     params->has_x_checkpoint_delay = true;
     params->has_block_incremental = true;
     params->has_multifd_channels = true;
+    params->has_postcopy_fault_threads = true;
+    params->has_dirty_sync_threads = true;
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
 #ifdef CONFIG_LINUX
     params->has_zero_copy_send = true;
+    params->has_direct_io = true;
 #endif
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
@@ -4366,6 +4724,7 @@ static void migration_instance_init(Object *obj)
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
 }
 
@@ -23,6 +23,7 @@
 #include "io/channel-buffer.h"
 #include "net/announce.h"
 #include "qom/object.h"
+#include "downtime.h"
 
 struct PostcopyBlocktimeContext;
 
@@ -45,6 +46,16 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Channels that carry RAM pages: the main migration stream, and the
+ * postcopy preempt channel when postcopy-preempt is enabled.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -63,11 +74,23 @@ typedef struct {
     bool all_zero;
 } PostcopyTmpPage;
 
+/* State of one postcopy fault thread on the destination */
+typedef struct PostcopyFaultThread {
+    MigrationIncomingState *mis;
+    QemuThread thread;
+    /* Index of the thread, also the chunk of each RAMBlock it serves */
+    unsigned int index;
+    /* For the kernel to send us notifications */
+    int userfault_fd;
+    /* To notify the thread to wake, e.g., when need to quit */
+    int userfault_event_fd;
+} PostcopyFaultThread;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
-    /* Previously received RAM's RAMBlock pointer */
-    RAMBlock *last_recv_block;
+    /* Previously received RAM's RAMBlock pointer, one per RAMChannel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     /* A hook to allow cleanup at the end of incoming migration */
     void *transport_data;
     void (*transport_cleanup)(void *data);
@@ -86,22 +109,29 @@ struct MigrationIncomingState {
     AnnounceTimer  announce_timer;
 
     size_t         largest_page_size;
-    bool           have_fault_thread;
-    QemuThread     fault_thread;
-    /* Set this when we want the fault thread to quit */
+    /*
+     * Every RAMBlock is split into fault_threads_nr chunks, each registered
+     * with the userfaultfd of one fault thread.  Zero if there are no fault
+     * threads running.
+     */
+    unsigned int   fault_threads_nr;
+    PostcopyFaultThread *fault_threads;
+    /* Set this when we want the fault threads to quit */
     bool           fault_thread_quit;
 
     bool           have_listen_thread;
     QemuThread     listen_thread;
 
-    /* For the kernel to send us notifications */
-    int       userfault_fd;
-    /* To notify the fault_thread to wake, e.g., when need to quit */
-    int       userfault_event_fd;
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
-    /* RAMBlock of last request sent to source */
+    /* RAMBlock of last request sent to source, protected by rp_mutex */
     RAMBlock *last_rb;
+    /* Channel for pages the source sends urgently (postcopy-preempt) */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted when postcopy_qemufile_dst is connected, or on cleanup */
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool      have_preempt_thread;
+    QemuThread postcopy_prio_thread;
     /*
      * Number of postcopy channels including the default precopy channel, so
      * vanilla postcopy will only contain one channel which contain both
@@ -138,6 +168,9 @@ struct MigrationIncomingState {
      * */
     struct PostcopyBlocktimeContext *blocktime_ctx;
 
+    /* Where the downtime went, from the end of the load to the VM start */
+    MigrationDowntime downtime_stats;
+
     /* notify PAUSED postcopy incoming migrations to try to continue */
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
@@ -192,6 +225,15 @@ struct MigrationState {
     QEMUBH *cleanup_bh;
     /* Protected by qemu_file_lock */
     QEMUFile *to_dst_file;
+    /*
+     * Channel for pages requested by the destination (postcopy-preempt).
+     * Protected by qemu_file_lock.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Set while the preempt channel is being connected */
+    bool postcopy_preempt_connecting;
+    /* Posted once the preempt channel connection attempt has finished */
+    QemuSemaphore postcopy_qemufile_src_sem;
     QIOChannelBuffer *bioc;
     /*
      * Protects to_dst_file/from_dst_file pointers.  We need to make sure we
@@ -252,6 +294,11 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* Set by the adaptive-convergence controller at each bitmap sync */
+    int64_t projected_downtime;
+    MigrationConvergenceAction convergence_action;
+    /* Where the downtime went, from the VM stop to the completion */
+    MigrationDowntime downtime_stats;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
     /*
@@ -362,23 +409,33 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
+bool migrate_adaptive_convergence(void);
 bool migrate_use_multifd(void);
+bool migrate_use_multifd_zero_page(void);
+bool migrate_use_fixed_ram(void);
+bool migrate_lazy_restore(void);
+bool migrate_parallel_load(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+int migrate_postcopy_fault_threads(void);
+int migrate_dirty_sync_threads(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
 
 #ifdef CONFIG_LINUX
 bool migrate_use_zero_copy_send(void);
+bool migrate_use_direct_io(void);
 #else
 #define migrate_use_zero_copy_send() (false)
+#define migrate_use_direct_io() (false)
 #endif
 int migrate_use_tls(void);
 int migrate_use_xbzrle(void);
@@ -0,0 +1,223 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "multifd.h"
+
+struct lz4_data {
+    /* pages of the packet, contiguous */
+    uint8_t *buf;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+/* Multifd lz4 compression */
+
+/*
+ * lz4 compresses one contiguous block, so the pages of a packet are
+ * gathered first.  Copying them also keeps the guest from changing a
+ * page while lz4 still refers to it.
+ */
+static struct lz4_data *lz4_data_new(uint32_t zbuff_len, uint8_t id,
+                                     Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->buf = g_try_malloc(MULTIFD_PACKET_SIZE);
+    z->zbuff_len = zbuff_len;
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->buf || !z->zbuff) {
+        g_free(z->buf);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for lz4 buffers", id);
+        return NULL;
+    }
+    return z;
+}
+
+static void lz4_data_free(struct lz4_data *z)
+{
+    g_free(z->buf);
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Allocate the buffers of each channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    /* This is the maximum size of the compressed buffer */
+    p->data = lz4_data_new(LZ4_compressBound(MULTIFD_PACKET_SIZE), p->id,
+                           errp);
+    return p->data ? 0 : -1;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(z->buf + i * page_size, p->pages->block->host + p->normal[i],
+               page_size);
+    }
+
+    ret = LZ4_compress_default((const char *)z->buf, (char *)z->zbuff,
+                               p->normal_num * page_size, z->zbuff_len);
+    if (ret <= 0) {
+        error_setg(errp, "multifd %u: LZ4_compress_default failed", p->id);
+        return -1;
+    }
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = ret;
+    p->iovs_num++;
+    p->next_packet_size = ret;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Allocate the buffers of each channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->data = lz4_data_new(LZ4_compressBound(MULTIFD_PACKET_SIZE), p->id,
+                           errp);
+    return p->data ? 0 : -1;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Return the memory of the channel.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+    uint32_t in_size = p->next_packet_size;
+    size_t page_size = qemu_target_page_size();
+    uint32_t expected_size = p->normal_num * page_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u is larger "
+                   "than %u", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = LZ4_decompress_safe((const char *)z->zbuff, (char *)z->buf,
+                              in_size, expected_size);
+    if (ret != (int)expected_size) {
+        error_setg(errp, "multifd %u: packet size received %d size expected "
+                   "%u", p->id, ret, expected_size);
+        return -1;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(p->host + p->normal[i], z->buf + i * page_size, page_size);
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
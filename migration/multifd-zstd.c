@@ -12,7 +12,10 @@
 
 #include "qemu/osdep.h"
 #include <zstd.h>
+#include <zdict.h>
+#include "qemu/bswap.h"
 #include "qemu/rcu.h"
+#include "qemu/units.h"
 #include "exec/ramblock.h"
 #include "exec/target_page.h"
 #include "qapi/error.h"
@@ -309,9 +312,410 @@ static MultiFDMethods multifd_zstd_ops = {
     .recv_pages = zstd_recv_pages
 };
 
+/*
+ * Multifd zstd compression with a dictionary per RAMBlock
+ *
+ * Every packet is compressed as an independent zstd frame.  The first
+ * pages of each RAMBlock sent on a channel are kept as samples; once
+ * there are enough of them a dictionary is trained, sent to the other
+ * side at the start of the next packet and used for every later packet
+ * of that RAMBlock on that channel.  Channels process their packets in
+ * order, so both sides agree on the dictionary without further
+ * signalling.
+ */
+
+/* Size of the dictionary trained for each RAMBlock */
+#define ZSTD_DICT_SIZE (16 * KiB)
+/* Amount of pages sampled to train it */
+#define ZSTD_DICT_SAMPLES_SIZE (1 * MiB)
+
+struct zstd_dict_block {
+    /* samples collected so far, freed once the dictionary is trained */
+    uint8_t *samples;
+    size_t *sample_sizes;
+    unsigned int nr_samples;
+    /* no dictionary could be trained, compress without one */
+    bool failed;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+};
+
+struct zstd_dict_data {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    /* RAMBlock -> struct zstd_dict_block */
+    GHashTable *blocks;
+    /* trained dictionary */
+    uint8_t *dict;
+    /* packet buffer: optional dictionary then the compressed frame */
+    uint8_t *zbuff;
+    uint32_t zbuff_len;
+};
+
+static void zstd_dict_block_free(gpointer data)
+{
+    struct zstd_dict_block *b = data;
+
+    g_free(b->samples);
+    g_free(b->sample_sizes);
+    ZSTD_freeCDict(b->cdict);
+    ZSTD_freeDDict(b->ddict);
+    g_free(b);
+}
+
+static struct zstd_dict_block *zstd_dict_block_get(struct zstd_dict_data *z,
+                                                   RAMBlock *block)
+{
+    struct zstd_dict_block *b = g_hash_table_lookup(z->blocks, block);
+
+    if (!b) {
+        b = g_new0(struct zstd_dict_block, 1);
+        g_hash_table_insert(z->blocks, block, b);
+    }
+    return b;
+}
+
+static struct zstd_dict_data *zstd_dict_data_new(void)
+{
+    struct zstd_dict_data *z = g_new0(struct zstd_dict_data, 1);
+
+    z->blocks = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                      zstd_dict_block_free);
+    z->zbuff_len = sizeof(uint32_t) + ZSTD_DICT_SIZE +
+                   ZSTD_compressBound(MULTIFD_PACKET_SIZE);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    return z;
+}
+
+static void zstd_dict_data_free(struct zstd_dict_data *z)
+{
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+    g_hash_table_destroy(z->blocks);
+    g_free(z->dict);
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+/**
+ * zstd_dict_send_setup: setup send side
+ *
+ * Setup each channel with a zstd context and no dictionary.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_dict_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_dict_data *z = zstd_dict_data_new();
+    size_t res;
+
+    p->data = z;
+    z->cctx = ZSTD_createCCtx();
+    z->dict = g_try_malloc(ZSTD_DICT_SIZE);
+    if (!z->cctx || !z->zbuff || !z->dict) {
+        error_setg(errp, "multifd %u: out of memory for zstd-dict", p->id);
+        goto err;
+    }
+
+    res = ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel,
+                                 migrate_multifd_zstd_level());
+    if (ZSTD_isError(res)) {
+        error_setg(errp, "multifd %u: setting zstd level failed with %s",
+                   p->id, ZSTD_getErrorName(res));
+        goto err;
+    }
+    return 0;
+
+err:
+    zstd_dict_data_free(z);
+    p->data = NULL;
+    return -1;
+}
+
+/**
+ * zstd_dict_send_cleanup: cleanup send side
+ *
+ * Free the contexts and the dictionaries of the channel.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void zstd_dict_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    zstd_dict_data_free(p->data);
+    p->data = NULL;
+}
+
+/*
+ * Keep the pages of the packet as samples for @b and train its dictionary
+ * once there are enough of them.
+ *
+ * Returns the size of the new dictionary, stored in z->dict, or 0.
+ */
+static size_t zstd_dict_sample(MultiFDSendParams *p, struct zstd_dict_data *z,
+                               struct zstd_dict_block *b)
+{
+    size_t page_size = qemu_target_page_size();
+    unsigned int max_samples = ZSTD_DICT_SAMPLES_SIZE / page_size;
+    size_t dict_size;
+    uint32_t i;
+
+    if (!b->samples) {
+        b->samples = g_malloc(ZSTD_DICT_SAMPLES_SIZE);
+        b->sample_sizes = g_new(size_t, max_samples);
+    }
+
+    for (i = 0; i < p->normal_num && b->nr_samples < max_samples; i++) {
+        memcpy(b->samples + b->nr_samples * page_size,
+               p->pages->block->host + p->normal[i], page_size);
+        b->sample_sizes[b->nr_samples++] = page_size;
+    }
+    if (b->nr_samples < max_samples) {
+        return 0;
+    }
+
+    dict_size = ZDICT_trainFromBuffer(z->dict, ZSTD_DICT_SIZE, b->samples,
+                                      b->sample_sizes, b->nr_samples);
+    g_free(b->samples);
+    b->samples = NULL;
+    g_free(b->sample_sizes);
+    b->sample_sizes = NULL;
+
+    if (ZDICT_isError(dict_size)) {
+        /* e.g. pages that do not compress, carry on without dictionary */
+        trace_multifd_zstd_dict_train(p->id, p->pages->block->idstr, 0);
+        b->failed = true;
+        return 0;
+    }
+
+    b->cdict = ZSTD_createCDict(z->dict, dict_size,
+                                migrate_multifd_zstd_level());
+    if (!b->cdict) {
+        b->failed = true;
+        return 0;
+    }
+    trace_multifd_zstd_dict_train(p->id, p->pages->block->idstr, dict_size);
+    return dict_size;
+}
+
+/**
+ * zstd_dict_send_prepare: prepare date to be able to send
+ *
+ * Compress all the pages that we are going to send in one frame, with
+ * the dictionary of their RAMBlock if there is one.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_dict_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_dict_data *z = p->data;
+    struct zstd_dict_block *b = zstd_dict_block_get(z, p->pages->block);
+    size_t page_size = qemu_target_page_size();
+    ZSTD_outBuffer out = { .dst = z->zbuff, .size = z->zbuff_len };
+    ZSTD_inBuffer in;
+    size_t dict_size = 0;
+    size_t ret;
+    uint32_t i;
+
+    if (!b->cdict && !b->failed) {
+        dict_size = zstd_dict_sample(p, z, b);
+    }
+    if (dict_size) {
+        stl_be_p(z->zbuff, dict_size);
+        memcpy(z->zbuff + sizeof(uint32_t), z->dict, dict_size);
+        out.pos = sizeof(uint32_t) + dict_size;
+        p->flags |= MULTIFD_FLAG_ZSTD_NEW_DICT;
+    }
+
+    ZSTD_CCtx_reset(z->cctx, ZSTD_reset_session_only);
+    ret = ZSTD_CCtx_refCDict(z->cctx, b->cdict);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd %u: zstd refCDict failed with %s",
+                   p->id, ZSTD_getErrorName(ret));
+        return -1;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        ZSTD_EndDirective end = ZSTD_e_continue;
+
+        if (i == p->normal_num - 1) {
+            end = ZSTD_e_end;
+        }
+        in.src = p->pages->block->host + p->normal[i];
+        in.size = page_size;
+        in.pos = 0;
+
+        /* Same loop as zstd_send_prepare() */
+        do {
+            ret = ZSTD_compressStream2(z->cctx, &out, &in, end);
+        } while (ret > 0 && (in.size - in.pos > 0)
+                         && (out.size - out.pos > 0));
+        if (ret > 0 && (in.size - in.pos > 0)) {
+            error_setg(errp, "multifd %u: compressStream buffer too small",
+                       p->id);
+            return -1;
+        }
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: compressStream error %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out.pos;
+    p->iovs_num++;
+    p->next_packet_size = out.pos;
+    p->flags |= MULTIFD_FLAG_ZSTD_DICT;
+
+    return 0;
+}
+
+/**
+ * zstd_dict_recv_setup: setup receive side
+ *
+ * Create the decompression context and buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_dict_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct zstd_dict_data *z = zstd_dict_data_new();
+
+    p->data = z;
+    z->dctx = ZSTD_createDCtx();
+    if (!z->dctx || !z->zbuff) {
+        zstd_dict_data_free(z);
+        p->data = NULL;
+        error_setg(errp, "multifd %u: out of memory for zstd-dict", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * zstd_dict_recv_cleanup: cleanup receive side
+ *
+ * Free the context and the dictionaries of the channel.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void zstd_dict_recv_cleanup(MultiFDRecvParams *p)
+{
+    zstd_dict_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * zstd_dict_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the packet, take the new dictionary it may start with, and
+ * uncompress the frame into the actual pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_dict_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    struct zstd_dict_data *z = p->data;
+    struct zstd_dict_block *b = zstd_dict_block_get(z, p->block);
+    uint32_t in_size = p->next_packet_size;
+    size_t page_size = qemu_target_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    ZSTD_inBuffer in = { .src = z->zbuff, .size = in_size };
+    ZSTD_outBuffer out;
+    size_t ret;
+    uint32_t i;
+
+    if (flags != MULTIFD_FLAG_ZSTD_DICT) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_ZSTD_DICT);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u is larger "
+                   "than %u", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    if (qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp)) {
+        return -1;
+    }
+
+    if (p->flags & MULTIFD_FLAG_ZSTD_NEW_DICT) {
+        uint32_t dict_size = in_size >= sizeof(uint32_t) ? ldl_be_p(z->zbuff)
+                                                          : UINT32_MAX;
+
+        if (dict_size > ZSTD_DICT_SIZE ||
+            dict_size > in_size - sizeof(uint32_t)) {
+            error_setg(errp, "multifd %u: invalid zstd dictionary size %u",
+                       p->id, dict_size);
+            return -1;
+        }
+        ZSTD_freeDDict(b->ddict);
+        b->ddict = ZSTD_createDDict(z->zbuff + sizeof(uint32_t), dict_size);
+        if (!b->ddict) {
+            error_setg(errp, "multifd %u: zstd createDDict failed", p->id);
+            return -1;
+        }
+        in.pos = sizeof(uint32_t) + dict_size;
+    }
+
+    ZSTD_DCtx_reset(z->dctx, ZSTD_reset_session_only);
+    ret = ZSTD_DCtx_refDDict(z->dctx, b->ddict);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd %u: zstd refDDict failed with %s",
+                   p->id, ZSTD_getErrorName(ret));
+        return -1;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        out.dst = p->host + p->normal[i];
+        out.size = page_size;
+        out.pos = 0;
+
+        /* Same loop as zstd_recv_pages() */
+        do {
+            ret = ZSTD_decompressStream(z->dctx, &out, &in);
+        } while (ret > 0 && (in.size - in.pos > 0)
+                         && (out.pos < page_size));
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: decompressStream returned %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (out.pos < page_size) {
+            error_setg(errp, "multifd %u: packet ended before page %u of %u",
+                       p->id, i, p->normal_num);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_zstd_dict_ops = {
+    .send_setup = zstd_dict_send_setup,
+    .send_cleanup = zstd_dict_send_cleanup,
+    .send_prepare = zstd_dict_send_prepare,
+    .recv_setup = zstd_dict_recv_setup,
+    .recv_cleanup = zstd_dict_recv_cleanup,
+    .recv_pages = zstd_dict_recv_pages
+};
+
 static void multifd_zstd_register(void)
 {
     multifd_register_ops(MULTIFD_COMPRESSION_ZSTD, &multifd_zstd_ops);
+    multifd_register_ops(MULTIFD_COMPRESSION_ZSTD_DICT,
+                         &multifd_zstd_dict_ops);
 }
 
 migration_init(multifd_zstd_register);
@@ -12,6 +12,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,6 +24,7 @@
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "tls.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -31,6 +36,15 @@
 
 /* Multiple fd's */
 
+/*
+ * With fixed-ram the channels write pages straight to their place in the
+ * file: there are no packets, and nothing to receive on the other side.
+ */
+static bool multifd_use_packets(void)
+{
+    return !migrate_use_fixed_ram();
+}
+
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
 
@@ -263,6 +277,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->normal_pages = cpu_to_be32(p->normal_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
 
@@ -276,6 +291,13 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    for (i = 0; i < p->zero_num; i++) {
+        /* there are architectures where ram_addr_t is 32 bit */
+        uint64_t temp = p->zero[i];
+
+        packet->offset[p->normal_num + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -324,10 +346,23 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+        error_setg(errp, "multifd: received packet "
+                   "with %u zero pages and expected maximum pages are %u",
+                   p->zero_num, packet->pages_alloc - p->normal_num) ;
+        return -1;
+    }
+    if (p->zero_num && !migrate_use_multifd_zero_page()) {
+        error_setg(errp, "multifd: received zero pages but the "
+                   "multifd-zero-page capability is not enabled");
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->normal_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -340,6 +375,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->block = block;
     p->host = block->host;
     for (i = 0; i < p->normal_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
@@ -353,6 +389,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
+
+        if (offset > (block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+        p->zero[i] = offset;
+    }
+
     return 0;
 }
 
@@ -374,6 +422,81 @@ struct {
     MultiFDMethods *ops;
 } *multifd_send_state;
 
+/*
+ * Per channel counters.  They live outside multifd_send_state so that
+ * they can still be queried once the migration has finished.
+ */
+typedef struct {
+    /* normal pages handed to the channel */
+    Stat64 pages;
+    /* bytes of page data before and after send_prepare */
+    Stat64 in_bytes;
+    Stat64 out_bytes;
+    /* thread CPU time spent in send_prepare */
+    Stat64 prepare_ns;
+} MultiFDSendCounters;
+
+static MultiFDSendCounters *multifd_send_counters;
+static int multifd_send_counters_num;
+
+/* CPU time of the current thread, or wall clock time if not available */
+static int64_t multifd_thread_clock_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+    }
+#endif
+    return get_clock();
+}
+
+MultiFDChannelStatsList *multifd_channel_stats(void)
+{
+    MultiFDChannelStatsList *head = NULL;
+    int i;
+
+    for (i = multifd_send_counters_num - 1; i >= 0; i--) {
+        MultiFDSendCounters *c = &multifd_send_counters[i];
+        MultiFDChannelStats *stats = g_new0(MultiFDChannelStats, 1);
+        uint64_t in_bytes = stat64_get(&c->in_bytes);
+        uint64_t out_bytes = stat64_get(&c->out_bytes);
+
+        stats->id = i;
+        stats->pages = stat64_get(&c->pages);
+        stats->bytes = out_bytes;
+        if (out_bytes) {
+            stats->compression_ratio = (double)in_bytes / out_bytes;
+        }
+        if (in_bytes) {
+            stats->cpu_time_per_mb = (double)stat64_get(&c->prepare_ns) /
+                                     SCALE_US / ((double)in_bytes / MiB);
+        }
+        QAPI_LIST_PREPEND(head, stats);
+    }
+    return head;
+}
+
+/*
+ * Report what the channel has sent since the last call to the transfer
+ * counters.  Pages were accounted as normal when they were queued; only
+ * the channel knows which of them were zero and so were not sent at all.
+ *
+ * Called with p->mutex held, from the migration thread.
+ */
+static void multifd_send_account(QEMUFile *f, MultiFDSendParams *p)
+{
+    qemu_file_update_transfer(f, p->bytes_unaccounted);
+    ram_counters.multifd_bytes += p->bytes_unaccounted;
+    ram_counters.transferred += p->bytes_unaccounted;
+    p->bytes_unaccounted = 0;
+
+    ram_counters.normal -= p->zero_pages_unaccounted;
+    ram_counters.duplicate += p->zero_pages_unaccounted;
+    p->zero_pages_unaccounted = 0;
+}
+
 /*
  * How we use multifd_send_state->pages and channel->pages?
  *
@@ -398,7 +521,6 @@ static int multifd_send_pages(QEMUFile *f)
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     if (qatomic_read(&multifd_send_state->exiting)) {
         return -1;
@@ -433,11 +555,16 @@ static int multifd_send_pages(QEMUFile *f)
     p->packet_num = multifd_send_state->packet_num++;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->num) * qemu_target_page_size()
-                + p->packet_len;
-    qemu_file_update_transfer(f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;
+    /*
+     * The page data is accounted once the channel has found out which
+     * pages are zero, here only the previous job of the channel is.
+     */
+    multifd_send_account(f, p);
+    if (multifd_use_packets()) {
+        qemu_file_update_transfer(f, p->packet_len);
+        ram_counters.multifd_bytes += p->packet_len;
+        ram_counters.transferred += p->packet_len;
+    }
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -535,7 +662,11 @@ void multifd_save_cleanup(void)
         if (p->registered_yank) {
             migration_ioc_unregister_yank(p->c);
         }
-        socket_send_channel_destroy(p->c);
+        if (multifd_use_packets()) {
+            socket_send_channel_destroy(p->c);
+        } else {
+            object_unref(OBJECT(p->c));
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -551,6 +682,8 @@ void multifd_save_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -610,9 +743,11 @@ int multifd_send_sync_main(QEMUFile *f)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
+        if (multifd_use_packets()) {
+            qemu_file_update_transfer(f, p->packet_len);
+            ram_counters.multifd_bytes += p->packet_len;
+            ram_counters.transferred += p->packet_len;
+        }
         qemu_mutex_unlock(&p->mutex);
         qemu_sem_post(&p->sem);
 
@@ -632,28 +767,75 @@ int multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account(f, p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 
     return 0;
 }
 
+/*
+ * Write the pages of a fixed-ram migration to their offset in the file,
+ * one call per run of contiguous pages, and record in the file bitmap
+ * which pages are present.
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, RAMBlock *rb,
+                                    Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, j, n;
+
+    for (i = 0; i < p->zero_num; i++) {
+        clear_bit_atomic(p->zero[i] / page_size, rb->file_bmap);
+    }
+
+    for (i = 0; i < p->normal_num; i += n) {
+        ram_addr_t start = p->normal[i];
+
+        for (n = 0; i + n < p->normal_num &&
+                    p->normal[i + n] == start + n * page_size; n++) {
+            p->iov[n].iov_base = rb->host + p->normal[i + n];
+            p->iov[n].iov_len = page_size;
+        }
+
+        if (qio_channel_pwritev_all(p->c, p->iov, n,
+                                    rb->pages_offset + start, errp) < 0) {
+            return -1;
+        }
+
+        for (j = i; j < i + n; j++) {
+            set_bit_atomic(p->normal[j] / page_size, rb->file_bmap);
+        }
+    }
+
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
     Error *local_err = NULL;
     int ret = 0;
     bool use_zero_copy_send = migrate_use_zero_copy_send();
+    bool use_packets = multifd_use_packets();
+    bool use_zero_page = migrate_use_multifd_zero_page() || !use_packets;
+    size_t page_size = qemu_target_page_size();
+    MultiFDSendCounters *c = &multifd_send_counters[p->id];
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    if (use_packets) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -666,7 +848,10 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
+            RAMBlock *rb = p->pages->block;
             p->normal_num = 0;
+            p->zero_num = 0;
+            p->next_packet_size = 0;
 
             if (use_zero_copy_send) {
                 p->iovs_num = 0;
@@ -675,45 +860,76 @@ static void *multifd_send_thread(void *opaque)
             }
 
             for (int i = 0; i < p->pages->num; i++) {
-                p->normal[p->normal_num] = p->pages->offset[i];
-                p->normal_num++;
+                ram_addr_t offset = p->pages->offset[i];
+
+                if (use_zero_page &&
+                    buffer_is_zero(rb->host + offset, page_size)) {
+                    p->zero[p->zero_num] = offset;
+                    p->zero_num++;
+                } else {
+                    p->normal[p->normal_num] = offset;
+                    p->normal_num++;
+                }
             }
 
-            if (p->normal_num) {
-                ret = multifd_send_state->ops->send_prepare(p, &local_err);
-                if (ret != 0) {
-                    qemu_mutex_unlock(&p->mutex);
-                    break;
+            if (use_packets) {
+                if (p->normal_num) {
+                    int64_t start = multifd_thread_clock_ns();
+
+                    ret = multifd_send_state->ops->send_prepare(p,
+                                                                &local_err);
+                    if (ret != 0) {
+                        qemu_mutex_unlock(&p->mutex);
+                        break;
+                    }
+                    stat64_add(&c->prepare_ns,
+                               multifd_thread_clock_ns() - start);
+                    stat64_add(&c->out_bytes, p->next_packet_size);
                 }
+                multifd_send_fill_packet(p);
+            } else {
+                stat64_add(&c->out_bytes, p->normal_num * page_size);
             }
-            multifd_send_fill_packet(p);
+            stat64_add(&c->pages, p->normal_num);
+            stat64_add(&c->in_bytes, p->normal_num * page_size);
             p->flags = 0;
             p->num_packets++;
             p->total_normal_pages += p->normal_num;
+            p->total_zero_pages += p->zero_num;
+            p->zero_pages_unaccounted += p->zero_num;
+            p->bytes_unaccounted += (uint64_t)p->normal_num * page_size;
             p->pages->num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, p->normal_num, flags,
-                               p->next_packet_size);
+            trace_multifd_send(p->id, packet_num, p->normal_num, p->zero_num,
+                               flags, p->next_packet_size);
 
-            if (use_zero_copy_send) {
-                /* Send header first, without zerocopy */
-                ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                            p->packet_len, &local_err);
+            if (!use_packets) {
+                ret = multifd_file_write_pages(p, rb, &local_err);
                 if (ret != 0) {
                     break;
                 }
             } else {
-                /* Send header using the same writev call */
-                p->iov[0].iov_len = p->packet_len;
-                p->iov[0].iov_base = p->packet;
-            }
+                if (use_zero_copy_send) {
+                    /* Send header first, without zerocopy */
+                    ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                                p->packet_len, &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                } else {
+                    /* Send header using the same writev call */
+                    p->iov[0].iov_len = p->packet_len;
+                    p->iov[0].iov_base = p->packet;
+                }
 
-            ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num, NULL,
-                                              0, p->write_flags, &local_err);
-            if (ret != 0) {
-                break;
+                ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
+                                                  NULL, 0, p->write_flags,
+                                                  &local_err);
+                if (ret != 0) {
+                    break;
+                }
             }
 
             qemu_mutex_lock(&p->mutex);
@@ -754,7 +970,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -898,6 +1115,29 @@ cleanup:
     multifd_new_send_channel_cleanup(p, sioc, local_err);
 }
 
+static void multifd_new_send_channel_create(MultiFDSendParams *p)
+{
+    Error *local_err = NULL;
+    QIOChannel *ioc;
+
+    if (multifd_use_packets()) {
+        socket_send_channel_create(multifd_new_send_channel_async, p);
+        return;
+    }
+
+    /* Files need no connection, open the channel right away */
+    ioc = file_send_channel_create(&local_err);
+    if (!ioc) {
+        multifd_new_send_channel_cleanup(p, NULL, local_err);
+        return;
+    }
+
+    p->c = ioc;
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
 int multifd_save_setup(Error **errp)
 {
     int thread_count;
@@ -919,6 +1159,9 @@ int multifd_save_setup(Error **errp)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    g_free(multifd_send_counters);
+    multifd_send_counters = g_new0(MultiFDSendCounters, thread_count);
+    multifd_send_counters_num = thread_count;
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -939,6 +1182,7 @@ int multifd_save_setup(Error **errp)
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, page_count + 1);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
 
         if (migrate_use_zero_copy_send()) {
             p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
@@ -946,7 +1190,7 @@ int multifd_save_setup(Error **errp)
             p->write_flags = 0;
         }
 
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        multifd_new_send_channel_create(p);
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1013,7 +1257,8 @@ int multifd_load_cleanup(Error **errp)
 {
     int i;
 
-    if (!migrate_use_multifd() || !migrate_multi_channels_is_allowed()) {
+    if (!migrate_use_multifd() || !migrate_multi_channels_is_allowed() ||
+        !multifd_use_packets()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1047,6 +1292,8 @@ int multifd_load_cleanup(Error **errp)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1062,7 +1309,7 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_use_packets()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1120,10 +1367,11 @@ static void *multifd_recv_thread(void *opaque)
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, p->normal_num, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
+                           flags, p->next_packet_size);
         p->num_packets++;
         p->total_normal_pages += p->normal_num;
+        p->total_zero_pages += p->zero_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (p->normal_num) {
@@ -1133,6 +1381,11 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        for (int i = 0; i < p->zero_num; i++) {
+            ram_handle_compressed(p->host + p->zero[i], 0,
+                                  qemu_target_page_size());
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1148,7 +1401,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1159,7 +1413,7 @@ int multifd_load_setup(Error **errp)
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_use_packets()) {
         return 0;
     }
     if (!migrate_multi_channels_is_allowed()) {
@@ -1186,6 +1440,7 @@ int multifd_load_setup(Error **errp)
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1206,7 +1461,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_use_packets()) {
         return true;
     }
 
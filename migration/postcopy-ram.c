@@ -33,6 +33,9 @@
 #include "trace.h"
 #include "hw/boards.h"
 #include "exec/ramblock.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
+#include "yank_functions.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -84,10 +87,10 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp)
  */
 void postcopy_thread_create(MigrationIncomingState *mis,
                             QemuThread *thread, const char *name,
-                            void *(*fn)(void *), int joinable)
+                            void *(*fn)(void *), void *opaque, int joinable)
 {
     qemu_sem_init(&mis->thread_sync_sem, 0);
-    qemu_thread_create(thread, name, fn, mis, joinable);
+    qemu_thread_create(thread, name, fn, opaque, joinable);
     qemu_sem_wait(&mis->thread_sync_sem);
     qemu_sem_destroy(&mis->thread_sync_sem);
 }
@@ -487,6 +490,47 @@ static int init_range(RAMBlock *rb, void *opaque)
     return 0;
 }
 
+/*
+ * Each RAMBlock is split into one chunk per fault thread, registered with
+ * the userfaultfd of that thread.  Chunks are aligned to the page size of
+ * the block so that a host page is always served by a single thread.
+ */
+static ram_addr_t postcopy_fault_chunk_size(MigrationIncomingState *mis,
+                                            RAMBlock *rb)
+{
+    return ROUND_UP(DIV_ROUND_UP(rb->postcopy_length, mis->fault_threads_nr),
+                    qemu_ram_pagesize(rb));
+}
+
+/* Returns the fault thread whose userfaultfd covers @offset in @rb */
+static PostcopyFaultThread *
+postcopy_fault_thread_of(MigrationIncomingState *mis, RAMBlock *rb,
+                         ram_addr_t offset)
+{
+    return &mis->fault_threads[offset / postcopy_fault_chunk_size(mis, rb)];
+}
+
+/* Close the file descriptors of the fault threads and free them */
+static void postcopy_fault_threads_free(MigrationIncomingState *mis,
+                                        unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        PostcopyFaultThread *ft = &mis->fault_threads[i];
+
+        if (ft->userfault_fd != -1) {
+            close(ft->userfault_fd);
+        }
+        if (ft->userfault_event_fd != -1) {
+            close(ft->userfault_event_fd);
+        }
+    }
+    g_free(mis->fault_threads);
+    mis->fault_threads = NULL;
+    mis->fault_threads_nr = 0;
+}
+
 /*
  * At the end of migration, undo the effects of init_range
  * opaque should be the MIS.
@@ -498,7 +542,9 @@ static int cleanup_range(RAMBlock *rb, void *opaque)
     ram_addr_t offset = qemu_ram_get_offset(rb);
     ram_addr_t length = rb->postcopy_length;
     MigrationIncomingState *mis = opaque;
+    ram_addr_t chunk = postcopy_fault_chunk_size(mis, rb);
     struct uffdio_range range_struct;
+    ram_addr_t start;
     trace_postcopy_cleanup_range(block_name, host_addr, offset, length);
 
     /*
@@ -512,13 +558,18 @@ static int cleanup_range(RAMBlock *rb, void *opaque)
      * pages.   It can be useful to leave it on to debug postcopy
      * if you're not sure it's always getting every page.
      */
-    range_struct.start = (uintptr_t)host_addr;
-    range_struct.len = length;
+    for (start = 0; start < length; start += chunk) {
+        PostcopyFaultThread *ft = postcopy_fault_thread_of(mis, rb, start);
 
-    if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
-        error_report("%s: userfault unregister %s", __func__, strerror(errno));
+        range_struct.start = (uintptr_t)host_addr + start;
+        range_struct.len = MIN(chunk, length - start);
 
-        return -1;
+        if (ioctl(ft->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+            error_report("%s: userfault unregister %s", __func__,
+                         strerror(errno));
+
+            return -1;
+        }
     }
 
     return 0;
@@ -567,14 +618,22 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
-    if (mis->have_fault_thread) {
+    /* The preempt thread places pages through the fault threads' fds */
+    if (mis->have_preempt_thread) {
+        postcopy_preempt_thread_join(mis);
+    }
+
+    if (mis->fault_threads_nr) {
         Error *local_err = NULL;
+        unsigned int i;
 
-        /* Let the fault thread quit */
+        /* Let the fault threads quit */
         qatomic_set(&mis->fault_thread_quit, 1);
         postcopy_fault_thread_notify(mis);
         trace_postcopy_ram_incoming_cleanup_join();
-        qemu_thread_join(&mis->fault_thread);
+        for (i = 0; i < mis->fault_threads_nr; i++) {
+            qemu_thread_join(&mis->fault_threads[i].thread);
+        }
 
         if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_END, &local_err)) {
             error_report_err(local_err);
@@ -586,9 +645,7 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
 
         trace_postcopy_ram_incoming_cleanup_closeuf();
-        close(mis->userfault_fd);
-        close(mis->userfault_event_fd);
-        mis->have_fault_thread = false;
+        postcopy_fault_threads_free(mis, mis->fault_threads_nr);
     }
 
     if (enable_mlock) {
@@ -659,23 +716,32 @@ int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
 static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    ram_addr_t length = rb->postcopy_length;
+    ram_addr_t chunk = postcopy_fault_chunk_size(mis, rb);
     struct uffdio_register reg_struct;
+    ram_addr_t start;
 
-    reg_struct.range.start = (uintptr_t)qemu_ram_get_host_addr(rb);
-    reg_struct.range.len = rb->postcopy_length;
-    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+    for (start = 0; start < length; start += chunk) {
+        PostcopyFaultThread *ft = postcopy_fault_thread_of(mis, rb, start);
 
-    /* Now tell our userfault_fd that it's responsible for this area */
-    if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
-        error_report("%s userfault register: %s", __func__, strerror(errno));
-        return -1;
-    }
-    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
-        error_report("%s userfault: Region doesn't support COPY", __func__);
-        return -1;
-    }
-    if (reg_struct.ioctls & ((__u64)1 << _UFFDIO_ZEROPAGE)) {
-        qemu_ram_set_uf_zeroable(rb);
+        reg_struct.range.start = (uintptr_t)qemu_ram_get_host_addr(rb) + start;
+        reg_struct.range.len = MIN(chunk, length - start);
+        reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+        /* Now tell this thread's userfault_fd that it's responsible for it */
+        if (ioctl(ft->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+            error_report("%s userfault register: %s", __func__,
+                         strerror(errno));
+            return -1;
+        }
+        if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
+            error_report("%s userfault: Region doesn't support COPY",
+                         __func__);
+            return -1;
+        }
+        if (reg_struct.ioctls & ((__u64)1 << _UFFDIO_ZEROPAGE)) {
+            qemu_ram_set_uf_zeroable(rb);
+        }
     }
 
     return 0;
@@ -899,32 +965,35 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 }
 
 /*
- * Handle faults detected by the USERFAULT markings
+ * Handle faults detected by the USERFAULT markings on the chunks of RAM
+ * registered with this thread's userfaultfd
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
-    MigrationIncomingState *mis = opaque;
+    PostcopyFaultThread *ft = opaque;
+    MigrationIncomingState *mis = ft->mis;
     struct uffd_msg msg;
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
 
-    trace_postcopy_ram_fault_thread_entry();
+    trace_postcopy_ram_fault_thread_entry(ft->index);
     rcu_register_thread();
-    mis->last_rb = NULL; /* last RAMBlock we sent part of */
     qemu_sem_post(&mis->thread_sync_sem);
 
     struct pollfd *pfd;
-    size_t pfd_len = 2 + mis->postcopy_remote_fds->len;
+    /* Faults from external processes on shared memory go to thread 0 */
+    size_t remote_len = ft->index ? 0 : mis->postcopy_remote_fds->len;
+    size_t pfd_len = 2 + remote_len;
 
     pfd = g_new0(struct pollfd, pfd_len);
 
-    pfd[0].fd = mis->userfault_fd;
+    pfd[0].fd = ft->userfault_fd;
     pfd[0].events = POLLIN;
-    pfd[1].fd = mis->userfault_event_fd;
+    pfd[1].fd = ft->userfault_event_fd;
     pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
-    trace_postcopy_ram_fault_thread_fds_core(pfd[0].fd, pfd[1].fd);
-    for (index = 0; index < mis->postcopy_remote_fds->len; index++) {
+    trace_postcopy_ram_fault_thread_fds_core(ft->index, pfd[0].fd, pfd[1].fd);
+    for (index = 0; index < remote_len; index++) {
         struct PostCopyFD *pcfd = &g_array_index(mis->postcopy_remote_fds,
                                                  struct PostCopyFD, index);
         pfd[2 + index].fd = pcfd->fd;
@@ -962,20 +1031,20 @@ static void *postcopy_ram_fault_thread(void *opaque)
             uint64_t tmp64 = 0;
 
             /* Consume the signal */
-            if (read(mis->userfault_event_fd, &tmp64, 8) != 8) {
+            if (read(ft->userfault_event_fd, &tmp64, 8) != 8) {
                 /* Nothing obviously nicer than posting this error. */
                 error_report("%s: read() failed", __func__);
             }
 
             if (qatomic_read(&mis->fault_thread_quit)) {
-                trace_postcopy_ram_fault_thread_quit();
+                trace_postcopy_ram_fault_thread_quit(ft->index);
                 break;
             }
         }
 
         if (pfd[0].revents) {
             poll_result--;
-            ret = read(mis->userfault_fd, &msg, sizeof(msg));
+            ret = read(ft->userfault_fd, &msg, sizeof(msg));
             if (ret != sizeof(msg)) {
                 if (errno == EAGAIN) {
                     /*
@@ -1091,19 +1160,81 @@ retry:
         }
     }
     rcu_unregister_thread();
-    trace_postcopy_ram_fault_thread_exit();
+    trace_postcopy_ram_fault_thread_exit(ft->index);
     g_free(pfd);
     return NULL;
 }
 
+/*
+ * Load the pages sent on the postcopy preempt channel, in parallel with
+ * the listen thread loading the main channel.  The source ends the channel
+ * with RAM_SAVE_FLAG_EOS.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret = 0;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+    qemu_sem_post(&mis->thread_sync_sem);
+
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    if (mis->postcopy_qemufile_dst) {
+        /*
+         * RAMBlocks cannot go away while an incoming migration is running,
+         * so don't hold the RCU read lock for the whole of postcopy.
+         */
+        ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                RAM_CHANNEL_POSTCOPY);
+    }
+
+    /*
+     * Faulting vCPUs wait for pages from this channel, so fail the main
+     * channel too; the listen thread then fails or pauses the migration.
+     * postcopy_preempt_thread_join() shuts the channel down on purpose
+     * after a failure.
+     */
+    if (ret < 0 && mis->state != MIGRATION_STATUS_FAILED) {
+        error_report("%s: Failed to load pages from the preempt channel: %s",
+                     __func__, strerror(-ret));
+        qemu_file_set_error(mis->from_src_file, ret);
+        qemu_file_shutdown(mis->from_src_file);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
+static void postcopy_preempt_thread_join(MigrationIncomingState *mis)
+{
+    /* In case the source never connected the channel */
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+
+    /*
+     * On success, the source ends the channel once all the pages were
+     * sent; only a failed migration needs to kick the thread out.
+     */
+    if (mis->state == MIGRATION_STATUS_FAILED && mis->postcopy_qemufile_dst) {
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    qemu_thread_join(&mis->postcopy_prio_thread);
+    mis->have_preempt_thread = false;
+}
+
 static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
 {
     PostcopyTmpPage *tmp_page;
     int err, i, channels;
     void *temp_page;
 
-    /* TODO: will be boosted when enable postcopy preemption */
-    mis->postcopy_channels = 1;
+    if (migrate_postcopy_preempt()) {
+        mis->postcopy_channels = RAM_CHANNEL_MAX;
+    } else {
+        mis->postcopy_channels = 1;
+    }
 
     channels = mis->postcopy_channels;
     mis->postcopy_tmp_pages = g_malloc0_n(sizeof(PostcopyTmpPage), channels);
@@ -1143,11 +1274,12 @@ static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
     return 0;
 }
 
-int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
+static int postcopy_fault_thread_open(MigrationIncomingState *mis,
+                                      PostcopyFaultThread *ft)
 {
     /* Open the fd for the kernel to give us userfaults */
-    mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
-    if (mis->userfault_fd == -1) {
+    ft->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ft->userfault_fd == -1) {
         error_report("%s: Failed to open userfault fd: %s", __func__,
                      strerror(errno));
         return -1;
@@ -1157,22 +1289,49 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
      * Although the host check already tested the API, we need to
      * do the check again as an ABI handshake on the new fd.
      */
-    if (!ufd_check_and_apply(mis->userfault_fd, mis)) {
+    if (!ufd_check_and_apply(ft->userfault_fd, mis)) {
         return -1;
     }
 
     /* Now an eventfd we use to tell the fault-thread to quit */
-    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
-    if (mis->userfault_event_fd == -1) {
+    ft->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (ft->userfault_event_fd == -1) {
         error_report("%s: Opening userfault_event_fd: %s", __func__,
                      strerror(errno));
-        close(mis->userfault_fd);
         return -1;
     }
 
-    postcopy_thread_create(mis, &mis->fault_thread, "postcopy/fault",
-                           postcopy_ram_fault_thread, QEMU_THREAD_JOINABLE);
-    mis->have_fault_thread = true;
+    return 0;
+}
+
+int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
+{
+    unsigned int i, nr = migrate_postcopy_fault_threads();
+
+    mis->fault_threads = g_new0(PostcopyFaultThread, nr);
+    for (i = 0; i < nr; i++) {
+        mis->fault_threads[i].mis = mis;
+        mis->fault_threads[i].index = i;
+        mis->fault_threads[i].userfault_fd = -1;
+        mis->fault_threads[i].userfault_event_fd = -1;
+    }
+    for (i = 0; i < nr; i++) {
+        if (postcopy_fault_thread_open(mis, &mis->fault_threads[i])) {
+            postcopy_fault_threads_free(mis, nr);
+            return -1;
+        }
+    }
+
+    mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    for (i = 0; i < nr; i++) {
+        g_autofree char *name = i ? g_strdup_printf("postcopy/fault%u", i) :
+                                    g_strdup("postcopy/fault");
+
+        postcopy_thread_create(mis, &mis->fault_threads[i].thread, name,
+                               postcopy_ram_fault_thread,
+                               &mis->fault_threads[i], QEMU_THREAD_JOINABLE);
+    }
+    mis->fault_threads_nr = nr;
 
     /* Mark so that we get notified of accesses to unwritten areas */
     if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
@@ -1185,6 +1344,13 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
+    if (migrate_postcopy_preempt()) {
+        postcopy_thread_create(mis, &mis->postcopy_prio_thread,
+                               "postcopy/preempt", postcopy_preempt_thread,
+                               mis, QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1193,7 +1359,9 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
-    int userfault_fd = mis->userfault_fd;
+    ram_addr_t offset = (uintptr_t)host_addr -
+                        (uintptr_t)qemu_ram_get_host_addr(rb);
+    int userfault_fd = postcopy_fault_thread_of(mis, rb, offset)->userfault_fd;
     int ret;
 
     if (from_addr) {
@@ -1382,15 +1550,135 @@ void postcopy_temp_page_reset(PostcopyTmpPage *tmp_page)
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
+    unsigned int i;
 
     /*
-     * Wakeup the fault_thread.  It's an eventfd that should currently
+     * Wakeup the fault threads.  Each has an eventfd that should currently
      * be at 0, we're going to increment it to 1
      */
-    if (write(mis->userfault_event_fd, &tmp64, 8) != 8) {
-        /* Not much we can do here, but may as well report it */
-        error_report("%s: incrementing failed: %s", __func__,
-                     strerror(errno));
+    for (i = 0; i < mis->fault_threads_nr; i++) {
+        if (write(mis->fault_threads[i].userfault_event_fd, &tmp64, 8) != 8) {
+            /* Not much we can do here, but may as well report it */
+            error_report("%s: incrementing failed: %s", __func__,
+                         strerror(errno));
+        }
+    }
+}
+
+/*
+ * Postcopy preemption: the pages requested by the destination are sent
+ * on a separate channel, so that they do not wait behind the background
+ * pages already queued on the main channel.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* It is loaded by its own thread, not by a coroutine */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+}
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (!s->postcopy_preempt_connecting) {
+        /* The migration was cleaned up in the meantime */
+        object_unref(OBJECT(ioc));
+        return;
+    }
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        /* postcopy_start() fails the migration when it finds no channel */
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        QEMUFile *file;
+
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        migration_ioc_register_yank(ioc);
+        file = qemu_fopen_channel_output(ioc);
+        qemu_mutex_lock(&s->qemu_file_lock);
+        s->postcopy_qemufile_src = file;
+        qemu_mutex_unlock(&s->qemu_file_lock);
+    }
+    trace_postcopy_preempt_send_setup_done(s->postcopy_qemufile_src != NULL);
+    object_unref(OBJECT(ioc));
+
+    s->postcopy_preempt_connecting = false;
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/* Start connecting the preempt channel, after the main channel connected */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (!migrate_multi_channels_is_allowed()) {
+        error_setg(errp, "Postcopy preempt is not supported by current "
+                   "protocol");
+        return -1;
+    }
+    if (migrate_use_tls()) {
+        error_setg(errp, "Postcopy preempt is not supported with TLS");
+        return -1;
+    }
+
+    trace_postcopy_preempt_send_setup();
+    s->postcopy_preempt_connecting = true;
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+
+    return 0;
+}
+
+/*
+ * Wait for the preempt channel to be connected.  Must be called without
+ * the BQL, since the connection completes in the main loop.
+ *
+ * Returns 0 if the channel is connected or not needed, -1 otherwise.
+ */
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+
+    return s->postcopy_qemufile_src ? 0 : -1;
+}
+
+/* Stop using the preempt channel, e.g. when postcopy is paused */
+void postcopy_preempt_close(MigrationState *s)
+{
+    QEMUFile *file;
+
+    qemu_mutex_lock(&s->qemu_file_lock);
+    file = s->postcopy_qemufile_src;
+    s->postcopy_qemufile_src = NULL;
+    qemu_mutex_unlock(&s->qemu_file_lock);
+
+    if (file) {
+        migration_ioc_unregister_yank_from_file(file);
+        qemu_file_shutdown(file);
+        qemu_fclose(file);
+    }
+}
+
+void postcopy_preempt_cleanup(MigrationState *s)
+{
+    /* A connection still in progress drops its channel when it completes */
+    s->postcopy_preempt_connecting = false;
+    postcopy_preempt_close(s);
+
+    /* Consume a completion postcopy_start() never waited for */
+    while (!qemu_sem_timedwait(&s->postcopy_qemufile_src_sem, 0)) {
+        /* nothing */
     }
 }
 
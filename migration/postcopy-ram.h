@@ -106,6 +106,13 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/* Postcopy preempt channel, see the postcopy-preempt capability */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+void postcopy_preempt_close(MigrationState *s);
+void postcopy_preempt_cleanup(MigrationState *s);
+
 /*
  * To be called once at the start before any device initialisation
  */
@@ -137,7 +144,7 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp);
 
 void postcopy_thread_create(MigrationIncomingState *mis,
                             QemuThread *thread, const char *name,
-                            void *(*fn)(void *), int joinable);
+                            void *(*fn)(void *), void *opaque, int joinable);
 
 struct PostCopyFD;
 
@@ -867,3 +867,36 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
 {
     return file->has_ioc ? QIO_CHANNEL(file->opaque) : NULL;
 }
+
+/*
+ * Move the I/O position of a file backed by a seekable channel to
+ * @offset.  Pending output is flushed first, buffered input is
+ * dropped.  Errors are reported through the file's error state.
+ */
+void qemu_set_offset(QEMUFile *f, int64_t offset)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -EINVAL);
+        return;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (qemu_file_get_error(f)) {
+        return;
+    }
+
+    if (qio_channel_io_seek(ioc, offset, SEEK_SET, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_err);
+        return;
+    }
+    f->pos = offset;
+}
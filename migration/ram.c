@@ -32,6 +32,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -55,6 +56,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "lazy-restore.h"
 #include "sysemu/runstate.h"
 
 #include "hw/boards.h" /* for machine_dump_guest_core() */
@@ -82,6 +84,27 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * With the fixed-ram capability each RAMBlock record of the
+ * RAM_SAVE_FLAG_MEM_SIZE section is followed by this header.  The bitmap
+ * of the pages present and the pages themselves are not part of the
+ * sequential stream but live at the given offsets of the file; the
+ * stream resumes after the page area of the block.
+ */
+#define FIXED_RAM_HDR_VERSION 1
+
+/* Alignment of the page area of each RAMBlock in the file */
+#define FIXED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+
+typedef struct {
+    uint32_t version;
+    /* target page size, all offsets are multiple of it */
+    uint64_t page_size;
+    /* little endian bitmap of the pages present in the file */
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+} QEMU_PACKED FixedRamHeader;
+
 XBZRLECacheStats xbzrle_counters;
 
 /* struct contains XBZRLE cache and a static page
@@ -296,6 +319,8 @@ struct RAMSrcPageRequest {
 };
 
 /* State of RAM for migration */
+typedef struct DirtySyncThreads DirtySyncThreads;
+
 struct RAMState {
     /* QEMUFile used for this migration */
     QEMUFile *f;
@@ -305,6 +330,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Last block from where we have sent data on the preempt channel */
+    RAMBlock *preempt_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -326,6 +353,8 @@ struct RAMState {
     uint64_t xbzrle_bytes_prev;
     /* Start using XBZRLE (e.g., after the first round). */
     bool xbzrle_enabled;
+    /* Skip hot RAM blocks until the cold ones are clean (adaptive mode) */
+    bool defer_hot_blocks;
     /* Are we on the last stage of migration */
     bool last_stage;
     /* compression statistics since the beginning of the period */
@@ -344,6 +373,8 @@ struct RAMState {
     uint64_t migration_dirty_pages;
     /* Protects modification of the bitmap and migration dirty pages */
     QemuMutex bitmap_mutex;
+    /* Helper threads for the dirty bitmap sync, NULL if there are none */
+    DirtySyncThreads *dirty_sync;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
@@ -1003,6 +1034,156 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 
     rs->migration_dirty_pages += new_dirty_pages;
     rs->num_dirty_pages_period += new_dirty_pages;
+    rb->dirty_pages_period += new_dirty_pages;
+}
+
+/*
+ * Sharded dirty bitmap sync
+ *
+ * With dirty-sync-threads > 1 each RAMBlock is split in chunks, and the
+ * migration thread and the helper threads take the chunks in turn.  A
+ * chunk covers whole words of the dirty bitmaps and whole chunks of the
+ * clear bitmap, so no two threads touch the same word; the dirty log
+ * clear is still postponed through the clear bitmap.  The dirty page
+ * counts are added up by the migration thread once all chunks are done.
+ */
+
+/* Minimum size of a chunk, in target pages */
+#define DIRTY_SYNC_CHUNK_PAGES ((1 * GiB) >> TARGET_PAGE_BITS)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+    uint64_t new_dirty_pages;
+} DirtySyncChunk;
+
+struct DirtySyncThreads {
+    QemuThread *threads;
+    int nr_threads;
+    /* Posted once per thread for each sync, or to quit */
+    QemuSemaphore start_sem;
+    /* Posted by each thread once there are no more chunks */
+    QemuSemaphore done_sem;
+    bool quit;
+    /* Chunks of the current sync */
+    GArray *chunks;
+    /* Next chunk to take */
+    unsigned int next;
+};
+
+static void dirty_sync_chunks(DirtySyncThreads *ds)
+{
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+
+    while ((i = qatomic_fetch_inc(&ds->next)) < ds->chunks->len) {
+        DirtySyncChunk *c = &g_array_index(ds->chunks, DirtySyncChunk, i);
+
+        c->new_dirty_pages = cpu_physical_memory_sync_dirty_bitmap(c->block,
+                                                                   c->start,
+                                                                   c->length);
+    }
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncThreads *ds = opaque;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&ds->start_sem);
+        if (qatomic_read(&ds->quit)) {
+            break;
+        }
+        dirty_sync_chunks(ds);
+        qemu_sem_post(&ds->done_sem);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static DirtySyncThreads *dirty_sync_threads_create(int nr_threads)
+{
+    DirtySyncThreads *ds = g_new0(DirtySyncThreads, 1);
+    int i;
+
+    ds->nr_threads = nr_threads;
+    ds->threads = g_new0(QemuThread, nr_threads);
+    ds->chunks = g_array_new(false, false, sizeof(DirtySyncChunk));
+    qemu_sem_init(&ds->start_sem, 0);
+    qemu_sem_init(&ds->done_sem, 0);
+
+    for (i = 0; i < nr_threads; i++) {
+        g_autofree char *name = g_strdup_printf("dirtysync_%d", i);
+
+        qemu_thread_create(&ds->threads[i], name, dirty_sync_thread, ds,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return ds;
+}
+
+static void dirty_sync_threads_destroy(DirtySyncThreads *ds)
+{
+    int i;
+
+    qatomic_set(&ds->quit, true);
+    for (i = 0; i < ds->nr_threads; i++) {
+        qemu_sem_post(&ds->start_sem);
+    }
+    for (i = 0; i < ds->nr_threads; i++) {
+        qemu_thread_join(&ds->threads[i]);
+    }
+    qemu_sem_destroy(&ds->start_sem);
+    qemu_sem_destroy(&ds->done_sem);
+    g_array_free(ds->chunks, true);
+    g_free(ds->threads);
+    g_free(ds);
+}
+
+/* Called with RCU critical section and bitmap_mutex held */
+static void ramblock_sync_dirty_bitmap_sharded(RAMState *rs)
+{
+    DirtySyncThreads *ds = rs->dirty_sync;
+    RAMBlock *block;
+    unsigned int i;
+
+    g_array_set_size(ds->chunks, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t chunk = MAX(1ULL << block->clear_bmap_shift,
+                               DIRTY_SYNC_CHUNK_PAGES) << TARGET_PAGE_BITS;
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += chunk) {
+            DirtySyncChunk c = {
+                .block = block,
+                .start = start,
+                .length = MIN(chunk, block->used_length - start),
+            };
+
+            g_array_append_val(ds->chunks, c);
+        }
+    }
+    trace_migration_bitmap_sync_sharded(ds->chunks->len, ds->nr_threads);
+
+    qatomic_set(&ds->next, 0);
+    for (i = 0; i < ds->nr_threads; i++) {
+        qemu_sem_post(&ds->start_sem);
+    }
+    dirty_sync_chunks(ds);
+    for (i = 0; i < ds->nr_threads; i++) {
+        qemu_sem_wait(&ds->done_sem);
+    }
+
+    for (i = 0; i < ds->chunks->len; i++) {
+        DirtySyncChunk *c = &g_array_index(ds->chunks, DirtySyncChunk, i);
+
+        rs->migration_dirty_pages += c->new_dirty_pages;
+        rs->num_dirty_pages_period += c->new_dirty_pages;
+        c->block->dirty_pages_period += c->new_dirty_pages;
+    }
 }
 
 /**
@@ -1113,10 +1294,121 @@ static void migration_trigger_throttle(RAMState *rs)
     }
 }
 
+/*
+ * migration_classify_blocks: mark the RAM blocks that are dirtied at more
+ * than twice the average rate as hot, so that find_dirty_block() sends
+ * them after the cold ones in each pass and they get fewer chances to be
+ * dirtied again before the end of the migration.
+ */
+static void migration_classify_blocks(RAMState *rs)
+{
+    uint64_t total = ram_bytes_total() >> TARGET_PAGE_BITS;
+    uint64_t dirtied = rs->num_dirty_pages_period;
+    bool defer = false;
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+
+        block->migration_hot = dirtied && !migration_in_postcopy() &&
+            block->dirty_pages_period * total > 2 * dirtied * pages;
+        if (block->migration_hot) {
+            trace_migration_adaptive_hot_block(block->idstr,
+                                               block->dirty_pages_period);
+            defer = true;
+        }
+        block->dirty_pages_period = 0;
+    }
+    rs->defer_hot_blocks = defer;
+}
+
+/**
+ * migration_adaptive_converge: take the next convergence action
+ *
+ * Replaces migration_trigger_throttle() when adaptive-convergence is
+ * enabled.  The ratio between the pages dirtied and the pages sent
+ * during the last period predicts whether the remaining dirty set will
+ * shrink below what can be sent within downtime-limit; if it does not,
+ * the cheapest action that brings the ratio below
+ * throttle-trigger-threshold is taken: XBZRLE, then a throttle computed
+ * from the ratio rather than stepped, then postcopy when even
+ * max-cpu-throttle would not be enough.
+ *
+ * @rs: current RAM state
+ * @period: length of the sync period in milliseconds
+ */
+static void migration_adaptive_converge(RAMState *rs, int64_t period)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationConvergenceAction action = MIGRATION_CONVERGENCE_ACTION_NONE;
+    double target = s->parameters.throttle_trigger_threshold / 100.0;
+    int pct_max = s->parameters.max_cpu_throttle;
+    uint64_t dirtied = rs->num_dirty_pages_period;
+    uint64_t sent = rs->target_page_count - rs->target_page_count_prev;
+    uint64_t remaining = rs->migration_dirty_pages;
+    uint64_t threshold = s->threshold_size >> TARGET_PAGE_BITS;
+    uint64_t converged = MIN(remaining, threshold);
+    double ratio, rate, cpu_now, cpu_max;
+    int64_t downtime;
+    int pct;
+
+    migration_classify_blocks(rs);
+
+    if (!sent || period <= 0 || blk_mig_bulk_active() ||
+        migration_in_postcopy()) {
+        return;
+    }
+
+    /* pages per millisecond, and dirtied pages per sent page */
+    rate = (double)sent / period;
+    ratio = (double)dirtied / sent;
+
+    if (ratio <= target) {
+        downtime = converged / rate;
+    } else if (migrate_use_xbzrle() && !rs->xbzrle_enabled) {
+        /* Cheapest first: pages sent again become deltas */
+        rs->xbzrle_enabled = true;
+        action = MIGRATION_CONVERGENCE_ACTION_XBZRLE;
+        downtime = remaining / rate;
+    } else {
+        /*
+         * Assume the dirty rate scales with the CPU time the guest gets,
+         * and compute the throttle that brings the ratio to the target.
+         */
+        cpu_now = 100 - (cpu_throttle_active() ?
+                         cpu_throttle_get_percentage() : 0);
+        pct = 100 - (int)(cpu_now * target / ratio);
+        if (pct <= pct_max) {
+            cpu_throttle_set(pct);
+            action = MIGRATION_CONVERGENCE_ACTION_THROTTLE;
+            downtime = converged / rate;
+        } else if (migrate_postcopy_ram() &&
+                   !qatomic_read(&s->start_postcopy)) {
+            /* Only the device state and RAM discards are left to stop for */
+            qatomic_set(&s->start_postcopy, true);
+            action = MIGRATION_CONVERGENCE_ACTION_POSTCOPY;
+            downtime = 0;
+        } else {
+            cpu_throttle_set(pct_max);
+            action = MIGRATION_CONVERGENCE_ACTION_THROTTLE;
+            cpu_max = 100 - pct_max;
+            downtime = (ratio * cpu_max / cpu_now <= target ?
+                        converged : remaining) / rate;
+        }
+    }
+
+    s->convergence_action = action;
+    s->projected_downtime = downtime;
+    trace_migration_adaptive_converge(dirtied, sent,
+                                      MigrationConvergenceAction_str(action),
+                                      downtime);
+}
+
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
-    int64_t end_time;
+    int64_t start_time, end_time;
 
     ram_counters.dirty_sync_count++;
 
@@ -1125,25 +1417,37 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
+        if (rs->dirty_sync) {
+            ramblock_sync_dirty_bitmap_sharded(rs);
+        } else {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ramblock_sync_dirty_bitmap(rs, block);
+            }
         }
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
+    ram_counters.dirty_sync_time =
+        (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time) / SCALE_US;
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > rs->time_last_bitmap_sync + 1000) {
-        migration_trigger_throttle(rs);
+        if (migrate_adaptive_convergence()) {
+            migration_adaptive_converge(rs,
+                                        end_time - rs->time_last_bitmap_sync);
+        } else {
+            migration_trigger_throttle(rs);
+        }
 
         migration_update_rates(rs, end_time);
 
@@ -1235,6 +1539,45 @@ static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return -1;
 }
 
+/**
+ * ram_save_fixed_ram_page: write a page at its offset in the file
+ *
+ * Zero pages are not written, they are only dropped from the bitmap of
+ * the pages present in the file.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_fixed_ram_page(RAMState *rs, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(rs->f);
+    uint8_t *p = block->host + offset;
+    struct iovec iov = { .iov_base = p, .iov_len = TARGET_PAGE_SIZE };
+    Error *local_err = NULL;
+
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    if (qio_channel_pwritev_all(ioc, &iov, 1, block->pages_offset + offset,
+                                &local_err) < 0) {
+        qemu_file_set_error_obj(rs->f, -EIO, local_err);
+        return -1;
+    }
+    set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_transferred_add(TARGET_PAGE_SIZE);
+    ram_counters.normal++;
+
+    return 1;
+}
+
 /*
  * @pages: the number of pages written by the control path,
  *        < 0 - error
@@ -1492,9 +1835,21 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     /* This is not a postcopy requested page */
     pss->postcopy_requested = false;
 
-    pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
+    if (rs->defer_hot_blocks && pss->block->migration_hot) {
+        /* Leave hot blocks for the end of the pass */
+        pss->page = pss->block->used_length >> TARGET_PAGE_BITS;
+    } else {
+        pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
+    }
     if (pss->complete_round && pss->block == rs->last_seen_block &&
         pss->page >= rs->last_page) {
+        if (rs->defer_hot_blocks) {
+            /* Only hot blocks are left, go around once more for them */
+            rs->defer_hot_blocks = false;
+            pss->complete_round = false;
+            *again = true;
+            return false;
+        }
         /*
          * We've been once around the RAM and haven't found anything.
          * Give up.
@@ -1523,8 +1878,11 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
             pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
             /* Flag that we've looped */
             pss->complete_round = true;
-            /* After the first round, enable XBZRLE. */
-            if (migrate_use_xbzrle()) {
+            /*
+             * After the first round, enable XBZRLE, unless the adaptive
+             * convergence controller decides when it is needed.
+             */
+            if (migrate_use_xbzrle() && !migrate_adaptive_convergence()) {
                 rs->xbzrle_enabled = true;
             }
         }
@@ -2143,6 +2501,14 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy as one whole host page should be placed
+     */
+    bool use_multifd = !save_page_use_compression(rs) &&
+                       migrate_use_multifd() && !migration_in_postcopy();
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -2153,6 +2519,19 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    /*
+     * The multifd channels look for zero pages themselves, so that the
+     * scan scales with the number of channels.
+     */
+    if (use_multifd &&
+        (migrate_use_multifd_zero_page() || migrate_use_fixed_ram())) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    if (migrate_use_fixed_ram()) {
+        return ram_save_fixed_ram_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2166,14 +2545,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2239,6 +2611,56 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
     return (res < 0 ? res : pages);
 }
 
+/*
+ * Returns the postcopy preempt channel if requested pages should be sent
+ * on it, or NULL to send them on the main channel.
+ */
+static QEMUFile *postcopy_preempt_file(void)
+{
+    if (!migrate_postcopy_preempt() || !migration_in_postcopy()) {
+        return NULL;
+    }
+
+    return migrate_get_current()->postcopy_qemufile_src;
+}
+
+/**
+ * ram_save_host_page_urgent: send a host page requested by the destination
+ *
+ * The page is sent on the postcopy preempt channel, which has its own
+ * last sent block for RAM_SAVE_FLAG_CONTINUE.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @f: the postcopy preempt channel
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     QEMUFile *f)
+{
+    QEMUFile *main_f = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    rs->f = f;
+    rs->last_sent_block = rs->preempt_last_sent_block;
+    pages = ram_save_host_page(rs, pss);
+    qemu_fflush(f);
+    rs->preempt_last_sent_block = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_f;
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        /* Fail the main channel too, so that postcopy pauses */
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2281,7 +2703,14 @@ static int ram_find_and_save_block(RAMState *rs)
         }
 
         if (found) {
-            pages = ram_save_host_page(rs, &pss);
+            QEMUFile *preempt_f = pss.postcopy_requested ?
+                                  postcopy_preempt_file() : NULL;
+
+            if (preempt_f) {
+                pages = ram_save_host_page_urgent(rs, &pss, preempt_f);
+            } else {
+                pages = ram_save_host_page(rs, &pss);
+            }
         }
     } while (!pages && again);
 
@@ -2343,6 +2772,9 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        if ((*rsp)->dirty_sync) {
+            dirty_sync_threads_destroy((*rsp)->dirty_sync);
+        }
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -2391,6 +2823,8 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2402,6 +2836,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_enabled = false;
@@ -2705,6 +3140,11 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    /* The migration thread takes its share of the chunks too */
+    if (migrate_dirty_sync_threads() > 1) {
+        (*rsp)->dirty_sync =
+            dirty_sync_threads_create(migrate_dirty_sync_threads() - 1);
+    }
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2752,6 +3192,8 @@ static void ram_list_init_bitmaps(void)
             bitmap_set(block->bmap, 0, pages);
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            block->dirty_pages_period = 0;
+            block->migration_hot = false;
         }
     }
 }
@@ -2890,6 +3332,63 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/* Number of bits stored in the file for a block with @pages pages */
+static uint64_t fixed_ram_bitmap_bits(ram_addr_t pages)
+{
+    /* Multiple of 64 bits so that the layout is the same on all hosts */
+    return ROUND_UP(pages, 64);
+}
+
+static void fixed_ram_insert_header(QEMUFile *f, RAMBlock *block)
+{
+    FixedRamHeader header;
+    uint64_t nbits = fixed_ram_bitmap_bits(block->used_length >>
+                                           TARGET_PAGE_BITS);
+    int64_t header_end = qemu_ftell(f) + sizeof(header);
+
+    block->file_bmap = bitmap_new(nbits);
+    block->bitmap_offset = header_end;
+    block->pages_offset = ROUND_UP(header_end + nbits / BITS_PER_BYTE,
+                                   FIXED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    header.version = cpu_to_be32(FIXED_RAM_HDR_VERSION);
+    header.page_size = cpu_to_be64(TARGET_PAGE_SIZE);
+    header.bitmap_offset = cpu_to_be64(block->bitmap_offset);
+    header.pages_offset = cpu_to_be64(block->pages_offset);
+    qemu_put_buffer(f, (uint8_t *)&header, sizeof(header));
+
+    /* The stream continues after the page area */
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static int fixed_ram_write_bitmaps(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t nbits = fixed_ram_bitmap_bits(block->used_length >>
+                                               TARGET_PAGE_BITS);
+        g_autofree unsigned long *le_bmap = bitmap_new(nbits);
+        struct iovec iov = {
+            .iov_base = le_bmap,
+            .iov_len = nbits / BITS_PER_BYTE,
+        };
+        Error *local_err = NULL;
+
+        bitmap_to_le(le_bmap, block->file_bmap, nbits);
+        if (qio_channel_pwritev_all(ioc, &iov, 1, block->bitmap_offset,
+                                    &local_err) < 0) {
+            qemu_file_set_error_obj(f, -EIO, local_err);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -2938,6 +3437,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_use_fixed_ram()) {
+                fixed_ram_insert_header(f, block);
+            }
         }
     }
 
@@ -3089,13 +3591,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     RAMState **temp = opaque;
     RAMState *rs = *temp;
+    QEMUFile *preempt_f;
     int ret = 0;
 
     rs->last_stage = !migration_in_colo_state();
 
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
             migration_bitmap_sync_precopy(rs);
+            migration_downtime_phase(&migrate_get_current()->downtime_stats,
+                                     MIGRATION_DOWNTIME_PHASE_RAM_SYNC, start);
         }
 
         ram_control_before_iterate(f, RAM_CONTROL_FINISH);
@@ -3125,11 +3632,29 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         return ret;
     }
 
+    preempt_f = postcopy_preempt_file();
+    if (preempt_f) {
+        /* Let the preempt thread on the destination finish */
+        qemu_put_be64(preempt_f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(preempt_f);
+        ret = qemu_file_get_error(preempt_f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     ret = multifd_send_sync_main(rs->f);
     if (ret < 0) {
         return ret;
     }
 
+    if (migrate_use_fixed_ram()) {
+        ret = fixed_ram_write_bitmaps(f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3209,11 +3734,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * @mis: the migration incoming state pointer
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel we're using
  */
 static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
-                                              QEMUFile *f, int flags)
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    RAMBlock *block = mis->last_recv_block;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3240,7 +3767,7 @@ static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
         return NULL;
     }
 
-    mis->last_recv_block = block;
+    mis->last_recv_block[channel] = block;
 
     return block;
 }
@@ -3629,6 +4156,9 @@ static int ram_load_cleanup(void *opaque)
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
+        /* Left by a lazy restore that did not start */
+        g_free(rb->file_bmap);
+        rb->file_bmap = NULL;
     }
 
     return 0;
@@ -3655,19 +4185,20 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for its own channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel to use for loading
  */
-int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Currently we only use channel 0.  TODO: use all the channels */
-    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[0];
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -3691,10 +4222,10 @@ int ram_load_postcopy(QEMUFile *f)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
-        trace_ram_load_postcopy_loop((uint64_t)addr, flags);
+        trace_ram_load_postcopy_loop(channel, (uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(mis, f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3894,6 +4425,149 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+typedef struct {
+    QemuThread thread;
+    QIOChannel *ioc;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    /* range of pages loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    Error *err;
+} FixedRamLoader;
+
+static void *fixed_ram_load_thread(void *opaque)
+{
+    FixedRamLoader *l = opaque;
+    RAMBlock *block = l->block;
+    unsigned long set, clear;
+
+    set = find_next_bit(l->bitmap, l->end, l->start);
+    while (set < l->end) {
+        ram_addr_t offset = (ram_addr_t)set << TARGET_PAGE_BITS;
+        struct iovec iov;
+
+        clear = find_next_zero_bit(l->bitmap, l->end, set);
+        iov.iov_base = block->host + offset;
+        iov.iov_len = (ram_addr_t)(clear - set) << TARGET_PAGE_BITS;
+        if (qio_channel_preadv_all(l->ioc, &iov, 1,
+                                   block->pages_offset + offset,
+                                   &l->err) < 0) {
+            break;
+        }
+        set = find_next_bit(l->bitmap, l->end, clear);
+    }
+
+    return NULL;
+}
+
+/*
+ * Read the pages of @block from their fixed offsets.  Runs of present
+ * pages are read with one call each; with multifd the block is split
+ * between as many threads as there are channels.  Pages missing from
+ * the file are zero and are left untouched.
+ */
+static int parse_ramblock_fixed_ram(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    uint64_t nbits = fixed_ram_bitmap_bits(pages);
+    g_autofree unsigned long *le_bmap = NULL;
+    g_autofree unsigned long *bitmap = NULL;
+    g_autofree FixedRamLoader *loaders = NULL;
+    unsigned long slice;
+    FixedRamHeader header;
+    struct iovec iov;
+    Error *local_err = NULL;
+    int nthreads, i, ret = 0;
+
+    if (qemu_get_buffer(f, (uint8_t *)&header, sizeof(header)) !=
+        sizeof(header)) {
+        error_report("Could not read fixed-ram header of block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+    header.version = be32_to_cpu(header.version);
+    header.page_size = be64_to_cpu(header.page_size);
+    header.bitmap_offset = be64_to_cpu(header.bitmap_offset);
+    header.pages_offset = be64_to_cpu(header.pages_offset);
+
+    if (header.version != FIXED_RAM_HDR_VERSION) {
+        error_report("Unsupported fixed-ram header version %" PRIu32
+                     " for block %s", header.version, block->idstr);
+        return -EINVAL;
+    }
+    if (header.page_size != TARGET_PAGE_SIZE ||
+        !QEMU_IS_ALIGNED(header.pages_offset, TARGET_PAGE_SIZE)) {
+        error_report("Invalid fixed-ram page layout for block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    le_bmap = bitmap_new(nbits);
+    bitmap = bitmap_new(nbits);
+    iov.iov_base = le_bmap;
+    iov.iov_len = nbits / BITS_PER_BYTE;
+    if (qio_channel_preadv_all(ioc, &iov, 1, header.bitmap_offset,
+                               &local_err) < 0) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+    bitmap_from_le(bitmap, le_bmap, nbits);
+    block->pages_offset = header.pages_offset;
+
+    if (migrate_lazy_restore()) {
+        /* The pages are read on demand once all blocks are known */
+        block->file_bmap = g_steal_pointer(&bitmap);
+        qemu_set_offset(f, header.pages_offset + length);
+        return qemu_file_get_error(f);
+    }
+
+    nthreads = migrate_use_multifd() ? migrate_multifd_channels() : 1;
+    slice = ROUND_UP(DIV_ROUND_UP(pages, nthreads), BITS_PER_LONG);
+    loaders = g_new0(FixedRamLoader, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        FixedRamLoader *l = &loaders[i];
+
+        l->ioc = ioc;
+        l->block = block;
+        l->bitmap = bitmap;
+        l->start = MIN(i * slice, pages);
+        l->end = MIN(l->start + slice, pages);
+        if (nthreads == 1) {
+            fixed_ram_load_thread(l);
+        } else {
+            qemu_thread_create(&l->thread, "fixed-ram-load",
+                               fixed_ram_load_thread, l,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        FixedRamLoader *l = &loaders[i];
+
+        if (nthreads > 1) {
+            qemu_thread_join(&l->thread);
+        }
+        if (l->err) {
+            if (!ret) {
+                error_report_err(l->err);
+                ret = -EIO;
+            } else {
+                error_free(l->err);
+            }
+        }
+    }
+    if (ret) {
+        return ret;
+    }
+
+    trace_ram_load_fixed_ram(block->idstr, nthreads);
+
+    qemu_set_offset(f, header.pages_offset + length);
+    return qemu_file_get_error(f);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3945,7 +4619,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(mis, f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -4034,6 +4709,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_use_fixed_ram()) {
+                        ret = parse_ramblock_fixed_ram(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4044,6 +4722,14 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_lazy_restore()) {
+                Error *local_err = NULL;
+
+                if (lazy_restore_start(qemu_file_get_ioc(f), &local_err)) {
+                    error_report_err(local_err);
+                    ret = -EINVAL;
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -4122,7 +4808,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -55,6 +55,7 @@
 #include "qemu/main-loop.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -65,6 +66,7 @@
 #include "qemu/bitmap.h"
 #include "net/announce.h"
 #include "qemu/yank.h"
+#include "block/thread-pool.h"
 #include "yank_functions.h"
 
 const unsigned int postcopy_ram_discard_version;
@@ -943,6 +945,53 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se,
     return vmstate_save_state(f, se->vmsd, se->opaque, vmdesc);
 }
 
+/*
+ * With parallel-load, the state of the devices that allow it is sent with
+ * its size, so that the destination can hand it to a worker thread
+ * without parsing it.
+ */
+#define VMSTATE_PARALLEL_MAX_SIZE (64 * MiB)
+
+static bool vmstate_parallel_load(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel_load && migrate_parallel_load();
+}
+
+/* Save the state of a device, for a QEMU_VM_SECTION_FULL section */
+static int vmstate_save_full(QEMUFile *f, SaveStateEntry *se,
+                             JSONWriter *vmdesc)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    int ret;
+
+    if (!vmstate_parallel_load(se)) {
+        return vmstate_save(f, se, vmdesc);
+    }
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-vmstate-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    ret = vmstate_save(fb, se, vmdesc);
+    qemu_fflush(fb);
+    if (!ret) {
+        ret = qemu_file_get_error(fb);
+    }
+    if (!ret && bioc->usage > VMSTATE_PARALLEL_MAX_SIZE) {
+        error_report("State of device '%s' is too large for parallel-load "
+                     "(%zu bytes)", se->idstr, bioc->usage);
+        ret = -EFBIG;
+    }
+    if (!ret) {
+        qemu_put_be32(f, bioc->usage);
+        qemu_put_buffer(f, bioc->data, bioc->usage);
+    }
+    qemu_fclose(fb);
+    object_unref(OBJECT(bioc));
+
+    return ret;
+}
+
 /*
  * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
  */
@@ -1363,7 +1412,9 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
+    MigrationDowntime *downtime = &migrate_get_current()->downtime_stats;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1383,7 +1434,9 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        migration_downtime_device(downtime, se->idstr, se->instance_id, start);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1399,9 +1452,11 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
+    MigrationDowntime *downtime = &migrate_get_current()->downtime_stats;
     g_autoptr(JSONWriter) vmdesc = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     vmdesc = json_writer_new(false);
@@ -1425,11 +1480,13 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_writer_int64(vmdesc, "instance_id", se->instance_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        ret = vmstate_save(f, se, vmdesc);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        ret = vmstate_save_full(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
             return ret;
         }
+        migration_downtime_device(downtime, se->idstr, se->instance_id, start);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
@@ -1468,9 +1525,11 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
+    MigrationDowntime *downtime = &migrate_get_current()->downtime_stats;
     int ret;
     Error *local_err = NULL;
     bool in_postcopy = migration_in_postcopy();
+    int64_t start;
 
     if (precopy_notify(PRECOPY_NOTIFY_COMPLETE, &local_err)) {
         error_report_err(local_err);
@@ -1481,24 +1540,32 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     cpu_synchronize_all_states();
 
     if (!in_postcopy || iterable_only) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
         if (ret) {
             return ret;
         }
+        migration_downtime_phase(downtime, MIGRATION_DOWNTIME_PHASE_ITERABLE,
+                                 start);
     }
 
     if (iterable_only) {
         goto flush;
     }
 
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
                                                           inactivate_disks);
     if (ret) {
         return ret;
     }
+    migration_downtime_phase(downtime, MIGRATION_DOWNTIME_PHASE_NON_ITERABLE,
+                             start);
 
 flush:
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     qemu_fflush(f);
+    migration_downtime_phase(downtime, MIGRATION_DOWNTIME_PHASE_FLUSH, start);
     return 0;
 }
 
@@ -1638,7 +1705,7 @@ int qemu_save_device_state(QEMUFile *f)
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
 
-        ret = vmstate_save(f, se, NULL);
+        ret = vmstate_save_full(f, se, NULL);
         if (ret) {
             return ret;
         }
@@ -1989,7 +2056,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
 
     mis->have_listen_thread = true;
     postcopy_thread_create(mis, &mis->listen_thread, "postcopy/listen",
-                           postcopy_ram_listen_thread, QEMU_THREAD_DETACHED);
+                           postcopy_ram_listen_thread, mis,
+                           QEMU_THREAD_DETACHED);
     trace_loadvm_postcopy_handle_listen("return");
 
     return 0;
@@ -1999,6 +2067,7 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     trace_loadvm_postcopy_handle_run_bh("enter");
 
@@ -2034,6 +2103,9 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
         runstate_set(RUN_STATE_PAUSED);
     }
 
+    migration_downtime_phase(&mis->downtime_stats,
+                             MIGRATION_DOWNTIME_PHASE_START, start);
+    migration_downtime_stop(&mis->downtime_stats);
     qemu_bh_delete(mis->bh);
 
     trace_loadvm_postcopy_handle_run_bh("return");
@@ -2107,6 +2179,8 @@ static void migrate_send_rp_req_pages_pending(MigrationIncomingState *mis)
 
 static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
 {
+    unsigned int i;
+
     if (mis->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
         error_report("%s: illegal resume received", __func__);
         /* Don't fail the load, only for this. */
@@ -2117,7 +2191,9 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
      * Reset the last_rb before we resend any page req to source again, since
      * the source should have it reset already.
      */
-    mis->last_rb = NULL;
+    WITH_QEMU_LOCK_GUARD(&mis->rp_mutex) {
+        mis->last_rb = NULL;
+    }
 
     /*
      * This means source VM is ready to resume the postcopy migration.
@@ -2145,12 +2221,15 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
     migrate_send_rp_req_pages_pending(mis);
 
     /*
-     * It's time to switch state and release the fault thread to continue
+     * It's time to switch state and release the fault threads to continue
      * service page faults.  Note that this should be explicitly after the
-     * above call to migrate_send_rp_req_pages_pending().  In short:
-     * migrate_send_rp_message_req_pages() is not thread safe, yet.
+     * above call to migrate_send_rp_req_pages_pending(), so that the pages
+     * the guest is already waiting for are requested first.  Each fault
+     * thread paused on its own.
      */
-    qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    for (i = 0; i < mis->fault_threads_nr; i++) {
+        qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    }
 
     return 0;
 }
@@ -2390,12 +2469,172 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
+/*
+ * Parallel load of device state
+ *
+ * The loads are submitted to the thread pool of the main AioContext from
+ * the incoming coroutine, which keeps reading the stream.  All pending
+ * loads are waited for before anything else than the state of a device
+ * that allows it with the same priority, so the order between priorities
+ * and with the other sections is kept.  The completions run in the main
+ * loop, as the coroutine does, so no locking is needed.
+ *
+ * The state is kept per qemu_loadvm_state_main() call: the postcopy listen
+ * thread runs its own loop concurrently with the coroutine, and loads
+ * everything itself because it cannot yield.
+ */
+typedef struct {
+    /* Loads submitted and not completed yet */
+    unsigned int pending;
+    /* Priority of the pending loads */
+    MigrationPriority priority;
+    /* First error of a load since the last wait */
+    int ret;
+    /* Coroutine waiting for the pending loads */
+    Coroutine *waiter;
+} LoadvmParallel;
+
+typedef struct {
+    LoadvmParallel *parallel;
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int64_t start;
+} LoadvmParallelReq;
+
+static int loadvm_parallel_worker(void *opaque)
+{
+    LoadvmParallelReq *req = opaque;
+
+    return vmstate_load(req->f, req->se);
+}
+
+static int loadvm_parallel_finish(LoadvmParallelReq *req, int ret)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (ret < 0) {
+        error_report("error while loading state for instance 0x%"PRIx32" of"
+                     " device '%s'", req->se->instance_id, req->se->idstr);
+    }
+    migration_downtime_device(&mis->downtime_stats, req->se->idstr,
+                              req->se->instance_id, req->start);
+    qemu_fclose(req->f);
+    object_unref(OBJECT(req->bioc));
+    g_free(req);
+
+    return ret;
+}
+
+static void loadvm_parallel_done(void *opaque, int ret)
+{
+    LoadvmParallelReq *req = opaque;
+    LoadvmParallel *parallel = req->parallel;
+
+    ret = loadvm_parallel_finish(req, ret);
+    if (ret < 0 && !parallel->ret) {
+        parallel->ret = ret;
+    }
+
+    if (--parallel->pending == 0 && parallel->waiter) {
+        aio_co_wake(parallel->waiter);
+    }
+}
+
+/* Wait for the pending loads, returns the first error among them */
+static int loadvm_parallel_wait(LoadvmParallel *parallel,
+                                MigrationIncomingState *mis)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    if (parallel->pending) {
+        /* Only the incoming coroutine submits loads */
+        assert(qemu_in_coroutine());
+        while (parallel->pending) {
+            parallel->waiter = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            parallel->waiter = NULL;
+        }
+        migration_downtime_phase(&mis->downtime_stats,
+                                 MIGRATION_DOWNTIME_PHASE_LOAD, start);
+    }
+
+    ret = parallel->ret;
+    parallel->ret = 0;
+    return ret;
+}
+
+/* Read the state of @se and load it in a worker thread */
+static int loadvm_parallel_submit(LoadvmParallel *parallel, QEMUFile *f,
+                                  MigrationIncomingState *mis,
+                                  SaveStateEntry *se)
+{
+    LoadvmParallelReq *req;
+    QIOChannelBuffer *bioc;
+    uint32_t size;
+    int ret;
+
+    if (parallel->pending && parallel->priority != se->vmsd->priority) {
+        ret = loadvm_parallel_wait(parallel, mis);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    size = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (size > VMSTATE_PARALLEL_MAX_SIZE) {
+        error_report("Invalid size %" PRIu32 " for the state of device '%s'",
+                     size, se->idstr);
+        return -EINVAL;
+    }
+    bioc = qio_channel_buffer_new(size);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-vmstate-buffer");
+    ret = qemu_get_buffer(f, bioc->data, size);
+    if (ret != size) {
+        object_unref(OBJECT(bioc));
+        error_report("Failed to read the state of device '%s'", se->idstr);
+        ret = qemu_file_get_error(f);
+        return ret < 0 ? ret : -EIO;
+    }
+    bioc->usage = size;
+
+    req = g_new0(LoadvmParallelReq, 1);
+    req->parallel = parallel;
+    req->se = se;
+    req->bioc = bioc;
+    req->f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    req->start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (!qemu_in_coroutine()) {
+        /*
+         * e.g. COLO or the postcopy listen thread, there is no coroutine
+         * to wait in: load it here
+         */
+        return loadvm_parallel_finish(req, loadvm_parallel_worker(req));
+    }
+
+    trace_loadvm_parallel_submit(se->idstr, se->instance_id, size);
+    parallel->priority = se->vmsd->priority;
+    parallel->pending++;
+    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                           loadvm_parallel_worker, req,
+                           loadvm_parallel_done, req);
+    return 0;
+}
+
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               LoadvmParallel *parallel)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
     char idstr[256];
+    int64_t start;
     int ret;
 
     /* Read section start */
@@ -2442,12 +2681,33 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    if (vmstate_parallel_load(se)) {
+        ret = loadvm_parallel_submit(parallel, f, mis, se);
+        if (ret < 0) {
+            return ret;
+        }
+        return check_section_footer(f, se) ? 0 : -EINVAL;
+    }
+
+    ret = loadvm_parallel_wait(parallel, mis);
+    if (ret < 0) {
+        return ret;
+    }
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
                      " device '%s'", instance_id, idstr);
         return ret;
     }
+    if (se->vmsd || (se->ops && se->ops->save_state)) {
+        /* The state of a device, rather than the start of an iterable one */
+        migration_downtime_device(&mis->downtime_stats, se->idstr,
+                                  se->instance_id, start);
+        migration_downtime_phase(&mis->downtime_stats,
+                                 MIGRATION_DOWNTIME_PHASE_LOAD, start);
+    }
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
@@ -2627,7 +2887,9 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    LoadvmParallel parallel = {};
     uint8_t section_type;
+    int parallel_ret;
     int ret = 0;
 
 retry:
@@ -2640,10 +2902,17 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_FULL) {
+            /* Only the state of devices is loaded in parallel */
+            ret = loadvm_parallel_wait(&parallel, mis);
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, &parallel);
             if (ret < 0) {
                 goto out;
             }
@@ -2673,6 +2942,10 @@ retry:
     }
 
 out:
+    parallel_ret = loadvm_parallel_wait(&parallel, mis);
+    if (ret >= 0 && parallel_ret < 0) {
+        ret = parallel_ret;
+    }
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,378 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vectorized encoders below share the run-length skeleton and only
+ * differ in how they compare the buffers: @eq_mask returns a bitmap of
+ * the bytes that are equal in a 64-byte window.  Runs are then found by
+ * scanning the bitmap, which keeps short runs cheap, and since runs are
+ * defined purely by byte equality every variant produces output that is
+ * bit-identical to xbzrle_encode_buffer_int().
+ */
+typedef uint64_t (*XbzrleEqMaskFn)(const uint8_t *old_buf,
+                                   const uint8_t *new_buf);
+
+typedef struct XbzrleWindow {
+    int base;
+    uint64_t eq;
+} XbzrleWindow;
+
+static inline void __attribute__((always_inline))
+xbzrle_load_window(const uint8_t *old_buf, const uint8_t *new_buf,
+                   int base, int slen, XbzrleWindow *w,
+                   XbzrleEqMaskFn eq_mask)
+{
+    int j;
+
+    w->base = base;
+    if (likely(slen - base >= 64)) {
+        w->eq = eq_mask(old_buf + base, new_buf + base);
+        return;
+    }
+
+    /* short tail, bits past slen stay clear */
+    w->eq = 0;
+    for (j = base; j < slen; j++) {
+        w->eq |= (uint64_t)(old_buf[j] == new_buf[j]) << (j - base);
+    }
+}
+
+/*
+ * Return the end of the run that starts at @i, which must be within the
+ * current window: a zero run (@equal) ends at the first unequal byte and
+ * vice versa.
+ */
+static inline int __attribute__((always_inline))
+xbzrle_find_run_end(const uint8_t *old_buf, const uint8_t *new_buf,
+                    int i, int slen, bool equal, XbzrleWindow *w,
+                    XbzrleEqMaskFn eq_mask)
+{
+    for (;;) {
+        uint64_t m = (equal ? ~w->eq : w->eq) >> (i - w->base);
+
+        if (m) {
+            return MIN(i + ctz64(m), slen);
+        }
+        i = w->base + 64;
+        if (i >= slen) {
+            return slen;
+        }
+        xbzrle_load_window(old_buf, new_buf, i, slen, w, eq_mask);
+    }
+}
+
+static inline int __attribute__((always_inline))
+xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen, XbzrleEqMaskFn eq_mask)
+{
+    XbzrleWindow w;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
+
+    xbzrle_load_window(old_buf, new_buf, 0, slen, &w, eq_mask);
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = xbzrle_find_run_end(old_buf, new_buf, i, slen, true, &w, eq_mask);
+        zrun_len = i - start;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = xbzrle_find_run_end(old_buf, new_buf, i, slen, false, &w, eq_mask);
+        nzrun_len = i - start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT) || \
+    defined(__SSE2__) || defined(__aarch64__)
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT) || \
+    defined(__SSE2__)
+/*
+ * Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static inline uint64_t __attribute__((always_inline))
+xbzrle_eq_mask_sse2(const uint8_t *old_buf, const uint8_t *new_buf)
+{
+    uint64_t eq = 0;
+    int i;
+
+    for (i = 0; i < 64; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+
+        eq |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) << i;
+    }
+    return eq;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_eq_mask_sse2);
+}
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/*
+ * As in util/bufferiszero.c, the includes have to be within the
+ * corresponding push_options region, and therefore the regions
+ * themselves have to be ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint64_t __attribute__((always_inline))
+xbzrle_eq_mask_avx2(const uint8_t *old_buf, const uint8_t *new_buf)
+{
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)old_buf);
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)new_buf);
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(old_buf + 32));
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(new_buf + 32));
+    uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, b0));
+    uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, b1));
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_eq_mask_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline uint64_t __attribute__((always_inline))
+xbzrle_eq_mask_avx512(const uint8_t *old_buf, const uint8_t *new_buf)
+{
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(old_buf),
+                                  _mm512_loadu_si512(new_buf));
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_eq_mask_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+#else /* __aarch64__ */
+#include <arm_neon.h>
+
+/*
+ * NEON has no movemask: weight each 0x00/0xff compare result by its bit
+ * position within the byte and fold the four vectors with pairwise adds.
+ */
+static inline uint64_t __attribute__((always_inline))
+xbzrle_eq_mask_neon(const uint8_t *old_buf, const uint8_t *new_buf)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t w = vld1q_u8(weights);
+    uint8x16_t t0 = vandq_u8(vceqq_u8(vld1q_u8(old_buf),
+                                      vld1q_u8(new_buf)), w);
+    uint8x16_t t1 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + 16),
+                                      vld1q_u8(new_buf + 16)), w);
+    uint8x16_t t2 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + 32),
+                                      vld1q_u8(new_buf + 32)), w);
+    uint8x16_t t3 = vandq_u8(vceqq_u8(vld1q_u8(old_buf + 48),
+                                      vld1q_u8(new_buf + 48)), w);
+    uint8x16_t sum = vpaddq_u8(vpaddq_u8(t0, t1), vpaddq_u8(t2, t3));
+
+    sum = vpaddq_u8(sum, sum);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+
+static int xbzrle_encode_buffer_neon(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_eq_mask_neon);
+}
+#endif
+
+/*
+ * Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+#define CACHE_SSE2     4
+#define CACHE_NEON     8
+
+/*
+ * Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.  NEON is part of the aarch64
+ * base ISA and never needs to be probed.
+ */
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#elif defined(__aarch64__)
+# define INIT_CACHE CACHE_NEON
+# define INIT_ACCEL xbzrle_encode_buffer_neon
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_buffer_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+#ifdef __aarch64__
+    if (cache & CACHE_NEON) {
+        fn = xbzrle_encode_buffer_neon;
+    }
+#else
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_buffer_sse2;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* 0xe6: OPMASK, ZMM, YMM and XMM state enabled by the OS */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX512BW_OPT || CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested xbzrle_encode_buffer_int, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
+#else
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
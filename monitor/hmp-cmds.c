@@ -23,6 +23,8 @@
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/timer.h"
+#include "qemu/coroutine.h"
+#include "qemu/rcu.h"
 #include "qemu/sockets.h"
 #include "qemu/help_option.h"
 #include "monitor/monitor-internal.h"
@@ -249,6 +251,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " ms\n",
                            info->expected_downtime);
         }
+        if (info->has_projected_downtime) {
+            monitor_printf(mon, "projected downtime: %" PRIu64 " ms (%s)\n",
+                           info->projected_downtime,
+                           MigrationConvergenceAction_str(
+                               info->convergence_action));
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " ms\n",
                            info->downtime);
@@ -278,6 +286,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -346,6 +356,46 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->compression->compression_rate);
     }
 
+    if (info->has_multifd_channel_stats) {
+        MultiFDChannelStatsList *stats;
+
+        for (stats = info->multifd_channel_stats; stats;
+             stats = stats->next) {
+            MultiFDChannelStats *c = stats->value;
+
+            monitor_printf(mon, "multifd channel %" PRId64 ": pages %" PRId64
+                           " size %" PRId64 " kbytes compression ratio %0.2f"
+                           " cpu %0.2f us/MB\n", c->id, c->pages,
+                           c->bytes >> 10, c->compression_ratio,
+                           c->cpu_time_per_mb);
+        }
+    }
+
+    if (info->has_downtime_stats) {
+        MigrationDowntimePhaseTimeList *phase;
+        MigrationDowntimeDeviceList *dev;
+        intList *bucket;
+
+        for (phase = info->downtime_stats->phases; phase;
+             phase = phase->next) {
+            monitor_printf(mon, "downtime %s: %" PRId64 " us\n",
+                           MigrationDowntimePhase_str(phase->value->phase),
+                           phase->value->time);
+        }
+        for (dev = info->downtime_stats->devices; dev; dev = dev->next) {
+            monitor_printf(mon, "downtime device %s/%" PRId64 ": %" PRId64
+                           " us\n", dev->value->name,
+                           dev->value->instance_id, dev->value->time);
+        }
+        monitor_printf(mon, "downtime histogram "
+                       "(<10us <100us <1ms <10ms <100ms more):");
+        for (bucket = info->downtime_stats->histogram; bucket;
+             bucket = bucket->next) {
+            monitor_printf(mon, " %" PRId64, bucket->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -487,6 +537,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_CHANNELS),
             params->multifd_channels);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS),
+            params->postcopy_fault_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
             MultiFDCompression_str(params->multifd_compression));
@@ -1296,6 +1352,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_channels = true;
         visit_type_uint8(v, param, &p->multifd_channels, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS:
+        p->has_postcopy_fault_threads = true;
+        visit_type_uint8(v, param, &p->postcopy_fault_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
     case MIGRATION_PARAMETER_MULTIFD_COMPRESSION:
         p->has_multifd_compression = true;
         visit_type_MultiFDCompression(v, param, &p->multifd_compression,
@@ -1314,6 +1378,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_zero_copy_send = true;
         visit_type_bool(v, param, &p->zero_copy_send, &err);
         break;
+    case MIGRATION_PARAMETER_DIRECT_IO:
+        p->has_direct_io = true;
+        visit_type_bool(v, param, &p->direct_io, &err);
+        break;
 #endif
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
@@ -1896,6 +1964,29 @@ void hmp_info_memory_devices(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, err);
 }
 
+static void hmp_info_iothread_poll_stats(Monitor *mon, IOThreadPollStats *ps)
+{
+    IOThreadHandlerStatsList *h;
+    uint64List *bucket;
+
+    monitor_printf(mon, "  poll: ns=%" PRId64 " count=%" PRIu64
+                   " success=%" PRIu64 " time=%" PRIu64 " ns%s\n",
+                   ps->poll_ns, ps->poll_count, ps->poll_success,
+                   ps->poll_time, ps->poll_over_budget ? " (over budget)" : "");
+    monitor_printf(mon, "    histogram:");
+    for (bucket = ps->poll_histogram; bucket; bucket = bucket->next) {
+        monitor_printf(mon, " %" PRIu64, bucket->value);
+    }
+    monitor_printf(mon, "\n");
+    monitor_printf(mon, "  wait: count=%" PRIu64 " time=%" PRIu64 " ns\n",
+                   ps->wait_count, ps->wait_time);
+    for (h = ps->handlers; h; h = h->next) {
+        monitor_printf(mon, "  fd %" PRId64 ": dispatched=%" PRIu64
+                       " polled=%" PRIu64 "\n", h->value->fd,
+                       h->value->dispatched, h->value->polled);
+    }
+}
+
 void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
 {
     IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
@@ -1909,13 +2000,65 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  poll-cpu-budget=%" PRId64 "\n",
+                       value->poll_cpu_budget);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        monitor_printf(mon, "  notify-sent=%" PRIu64 "\n", value->notify_sent);
+        monitor_printf(mon, "  notify-suppressed=%" PRIu64 "\n",
+                       value->notify_suppressed);
+        hmp_info_iothread_poll_stats(mon, value->poll_stats);
+        if (value->thread_pool) {
+            ThreadPoolStats *tp = value->thread_pool;
+
+            monitor_printf(mon, "  thread-pool: threads=%" PRId64
+                           " in-flight=%" PRIu64 " queue-depth=%" PRIu64
+                           " max-queue-depth=%" PRIu64 "\n",
+                           tp->threads, tp->in_flight, tp->queue_depth,
+                           tp->max_queue_depth);
+            monitor_printf(mon, "    requests=%" PRIu64 " steals=%" PRIu64
+                           " queue-time-avg=%" PRIu64 " ns"
+                           " queue-time-max=%" PRIu64 " ns"
+                           " run-time-avg=%" PRIu64 " ns\n",
+                           tp->requests, tp->steals, tp->queue_time_avg,
+                           tp->queue_time_max, tp->run_time_avg);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_coroutine_pool(Monitor *mon, const QDict *qdict)
+{
+    CoroutinePoolStats stats;
+
+    qemu_coroutine_get_pool_stats(&stats);
+    monitor_printf(mon, "created: %" PRIu64 "\n", stats.created);
+    monitor_printf(mon, "reused: %" PRIu64 "\n", stats.reused);
+    monitor_printf(mon, "deleted: %" PRIu64 "\n", stats.deleted);
+    monitor_printf(mon, "pool-max-size: %u\n", stats.pool_max_size);
+    monitor_printf(mon, "release-pool-size: %u\n", stats.release_pool_size);
+}
+
+void hmp_info_rcu(Monitor *mon, const QDict *qdict)
+{
+    struct rcu_stats stats;
+
+    rcu_get_stats(&stats);
+    monitor_printf(mon, "grace periods: %" PRIu64 "\n", stats.grace_periods);
+    monitor_printf(mon, "shared grace periods: %" PRIu64 "\n",
+                   stats.shared_grace_periods);
+    monitor_printf(mon, "grace period latency: avg %" PRIu64 " ns,"
+                   " max %" PRIu64 " ns\n",
+                   stats.grace_periods ?
+                   stats.gp_total_ns / stats.grace_periods : 0,
+                   stats.gp_max_ns);
+    monitor_printf(mon, "callbacks: queued %" PRIu64 ", invoked %" PRIu64
+                   ", backlog %" PRIu64 "\n",
+                   stats.callbacks_queued, stats.callbacks_invoked,
+                   stats.callbacks_queued - stats.callbacks_invoked);
+}
+
 void hmp_rocker(Monitor *mon, const QDict *qdict)
 {
     const char *name = qdict_get_str(qdict, "name");
@@ -19,7 +19,13 @@
 
 #include "qemu/osdep.h"
 
+#ifdef CONFIG_LINUX
+#include <sys/sendfile.h>
+#endif
+
+#include "block/block_int.h"
 #include "block/export.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qemu/queue.h"
 #include "trace.h"
@@ -97,6 +103,7 @@ struct NBDExport {
     Notifier eject_notifier;
 
     bool allocation_depth;
+    bool zero_copy;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
 };
@@ -1772,6 +1779,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1888,6 +1896,162 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+#ifdef CONFIG_LINUX
+typedef struct NBDSendfileData {
+    int out_fd;
+    int in_fd;
+    off_t offset;
+    size_t size;
+} NBDSendfileData;
+
+/* Runs in a thread pool worker, since reading the file may block */
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    ssize_t len;
+
+    do {
+        len = sendfile(data->out_fd, data->in_fd, &data->offset, data->size);
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -errno : len;
+}
+
+/*
+ * Whether the data that block status of @bs maps to @file can be read from
+ * @file without bypassing a filter (e.g. throttle or copy-on-read) on the
+ * way down.
+ */
+static bool nbd_zero_copy_path_ok(BlockDriverState *bs,
+                                  BlockDriverState *file)
+{
+    BdrvChild *child;
+
+    for (; bs; bs = bdrv_cow_bs(bs)) {
+        if (!bs->drv || bs->drv->is_filter) {
+            return false;
+        }
+        if (bs == file) {
+            return true;
+        }
+        QLIST_FOREACH(child, &bs->children, next) {
+            if (child->bs == file) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+#endif
+
+/*
+ * nbd_co_send_zero_copy
+ *
+ * Send @iov, followed by the @size bytes of the export at @offset, taking
+ * the data straight from the host file that backs the export rather than
+ * reading it into a buffer first.  This is only possible if the export was
+ * created with zero-copy enabled, the client talks over a plain socket, no
+ * I/O limits or filters apply and the whole range is data (not zero) that
+ * maps to a single host file that can be read at arbitrary offsets.
+ *
+ * The range is locked against concurrent writes, discards and truncations
+ * from block status until the data has been sent, so that the host file
+ * range cannot be changed or reallocated in between.
+ *
+ * Returns -ENOTSUP if the range cannot be sent that way, in which case
+ * nothing has been sent and the caller must fall back to a normal read.
+ * Otherwise, returns 0 on success and -EIO if sending fails.
+ */
+static int coroutine_fn nbd_co_send_zero_copy(NBDClient *client,
+                                              struct iovec *iov, unsigned niov,
+                                              uint64_t offset, size_t size,
+                                              Error **errp)
+{
+#ifdef CONFIG_LINUX
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->common.blk);
+    BlockDriverState *file = NULL;
+    ThreadPool *pool;
+    BdrvTrackedRequest req;
+    NBDSendfileData data;
+    int64_t pnum, map;
+    int status, fd;
+    int ret = 0;
+
+    if (!exp->zero_copy || client->ioc != QIO_CHANNEL(client->sioc) ||
+        !bs || !bs->drv || bs->drv->is_filter ||
+        blk_is_throttled(exp->common.blk)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_co_lock_range(bs, &req, offset, size);
+
+    status = bdrv_block_status_above(bs, NULL, offset, size, &pnum, &map,
+                                     &file);
+    if (status < 0 || !(status & BDRV_BLOCK_OFFSET_VALID) ||
+        !(status & BDRV_BLOCK_DATA) || (status & BDRV_BLOCK_ZERO) ||
+        !file || pnum < size || !nbd_zero_copy_path_ok(bs, file)) {
+        ret = -ENOTSUP;
+        goto unlock;
+    }
+
+    fd = bdrv_get_host_fd(file);
+    if (fd < 0) {
+        ret = -ENOTSUP;
+        goto unlock;
+    }
+
+    trace_nbd_co_send_zero_copy(offset, map, size);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (qio_channel_writev_all(client->ioc, iov, niov, errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    pool = aio_get_thread_pool(qemu_get_current_aio_context());
+    data = (NBDSendfileData) {
+        .out_fd = client->sioc->fd,
+        .in_fd = fd,
+        .offset = map,
+    };
+    while (size > 0) {
+        int len;
+
+        data.size = size;
+        len = thread_pool_submit_co(pool, nbd_sendfile_worker, &data);
+        if (len == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            error_setg_errno(errp, -len, "sendfile failed");
+            ret = -EIO;
+            goto out;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unexpected end of file while sending data");
+            ret = -EIO;
+            goto out;
+        }
+        size -= len;
+    }
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+unlock:
+    bdrv_co_unlock_range(&req);
+
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1917,6 +2081,27 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+/*
+ * Send a successful simple reply whose payload is the @len bytes of the
+ * export at @offset, using nbd_co_send_zero_copy().  Returns -ENOTSUP if
+ * nothing was sent.
+ */
+static int coroutine_fn nbd_co_send_simple_read_zero_copy(NBDClient *client,
+                                                          uint64_t handle,
+                                                          uint64_t offset,
+                                                          size_t len,
+                                                          Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    set_be_simple_reply(&reply, 0, handle);
+
+    return nbd_co_send_zero_copy(client, iov, 1, offset, len, errp);
+}
+
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
                                 uint16_t type, uint64_t handle, uint32_t length)
 {
@@ -1966,6 +2151,30 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/*
+ * Like nbd_co_send_structured_read(), but the data is sent from the
+ * export using nbd_co_send_zero_copy().  Returns -ENOTSUP if nothing was
+ * sent.
+ */
+static int coroutine_fn
+nbd_co_send_structured_read_zero_copy(NBDClient *client, uint64_t handle,
+                                      uint64_t offset, size_t size, bool final,
+                                      Error **errp)
+{
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    assert(size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_zero_copy(client, iov, 1, offset, size, errp);
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -2039,15 +2248,21 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->common.blk, offset + progress,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_structured_read_zero_copy(client, handle,
+                                                        offset + progress,
+                                                        pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->common.blk, offset + progress,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum, final,
+                                                  errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2444,6 +2659,23 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len) {
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_read_zero_copy(client,
+                                                        request->handle,
+                                                        request->from,
+                                                        request->len, true,
+                                                        errp);
+        } else {
+            ret = nbd_co_send_simple_read_zero_copy(client, request->handle,
+                                                    request->from,
+                                                    request->len, errp);
+        }
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
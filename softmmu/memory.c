@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -38,6 +39,8 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+/* Regions changed by the pending update, NULL if everything may have changed */
+static GPtrArray *memory_region_changes;
 static bool ioeventfd_update_pending;
 unsigned int global_dirty_tracking;
 
@@ -259,6 +262,7 @@ static FlatView *flatview_new(MemoryRegion *mr_root)
     view = g_new0(FlatView, 1);
     view->ref = 1;
     view->root = mr_root;
+    view->rendered_regions = g_hash_table_new(NULL, NULL);
     memory_region_ref(mr_root);
     trace_flatview_new(view, mr_root);
 
@@ -294,6 +298,7 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    g_hash_table_unref(view->rendered_regions);
     memory_region_unref(view->root);
     g_free(view);
 }
@@ -591,6 +596,9 @@ static void render_memory_region(FlatView *view,
     FlatRange fr;
     AddrRange tmp;
 
+    /* Even if it is not visible, changes to @mr can make it visible */
+    g_hash_table_add(view->rendered_regions, mr);
+
     if (!mr->enabled) {
         return;
     }
@@ -724,11 +732,34 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+/* Do @a and @b have the same ranges, including their dirty log masks? */
+static bool flatview_equal(FlatView *a, FlatView *b)
 {
     int i;
-    FlatView *view;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i]) ||
+            a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Render the memory topology of @mr into a FlatView, a list of disjoint
+ * absolute ranges.  If @old_views has a FlatView of @mr with the
+ * same ranges, that view is kept together with its dispatch tables, so
+ * that a transaction only rebuilds the address spaces that it changed.
+ */
+static FlatView *generate_memory_topology(MemoryRegion *mr,
+                                          GHashTable *old_views)
+{
+    int i;
+    FlatView *view, *old_view;
 
     view = flatview_new(mr);
 
@@ -739,6 +770,16 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
+    old_view = old_views ? g_hash_table_lookup(old_views, mr) : NULL;
+    if (old_view && flatview_equal(old_view, view)) {
+        /* @view was never published, no need to wait for readers */
+        flatview_destroy(view);
+        flatview_ref(old_view);
+        g_hash_table_replace(flat_views, mr, old_view);
+        trace_flatview_reuse(old_view, mr);
+        return old_view;
+    }
+
     view->dispatch = address_space_dispatch_new(view);
     for (i = 0; i < view->nr; i++) {
         MemoryRegionSection mrs =
@@ -992,7 +1033,7 @@ static void flatviews_init(void)
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
     if (!empty_view) {
-        empty_view = generate_memory_topology(NULL);
+        empty_view = generate_memory_topology(NULL, NULL);
         /* We keep it alive forever in the global variable.  */
         flatview_ref(empty_view);
     } else {
@@ -1001,26 +1042,90 @@ static void flatviews_init(void)
     }
 }
 
-static void flatviews_reset(void)
+/*
+ * Record that @mr changed in the current transaction, or that anything may
+ * have changed if @mr is NULL.
+ */
+static void memory_region_changed(MemoryRegion *mr)
 {
-    AddressSpace *as;
+    if (!memory_region_update_pending) {
+        memory_region_update_pending = true;
+        memory_region_changes = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)memory_region_unref);
+    }
+    if (!memory_region_changes) {
+        return;
+    }
+    if (!mr) {
+        g_ptr_array_unref(memory_region_changes);
+        memory_region_changes = NULL;
+        return;
+    }
+    memory_region_ref(mr);
+    g_ptr_array_add(memory_region_changes, mr);
+}
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
+/*
+ * Can the pending changes affect @view?  Every change that matters either
+ * touches a region that was visited while rendering @view, or adds or
+ * removes a subregion of such a region.  Other regions cannot have been
+ * reached from its root.
+ */
+static bool flatview_changed(FlatView *view)
+{
+    MemoryRegion *mr;
+    int i;
+
+    if (!memory_region_changes) {
+        return true;
     }
+
+    for (i = 0; i < memory_region_changes->len; i++) {
+        for (mr = g_ptr_array_index(memory_region_changes, i); mr;
+             mr = mr->container) {
+            if (g_hash_table_contains(view->rendered_regions, mr)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Returns the number of FlatViews that had to be rendered */
+static unsigned flatviews_reset(void)
+{
+    AddressSpace *as;
+    GHashTable *old_views = flat_views;
+    unsigned rendered = 0;
+
+    flat_views = NULL;
     flatviews_init();
 
     /* Render unique FVs */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        old_view = old_views ? g_hash_table_lookup(old_views, physmr) : NULL;
+        if (old_view && !flatview_changed(old_view)) {
+            flatview_ref(old_view);
+            g_hash_table_replace(flat_views, physmr, old_view);
+            trace_flatview_reuse(old_view, physmr);
+            continue;
+        }
+
+        generate_memory_topology(physmr, old_views);
+        rendered++;
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
     }
+    return rendered;
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1032,6 +1137,14 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
+        /*
+         * The FlatView was kept because it did not change.  Listeners such
+         * as vhost rebuild their list of sections from region_nop between
+         * begin and commit, so still report every range to them.
+         */
+        if (!QTAILQ_EMPTY(&as->listeners)) {
+            address_space_update_topology_pass(as, new_view, new_view, true);
+        }
         return;
     }
 
@@ -1074,7 +1187,7 @@ static void address_space_update_topology(AddressSpace *as)
 
     flatviews_init();
     if (!g_hash_table_lookup(flat_views, physmr)) {
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, NULL);
     }
     address_space_set_flatview(as);
 }
@@ -1095,7 +1208,11 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            flatviews_reset();
+            int64_t start = get_clock();
+            unsigned rendered = flatviews_reset();
+            GPtrArray *changes = memory_region_changes;
+
+            memory_region_changes = NULL;
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
@@ -1106,6 +1223,17 @@ void memory_region_transaction_commit(void)
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            trace_memory_region_transaction_commit(rendered,
+                                                   get_clock() - start);
+
+            /*
+             * Dropping the last reference to a region can finalize its
+             * owner, which may start a new transaction.  Do it only once
+             * this one is complete.
+             */
+            if (changes) {
+                g_ptr_array_unref(changes);
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -2135,7 +2263,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2265,7 +2395,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2275,7 +2407,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2285,7 +2419,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2537,7 +2673,11 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        /* The subregion's address matters where it is the target of an alias */
+        memory_region_changed(mr);
+        memory_region_changed(subregion);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2586,8 +2726,10 @@ void memory_region_del_subregion(MemoryRegion *mr,
         assert(alias->mapped_via_alias >= 0);
     }
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_changed(mr);
+    }
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -2598,7 +2740,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_changed(mr);
     memory_region_transaction_commit();
 }
 
@@ -2614,7 +2756,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_changed(mr);
     memory_region_transaction_commit();
 }
 
@@ -2650,7 +2792,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2821,7 +2965,7 @@ void memory_global_dirty_log_start(unsigned int flags)
     if (!old_flags) {
         MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
         memory_region_transaction_begin();
-        memory_region_update_pending = true;
+        memory_region_changed(NULL); /* dirty_log_mask of all FlatRanges */
         memory_region_transaction_commit();
     }
 }
@@ -2836,7 +2980,7 @@ static void memory_global_dirty_log_do_stop(unsigned int flags)
 
     if (!global_dirty_tracking) {
         memory_region_transaction_begin();
-        memory_region_update_pending = true;
+        memory_region_changed(NULL); /* dirty_log_mask of all FlatRanges */
         memory_region_transaction_commit();
         MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
@@ -3008,6 +3152,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->map_client_list_lock);
+    QLIST_INIT(&as->map_client_list);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
@@ -3015,6 +3163,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 
 static void do_address_space_destroy(AddressSpace *as)
 {
+    assert(qatomic_read(&as->bounce_buffer_size) == 0);
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->map_client_list_lock);
+
     assert(QTAILQ_EMPTY(&as->listeners));
 
     flatview_unref(as->current_map);
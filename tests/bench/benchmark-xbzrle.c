@@ -0,0 +1,114 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE 4096
+#define XBZRLE_BENCH_PAGES 256
+
+typedef enum {
+    PAGE_UNCHANGED,
+    PAGE_SPARSE,
+    PAGE_RANGE,
+    PAGE_DENSE,
+    PAGE__MAX,
+} XbzrlePageType;
+
+static const char *page_type_str[PAGE__MAX] = {
+    [PAGE_UNCHANGED] = "unchanged",
+    [PAGE_SPARSE] = "sparse",
+    [PAGE_RANGE] = "range",
+    [PAGE_DENSE] = "dense",
+};
+
+static void fill_pages(uint8_t *old, uint8_t *new, XbzrlePageType type)
+{
+    int n, i;
+
+    for (i = 0; i < XBZRLE_BENCH_PAGES * XBZRLE_PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, XBZRLE_BENCH_PAGES * XBZRLE_PAGE_SIZE);
+
+    for (n = 0; n < XBZRLE_BENCH_PAGES; n++) {
+        uint8_t *p = new + n * XBZRLE_PAGE_SIZE;
+
+        switch (type) {
+        case PAGE_UNCHANGED:
+            break;
+        case PAGE_SPARSE:
+            /* a counter or pointer update every 512 bytes */
+            for (i = 0; i < XBZRLE_PAGE_SIZE; i += 512) {
+                p[i + g_test_rand_int_range(0, 512)] ^= 0xff;
+            }
+            break;
+        case PAGE_RANGE:
+            /* one contiguous write of a quarter page */
+            i = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE * 3 / 4);
+            memset(p + i, 0x5a, XBZRLE_PAGE_SIZE / 4);
+            break;
+        case PAGE_DENSE:
+            /* every eighth byte changed, close to the overflow limit */
+            for (i = 0; i < XBZRLE_PAGE_SIZE; i += 8) {
+                p[i] ^= 0xff;
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+}
+
+static void test_xbzrle_encode_speed(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_BENCH_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_BENCH_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *dst = g_malloc(XBZRLE_PAGE_SIZE);
+    const size_t total = 1 * GiB;
+    XbzrlePageType type;
+    int accel = 0;
+
+    /*
+     * Accelerator 0 is the one selected at runtime; the last one is
+     * the generic C encoder.
+     */
+    do {
+        for (type = 0; type < PAGE__MAX; type++) {
+            size_t done = 0;
+            int n = 0;
+
+            fill_pages(old, new, type);
+
+            g_test_timer_start();
+            while (done < total) {
+                xbzrle_encode_buffer(old + n * XBZRLE_PAGE_SIZE,
+                                     new + n * XBZRLE_PAGE_SIZE,
+                                     XBZRLE_PAGE_SIZE, dst, XBZRLE_PAGE_SIZE);
+                n = (n + 1) % XBZRLE_BENCH_PAGES;
+                done += XBZRLE_PAGE_SIZE;
+            }
+            g_test_timer_elapsed();
+
+            g_test_message("xbzrle encode: accel %d, %s pages %.2f MB/sec",
+                           accel, page_type_str[type],
+                           total / MiB / g_test_timer_last());
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark/encode", test_xbzrle_encode_speed);
+    return g_test_run();
+}
@@ -0,0 +1,181 @@
+/*
+ * AioContext file descriptor monitoring benchmark
+ *
+ * Registers many event notifiers in an AioContext, signals a few of them at
+ * a time and measures how fast aio_poll() dispatches them with each fd
+ * monitoring implementation.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/resource.h>
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+static unsigned int duration = 1;
+static unsigned int n_fds = 1024;
+static unsigned int n_active = 16;
+static const char *backends = "poll,epoll,io_uring";
+
+static EventNotifier *notifiers;
+static unsigned long n_dispatched;
+
+static const char commands_string[] =
+    " -d = duration in seconds\n"
+    " -n = number of monitored file descriptors\n"
+    " -a = number of file descriptors signalled per round\n"
+    " -m = comma-separated fd monitoring implementations to compare\n"
+    "      (default: poll,epoll,io_uring)";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void notifier_read(EventNotifier *e)
+{
+    if (event_notifier_test_and_clear(e)) {
+        n_dispatched++;
+    }
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit rlim;
+    rlim_t needed = n_fds + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < needed) {
+        rlim.rlim_cur = MIN(needed, rlim.rlim_max);
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+}
+
+/* Runs in its own thread, which is the home thread of the AioContext */
+static void *run_backend(void *opaque)
+{
+    const char *name = opaque;
+    Error *local_err = NULL;
+    AioContext *ctx = aio_context_new(&error_abort);
+    unsigned long rounds = 0;
+    int64_t start, end;
+    unsigned int i;
+
+    qemu_set_current_aio_context(ctx);
+    aio_context_set_fdmon(ctx, name, &local_err);
+    if (local_err) {
+        printf(" %-10s skipped: %s\n", name, error_get_pretty(local_err));
+        error_free(local_err);
+        aio_context_unref(ctx);
+        return NULL;
+    }
+
+    notifiers = g_new(EventNotifier, n_fds);
+    for (i = 0; i < n_fds; i++) {
+        if (event_notifier_init(&notifiers[i], false) < 0) {
+            fprintf(stderr, "Failed to create %u event notifiers\n", n_fds);
+            exit(1);
+        }
+        aio_set_event_notifier(ctx, &notifiers[i], false, notifier_read,
+                               NULL, NULL);
+    }
+
+    /* Let fdmon-epoll upgrade and io_uring arm its polls */
+    do {} while (aio_poll(ctx, false));
+
+    n_dispatched = 0;
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        unsigned int first = g_random_int_range(0, n_fds);
+        unsigned int stride = MAX(n_fds / n_active, 1);
+        unsigned long target = n_dispatched + n_active;
+
+        for (i = 0; i < n_active; i++) {
+            event_notifier_set(&notifiers[(first + i * stride) % n_fds]);
+        }
+        while (n_dispatched < target) {
+            aio_poll(ctx, true);
+        }
+        rounds++;
+    } while (get_clock() < end);
+    end = get_clock();
+
+    printf(" %-10s %10.2f Krounds/s %10.1f ns/event\n", name,
+           rounds / ((end - start) / 1e6),
+           (double)(end - start) / n_dispatched);
+
+    for (i = 0; i < n_fds; i++) {
+        aio_set_event_notifier(ctx, &notifiers[i], false, NULL, NULL, NULL);
+        event_notifier_cleanup(&notifiers[i]);
+    }
+    g_free(notifiers);
+    aio_context_unref(ctx);
+    return NULL;
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" duration:          %u\n", duration);
+    printf(" # of fds:          %u\n", n_fds);
+    printf(" active fds/round:  %u\n", n_active);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:a:m:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_fds = atoi(optarg);
+            break;
+        case 'a':
+            n_active = atoi(optarg);
+            break;
+        case 'm':
+            backends = optarg;
+            break;
+        }
+    }
+
+    if (!n_fds || !n_active || n_active > n_fds) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_auto(GStrv) names = NULL;
+    unsigned int i;
+
+    parse_args(argc, argv);
+    pr_params();
+    raise_fd_limit();
+
+    printf("Results:\n");
+    names = g_strsplit(backends, ",", -1);
+    for (i = 0; names[i]; i++) {
+        QemuThread thread;
+
+        qemu_thread_create(&thread, "fdmon-bench", run_backend, names[i],
+                           QEMU_THREAD_JOINABLE);
+        qemu_thread_join(&thread);
+    }
+    return 0;
+}
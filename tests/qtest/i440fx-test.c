@@ -18,6 +18,7 @@
 #include "libqos/pci.h"
 #include "libqos/pci-pc.h"
 #include "hw/pci/pci_regs.h"
+#include "hw/display/bochs-vbe.h"
 
 #define BROKEN 1
 
@@ -278,6 +279,111 @@ static void test_i440fx_pam(gconstpointer opaque)
     qtest_end();
 }
 
+/* Read every area in turn, more areas than a lookup remembers */
+static void check_sections(const uint32_t *addr, const uint8_t *value,
+                           int n, int disabled)
+{
+    int i, j;
+
+    for (j = 0; j < 3; j++) {
+        for (i = 0; i < n; i++) {
+            if (i == disabled) {
+                g_assert(!verify_area(addr[i], addr[i] + 0xFFF, value[i]));
+            } else {
+                g_assert_cmpint(readb(addr[i]), ==, value[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Switch PAM areas off and on while reading several sections in turn.
+ * Address spaces that a PAM change does not affect keep their FlatView,
+ * and lookups must never return a section of a previous memory map.
+ */
+static void test_i440fx_pam_sections(gconstpointer opaque)
+{
+    const TestData *s = opaque;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    int i;
+    static const int pam[] = { -1, 2, 6, 10, 13, -1 };
+    static const uint32_t addr[] = {
+        0x00000, 0xC0000, 0xD0000, 0xE0000, 0xEC000, 0x100000,
+    };
+    static const uint8_t value[] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+
+    bus = test_start_get_bus(s);
+    dev = qpci_device_find(bus, QPCI_DEVFN(0, 0));
+    g_assert(dev != NULL);
+
+    for (i = 0; i < ARRAY_SIZE(addr); i++) {
+        if (pam[i] >= 0) {
+            pam_set(dev, pam[i], PAM_RE | PAM_WE);
+        }
+        write_area(addr[i], addr[i] + 0xFFF, value[i]);
+    }
+    check_sections(addr, value, ARRAY_SIZE(addr), -1);
+
+    for (i = 0; i < ARRAY_SIZE(addr); i++) {
+        if (pam[i] < 0) {
+            continue;
+        }
+
+        pam_set(dev, pam[i], 0);
+        check_sections(addr, value, ARRAY_SIZE(addr), i);
+
+        /* The RAM contents are back when reads go to RAM again */
+        pam_set(dev, pam[i], PAM_RE | PAM_WE);
+        check_sections(addr, value, ARRAY_SIZE(addr), -1);
+    }
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+/*
+ * Move the MMIO BAR of the VGA device.  The BAR is a subregion of the PCI
+ * memory space, which system memory only reaches through the pci-hole
+ * alias, so the change must still re-render the FlatView of system memory.
+ */
+static void test_i440fx_bar_move(gconstpointer opaque)
+{
+    const TestData *s = opaque;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    QPCIBar bar;
+    uint64_t old_addr, new_addr;
+    uint16_t cmd;
+
+    bus = test_start_get_bus(s);
+    dev = qpci_device_find(bus, QPCI_DEVFN(2, 0));
+    g_assert(dev != NULL);
+    g_assert_cmpint(qpci_config_readw(dev, PCI_VENDOR_ID), ==, 0x1234);
+
+    bar = qpci_iomap(dev, 2, NULL);
+    qpci_device_enable(dev);
+    old_addr = bar.addr + PCI_VGA_BOCHS_OFFSET;
+    g_assert_cmphex(readw(old_addr), ==, VBE_DISPI_ID5);
+
+    new_addr = old_addr + 0x100000;
+    qpci_config_writel(dev, PCI_BASE_ADDRESS_2, bar.addr + 0x100000);
+    g_assert_cmphex(readw(new_addr), ==, VBE_DISPI_ID5);
+    g_assert_cmphex(readw(old_addr), !=, VBE_DISPI_ID5);
+
+    /* Disabling memory decoding removes the BAR, enabling adds it back */
+    cmd = qpci_config_readw(dev, PCI_COMMAND);
+    qpci_config_writew(dev, PCI_COMMAND, cmd & ~PCI_COMMAND_MEMORY);
+    g_assert_cmphex(readw(new_addr), !=, VBE_DISPI_ID5);
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+    g_assert_cmphex(readw(new_addr), ==, VBE_DISPI_ID5);
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
 #define BLOB_SIZE ((size_t)65536)
 #define ISA_BIOS_MAXSZ ((size_t)(128 * 1024))
 
@@ -406,6 +512,9 @@ int main(int argc, char **argv)
 
     qtest_add_data_func("i440fx/defaults", &data, test_i440fx_defaults);
     qtest_add_data_func("i440fx/pam", &data, test_i440fx_pam);
+    qtest_add_data_func("i440fx/pam-sections", &data,
+                        test_i440fx_pam_sections);
+    qtest_add_data_func("i440fx/bar-move", &data, test_i440fx_bar_move);
     add_firmware_test("i440fx/firmware/bios", request_bios);
     add_firmware_test("i440fx/firmware/pflash", request_pflash);
 
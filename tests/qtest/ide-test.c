@@ -550,6 +550,89 @@ static void test_bmdma_no_busmaster(void)
     test_bmdma_teardown(qts);
 }
 
+/*
+ * DMA from memory that is not RAM goes through bounce buffers.  With a
+ * budget above the 4 KiB default, all the PRDs of a request are mapped
+ * at the same time.
+ */
+static void test_bmdma_bounce_buffer(void)
+{
+    QTestState *qts;
+    QPCIDevice *dev;
+    QPCIBar bmdma_bar, ide_bar;
+    QDict *rsp;
+    uint8_t status;
+    uint8_t *buf;
+    uint8_t *cmpbuf;
+    size_t len = 16 * 512;
+    uintptr_t guest_buf;
+    /* Nothing is mapped there, so reads return zeroes */
+    uint32_t unassigned = 0xd0000000;
+    PrdtEntry prdt[1];
+    PrdtEntry unassigned_prdt[] = {
+        {
+            .addr = cpu_to_le32(unassigned),
+            .size = cpu_to_le32(len / 2),
+        },
+        {
+            .addr = cpu_to_le32(unassigned + len / 2),
+            .size = cpu_to_le32((len / 2) | PRDT_EOT),
+        },
+    };
+
+    qts = ide_test_start(
+        "-machine x-max-bounce-buffer-size=65536 "
+        "-drive file=%s,if=ide,cache=writeback,format=raw "
+        "-global piix3-ide.x-max-bounce-buffer-size=65536",
+        tmp_path);
+    qtest_irq_intercept_in(qts, "ioapic");
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': {"
+                    " 'path': '/machine',"
+                    " 'property': 'x-max-bounce-buffer-size' } }");
+    g_assert_cmpint(qdict_get_int(rsp, "return"), ==, 65536);
+    qobject_unref(rsp);
+
+    guest_buf = guest_alloc(&guest_malloc, len);
+    prdt[0].addr = cpu_to_le32(guest_buf);
+    prdt[0].size = cpu_to_le32(len | PRDT_EOT);
+
+    dev = get_pci_device(qts, &bmdma_bar, &ide_bar);
+
+    buf = g_malloc(len);
+    cmpbuf = g_malloc0(len);
+
+    /* Fill the sectors with a pattern from RAM */
+    memset(buf, 0x55, len);
+    qtest_memwrite(qts, guest_buf, buf, len);
+
+    status = send_dma_request(qts, CMD_WRITE_DMA, 0, len / 512, prdt,
+                              ARRAY_SIZE(prdt), NULL);
+    g_assert_cmphex(status, ==, BM_STS_INTR);
+    assert_bit_clear(qpci_io_readb(dev, ide_bar, reg_status), DF | ERR);
+
+    /* Overwrite them from unassigned memory, 8 KiB in two mappings */
+    status = send_dma_request(qts, CMD_WRITE_DMA, 0, len / 512,
+                              unassigned_prdt, ARRAY_SIZE(unassigned_prdt),
+                              NULL);
+    g_assert_cmphex(status, ==, BM_STS_INTR);
+    assert_bit_clear(qpci_io_readb(dev, ide_bar, reg_status), DF | ERR);
+
+    status = send_dma_request(qts, CMD_READ_DMA, 0, len / 512, prdt,
+                              ARRAY_SIZE(prdt), NULL);
+    g_assert_cmphex(status, ==, BM_STS_INTR);
+    assert_bit_clear(qpci_io_readb(dev, ide_bar, reg_status), DF | ERR);
+
+    qtest_memread(qts, guest_buf, buf, len);
+    g_assert(memcmp(buf, cmpbuf, len) == 0);
+
+    free_pci_device(dev);
+    g_free(buf);
+    g_free(cmpbuf);
+
+    test_bmdma_teardown(qts);
+}
+
 static void string_cpu_to_be16(uint16_t *s, size_t bytes)
 {
     g_assert((bytes & 1) == 0);
@@ -1035,6 +1118,7 @@ int main(int argc, char **argv)
     qtest_add_func("/ide/bmdma/trim", test_bmdma_trim);
     qtest_add_func("/ide/bmdma/various_prdts", test_bmdma_various_prdts);
     qtest_add_func("/ide/bmdma/no_busmaster", test_bmdma_no_busmaster);
+    qtest_add_func("/ide/bmdma/bounce_buffer", test_bmdma_bounce_buffer);
 
     qtest_add_func("/ide/flush", test_flush);
     qtest_add_func("/ide/flush/nodev", test_flush_nodev);
@@ -218,6 +218,18 @@ static void read_blocktime(QTestState *who)
     qobject_unref(rsp_return);
 }
 
+static void read_downtime_stats(QTestState *who)
+{
+    QDict *rsp_return, *rsp_stats;
+
+    rsp_return = migrate_query_not_failed(who);
+    g_assert(qdict_haskey(rsp_return, "downtime-stats"));
+    rsp_stats = qdict_get_qdict(rsp_return, "downtime-stats");
+    g_assert(qdict_haskey(rsp_stats, "phases"));
+    g_assert(qdict_haskey(rsp_stats, "histogram"));
+    qobject_unref(rsp_return);
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -481,6 +493,10 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Postcopy: send requested pages on a separate channel */
+    bool postcopy_preempt;
+    /* Load the state of the devices that allow it in worker threads */
+    bool parallel_load;
     const char *opts_source;
     const char *opts_target;
 } MigrateStart;
@@ -984,6 +1000,17 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (args->postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+        migrate_set_parameter_int(to, "postcopy-fault-threads", 2);
+    }
+
+    if (args->parallel_load) {
+        migrate_set_capability(from, "parallel-load", true);
+        migrate_set_capability(to, "parallel-load", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -1030,6 +1057,38 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+/*
+ * The device state is loaded by the postcopy listen thread, which cannot
+ * hand it to worker threads: it must still load all of it.
+ */
+static void test_postcopy_parallel_load(void)
+{
+    MigrateStart args = {
+        .parallel_load = true,
+    };
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, &args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_preempt(void)
+{
+    MigrateStart args = {
+        .postcopy_preempt = true,
+    };
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, &args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart args = {
@@ -1260,6 +1319,81 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static void
+test_migrate_downtime_stats_finish(QTestState *from, QTestState *to,
+                                   void *opaque)
+{
+    read_downtime_stats(from);
+}
+
+static void test_precopy_unix_downtime_stats(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .finish_hook = test_migrate_downtime_stats_finish,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void *
+test_migrate_dirty_sync_threads_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_int(from, "dirty-sync-threads", 4);
+    return NULL;
+}
+
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_migrate_dirty_sync_threads_start,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void *
+test_migrate_parallel_load_start(QTestState *from, QTestState *to)
+{
+    migrate_set_capability(from, "parallel-load", true);
+    migrate_set_capability(to, "parallel-load", true);
+    return NULL;
+}
+
+static void
+test_migrate_parallel_load_finish(QTestState *from, QTestState *to,
+                                  void *opaque)
+{
+    const char *arch = qtest_get_arch();
+
+    /*
+     * port92 allows parallel-load: its state, with the A20 gate set by
+     * the boot block, must have been loaded by a worker.
+     */
+    if (g_str_equal(arch, "i386") || g_str_equal(arch, "x86_64")) {
+        g_assert_cmphex(qtest_inb(to, 0x92), ==, qtest_inb(from, 0x92));
+        g_assert_cmphex(qtest_inb(to, 0x92) & 2, ==, 2);
+    }
+}
+
+static void test_precopy_unix_parallel_load(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_migrate_parallel_load_start,
+        .finish_hook = test_migrate_parallel_load_finish,
+    };
+
+    test_precopy_common(&args);
+}
+
 
 static void test_precopy_unix_dirty_ring(void)
 {
@@ -1322,6 +1456,67 @@ static void test_precopy_unix_tls_x509_override_host(void)
 #endif /* CONFIG_TASN1 */
 #endif /* CONFIG_GNUTLS */
 
+static void test_precopy_file_fixed_ram_common(bool multifd, bool lazy)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "fixed-ram", true);
+    migrate_set_capability(to, "fixed-ram", true);
+
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+
+    if (lazy) {
+        migrate_set_capability(to, "lazy-restore", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* The file can only be loaded once the source is done writing it */
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_precopy_file_fixed_ram(void)
+{
+    test_precopy_file_fixed_ram_common(false, false);
+}
+
+static void test_precopy_file_fixed_ram_multifd(void)
+{
+    test_precopy_file_fixed_ram_common(true, false);
+}
+
+static void test_precopy_file_fixed_ram_lazy(void)
+{
+    test_precopy_file_fixed_ram_common(false, true);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1740,6 +1935,64 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_migrate_adaptive_converge(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    bool throttled = false;
+    const char *action;
+    int64_t percentage;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "adaptive-convergence", true);
+    migrate_set_parameter_int(from, "max-cpu-throttle", 95);
+
+    /*
+     * Set the initial parameters so that the migration could not converge
+     * without throttling.
+     */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000); /* ~100Mb/s */
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Wait for the controller to throttle the guest */
+    while (!throttled) {
+        rsp = migrate_query_not_failed(from);
+        action = qdict_get_try_str(rsp, "convergence-action");
+        if (action) {
+            g_assert(qdict_haskey(rsp, "projected-downtime"));
+            throttled = g_str_equal(action, "throttle");
+        }
+        qobject_unref(rsp);
+        usleep(100);
+        g_assert_false(got_stop);
+    }
+
+    percentage = read_migrate_property_int(from, "cpu-throttle-percentage");
+    g_assert_cmpint(percentage, >, 0);
+    g_assert_cmpint(percentage, <=, 95);
+
+    /* Now let it converge */
+    migrate_set_parameter_int(from, "downtime-limit", 250);
+    migrate_set_parameter_int(from, "max-bandwidth", 400000000);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_start_common(QTestState *from,
                                               QTestState *to,
@@ -1778,6 +2031,16 @@ test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_zero_page_start(QTestState *from,
+                                                 QTestState *to)
+{
+    migrate_set_capability(from, "multifd-zero-page", true);
+    migrate_set_capability(to, "multifd-zero-page", true);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
@@ -1785,8 +2048,25 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 {
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zstd");
 }
+
+static void *
+test_migrate_precopy_tcp_multifd_zstd_dict_start(QTestState *from,
+                                                 QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to,
+                                                         "zstd-dict");
+}
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
 static void test_multifd_tcp_none(void)
 {
     MigrateCommon args = {
@@ -1805,6 +2085,37 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void
+test_migrate_precopy_tcp_multifd_zero_page_finish(QTestState *from,
+                                                  QTestState *to,
+                                                  void *opaque)
+{
+    int64_t page_size = read_ram_property_int(from, "page-size");
+    int64_t duplicate = read_ram_property_int(from, "duplicate");
+    int64_t normal_bytes = read_ram_property_int(from, "normal-bytes");
+    int64_t multifd_bytes = read_ram_property_int(from, "multifd-bytes");
+
+    /*
+     * Most of guest RAM is never written by the test, so many pages are
+     * zero.  They are found by the channels, which only send their
+     * offset: the data of normal pages plus the packet headers must be
+     * all that was transferred.
+     */
+    g_assert_cmpint(duplicate, >, 0);
+    g_assert_cmpint(multifd_bytes, >=, normal_bytes);
+    g_assert_cmpint(multifd_bytes - normal_bytes, <, duplicate * page_size);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zero_page_start,
+        .finish_hook = test_migrate_precopy_tcp_multifd_zero_page_finish,
+    };
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
@@ -1814,6 +2125,26 @@ static void test_multifd_tcp_zstd(void)
     };
     test_precopy_common(&args);
 }
+
+static void test_multifd_tcp_zstd_dict(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zstd_dict_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+    };
+    test_precopy_common(&args);
+}
 #endif
 
 #ifdef CONFIG_GNUTLS
@@ -2134,9 +2465,24 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/parallel-load",
+                   test_postcopy_parallel_load);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix/plain", test_precopy_unix_plain);
+    qtest_add_func("/migration/precopy/unix/downtime-stats",
+                   test_precopy_unix_downtime_stats);
+    qtest_add_func("/migration/precopy/unix/dirty-sync-threads",
+                   test_precopy_unix_dirty_sync_threads);
+    qtest_add_func("/migration/precopy/unix/parallel-load",
+                   test_precopy_unix_parallel_load);
+    qtest_add_func("/migration/precopy/file/fixed-ram",
+                   test_precopy_file_fixed_ram);
+    qtest_add_func("/migration/precopy/file/fixed-ram/multifd",
+                   test_precopy_file_fixed_ram_multifd);
+    qtest_add_func("/migration/precopy/file/fixed-ram/lazy",
+                   test_precopy_file_fixed_ram_lazy);
     qtest_add_func("/migration/precopy/unix/xbzrle", test_precopy_unix_xbzrle);
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/precopy/unix/tls/psk",
@@ -2183,15 +2529,25 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/adaptive_converge",
+                   test_migrate_adaptive_converge);
     qtest_add_func("/migration/multifd/tcp/plain/none",
                    test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/plain/cancel",
                    test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/plain/zlib",
                    test_multifd_tcp_zlib);
+    qtest_add_func("/migration/multifd/tcp/plain/zero-page",
+                   test_multifd_tcp_zero_page);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/plain/zstd",
                    test_multifd_tcp_zstd);
+    qtest_add_func("/migration/multifd/tcp/plain/zstd-dict",
+                   test_multifd_tcp_zstd_dict);
+#endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/plain/lz4",
+                   test_multifd_tcp_lz4);
 #endif
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/multifd/tcp/tls/psk/match",
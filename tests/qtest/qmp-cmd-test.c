@@ -15,6 +15,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-visit-introspect.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qapi/qobject-input-visitor.h"
 
 const char common_args[] = "-nodefaults -machine none";
@@ -53,6 +54,7 @@ static int query_error_class(const char *cmd)
         { "x-query-usb", ERROR_CLASS_GENERIC_ERROR },
         /* Only valid with accel=tcg */
         { "x-query-jit", ERROR_CLASS_GENERIC_ERROR },
+        { "x-query-jit-htable", ERROR_CLASS_GENERIC_ERROR },
         { "x-query-opcount", ERROR_CLASS_GENERIC_ERROR },
         { NULL, -1 }
     };
@@ -213,6 +215,81 @@ static void add_query_tests(QmpSchema *schema)
     }
 }
 
+#ifndef _WIN32
+static void test_iothread_poll_stats(void)
+{
+    QTestState *qts;
+    QDict *resp, *info = NULL, *stats;
+    QListEntry *entry;
+    QList *list;
+
+    qts = qtest_init(common_args);
+
+    /* the CPU budget is a percentage */
+    resp = qtest_qmp(qts, "{'execute': 'object-add', 'arguments':"
+                     " {'qom-type': 'iothread', 'id': 'iot0',"
+                     " 'poll-cpu-budget': 101 } }");
+    g_assert_nonnull(resp);
+    qmp_expect_error_and_unref(resp, "GenericError");
+
+    resp = qtest_qmp(qts, "{'execute': 'object-add', 'arguments':"
+                     " {'qom-type': 'iothread', 'id': 'iot0',"
+                     " 'poll-max-ns': 32768, 'poll-cpu-budget': 50 } }");
+    g_assert_nonnull(resp);
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+
+    resp = qtest_qmp(qts, "{'execute': 'qom-set', 'arguments':"
+                     " {'path': '/objects/iot0', 'property': 'poll-cpu-budget',"
+                     " 'value': -1 } }");
+    g_assert_nonnull(resp);
+    qmp_expect_error_and_unref(resp, "GenericError");
+
+    resp = qtest_qmp(qts, "{'execute': 'qom-set', 'arguments':"
+                     " {'path': '/objects/iot0', 'property': 'poll-cpu-budget',"
+                     " 'value': 200 } }");
+    g_assert_nonnull(resp);
+    qmp_expect_error_and_unref(resp, "GenericError");
+
+    resp = qtest_qmp(qts, "{'execute': 'query-iothreads'}");
+    g_assert_nonnull(resp);
+    list = qdict_get_qlist(resp, "return");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *iothread = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(iothread, "id"), "iot0")) {
+            info = iothread;
+        }
+    }
+    g_assert_nonnull(info);
+    g_assert_cmpint(qdict_get_int(info, "poll-max-ns"), ==, 32768);
+    g_assert_cmpint(qdict_get_int(info, "poll-cpu-budget"), ==, 50);
+
+    stats = qdict_get_qdict(info, "poll-stats");
+    g_assert_nonnull(stats);
+    g_assert(qdict_haskey(stats, "poll-ns"));
+    g_assert(qdict_haskey(stats, "poll-count"));
+    g_assert(qdict_haskey(stats, "poll-success"));
+    g_assert(qdict_haskey(stats, "poll-time"));
+    g_assert(qdict_haskey(stats, "poll-over-budget"));
+    g_assert(qdict_haskey(stats, "wait-count"));
+    g_assert(qdict_haskey(stats, "wait-time"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(stats, "poll-histogram")),
+                    ==, 6);
+    /* at least the event notifier of the AioContext */
+    g_assert_false(qlist_empty(qdict_get_qlist(stats, "handlers")));
+    qobject_unref(resp);
+
+    resp = qtest_qmp(qts, "{'execute': 'object-del', 'arguments':"
+                     " {'id': 'iot0' } }");
+    g_assert_nonnull(resp);
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+
+    qtest_quit(qts);
+}
+#endif
+
 static void test_object_add_failure_modes(void)
 {
     QTestState *qts;
@@ -351,6 +428,9 @@ int main(int argc, char *argv[])
 
     qtest_add_func("qmp/object-add-failure-modes",
                    test_object_add_failure_modes);
+#ifndef _WIN32
+    qtest_add_func("qmp/iothread-poll-stats", test_iothread_poll_stats);
+#endif
 
     ret = g_test_run();
 
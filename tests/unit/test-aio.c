@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "block/aio.h"
 #include "qapi/error.h"
+#include "qapi/qapi-types-misc.h"
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
@@ -913,6 +914,211 @@ static void test_worker_thread_co_enter(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+static void *test_notify_thread(void *opaque)
+{
+    /* Give the main thread time to block in aio_poll */
+    g_usleep(100000);
+    aio_notify(ctx);
+    aio_notify(ctx);
+    return NULL;
+}
+
+static void test_notify_stats(void)
+{
+    uint64_t sent = stat64_get(&ctx->notify_sent);
+    uint64_t suppressed = stat64_get(&ctx->notify_suppressed);
+    QemuThread thread;
+
+    /* Nobody is waiting: no need to kick the event loop */
+    aio_notify(ctx);
+    g_assert_cmpint(stat64_get(&ctx->notify_sent), ==, sent);
+    g_assert_cmpint(stat64_get(&ctx->notify_suppressed), ==, suppressed + 1);
+    do {} while (aio_poll(ctx, false));
+
+    /* The second notification of the same wait does not kick it again */
+    sent = stat64_get(&ctx->notify_sent);
+    suppressed = stat64_get(&ctx->notify_suppressed);
+    qemu_thread_create(&thread, "test_notify_thread", test_notify_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    aio_poll(ctx, true);
+    qemu_thread_join(&thread);
+    do {} while (aio_poll(ctx, false));
+    g_assert_cmpint(stat64_get(&ctx->notify_sent), <=, sent + 1);
+    g_assert_cmpint(stat64_get(&ctx->notify_sent) +
+                    stat64_get(&ctx->notify_suppressed), >=,
+                    sent + suppressed + 2);
+}
+
+static void test_notify_two_waiters(void)
+{
+    uint64_t sent;
+
+    do {} while (aio_poll(ctx, false));
+
+    /*
+     * Another thread is blocked in aio_poll(ctx, true): it has raised
+     * notify_me and cleared notify_kicked.
+     */
+    qatomic_set(&ctx->notify_kicked, false);
+    qatomic_set(&ctx->notify_me, qatomic_read(&ctx->notify_me) + 2);
+
+    /* This notification kicks both waiters... */
+    sent = stat64_get(&ctx->notify_sent);
+    aio_notify(ctx);
+    g_assert_cmpint(stat64_get(&ctx->notify_sent), ==, sent + 1);
+
+    /* ... but this thread wakes up first and consumes the kick */
+    aio_poll(ctx, false);
+    g_assert(!event_notifier_test_and_clear(&ctx->notifier));
+
+    /* The other thread is still blocked, so it must be kicked again */
+    aio_notify(ctx);
+    g_assert_cmpint(stat64_get(&ctx->notify_sent), ==, sent + 2);
+    g_assert(event_notifier_test_and_clear(&ctx->notifier));
+
+    qatomic_set(&ctx->notify_me, qatomic_read(&ctx->notify_me) - 2);
+    do {} while (aio_poll(ctx, false));
+}
+
+#ifndef _WIN32
+static bool poll_test_ready;
+
+static bool poll_test_poll(void *opaque)
+{
+    return qatomic_read(&poll_test_ready);
+}
+
+static void poll_test_poll_ready(EventNotifier *e)
+{
+    qatomic_set(&poll_test_ready, false);
+}
+
+static void poll_test_timer_cb(void *opaque)
+{
+    bool *fired = opaque;
+
+    *fired = true;
+}
+
+/*
+ * Run aio_poll(ctx, true) with a timer armed @ns in the future, and keep
+ * running it until the timer fires if @wait_timer is true.
+ */
+static void poll_test_run(QEMUTimer *timer, int64_t ns, bool wait_timer)
+{
+    bool *fired = timer->opaque;
+
+    *fired = false;
+    timer_mod(timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + ns);
+    do {
+        aio_poll(ctx, true);
+    } while (wait_timer && !*fired);
+    timer_del(timer);
+}
+
+static uint64_t poll_test_bucket(IOThreadPollStats *stats, int i)
+{
+    uint64List *bucket = stats->poll_histogram;
+
+    while (i--) {
+        bucket = bucket->next;
+    }
+    return bucket->value;
+}
+
+static void test_poll_stats(void)
+{
+    EventNotifier e;
+    QEMUTimer timer;
+    bool fired;
+    IOThreadPollStats *before, *after;
+    IOThreadHandlerStatsList *h;
+    Error *err = NULL;
+    uint64_t buckets = 0;
+    int i;
+
+    event_notifier_init(&e, false);
+    aio_set_event_notifier(ctx, &e, false, dummy_notifier_read,
+                           poll_test_poll, poll_test_poll_ready);
+    aio_timer_init(ctx, &timer, QEMU_CLOCK_REALTIME, SCALE_NS,
+                   poll_test_timer_cb, &fired);
+    aio_context_set_poll_params(ctx, 10 * SCALE_MS, 0, 0, &error_abort);
+    do {} while (aio_poll(ctx, false));
+
+    /* A polling phase that finds nothing lasts for the whole polling time */
+    before = aio_context_get_poll_stats(ctx);
+    ctx->poll_ns = 100 * SCALE_US;
+    poll_test_run(&timer, 2 * SCALE_MS, true);
+    after = aio_context_get_poll_stats(ctx);
+
+    g_assert_cmpint(after->poll_count, >, before->poll_count);
+    g_assert_cmpint(after->poll_success, ==, before->poll_success);
+    g_assert_cmpint(after->poll_time - before->poll_time, >=, 100 * SCALE_US);
+    g_assert_cmpint(after->wait_count, >, before->wait_count);
+    for (i = 0; i < AIO_POLL_HISTOGRAM_BUCKETS; i++) {
+        buckets += poll_test_bucket(after, i) - poll_test_bucket(before, i);
+    }
+    g_assert_cmpint(buckets, ==, after->poll_count - before->poll_count);
+    /* [64us, 256us) or above */
+    g_assert_cmpint(poll_test_bucket(after, 4) + poll_test_bucket(after, 5),
+                    >,
+                    poll_test_bucket(before, 4) + poll_test_bucket(before, 5));
+    qapi_free_IOThreadPollStats(before);
+    qapi_free_IOThreadPollStats(after);
+
+    /* Polling finds the event, the handler is called without waiting */
+    before = aio_context_get_poll_stats(ctx);
+    ctx->poll_ns = 100 * SCALE_US;
+    qatomic_set(&poll_test_ready, true);
+    poll_test_run(&timer, SCALE_SEC, false);
+    after = aio_context_get_poll_stats(ctx);
+
+    g_assert(!qatomic_read(&poll_test_ready));
+    g_assert_cmpint(after->poll_success, ==, before->poll_success + 1);
+    for (h = after->handlers; h; h = h->next) {
+        if (h->value->fd == event_notifier_get_fd(&e)) {
+            g_assert_cmpint(h->value->polled, ==, 1);
+            break;
+        }
+    }
+    g_assert(h);
+    qapi_free_IOThreadPollStats(before);
+    qapi_free_IOThreadPollStats(after);
+
+    /* The budget is a percentage */
+    aio_context_set_poll_cpu_budget(ctx, 101, &err);
+    error_free_or_abort(&err);
+    aio_context_set_poll_cpu_budget(ctx, -1, &err);
+    error_free_or_abort(&err);
+
+    /* A window spent polling is over a 10% budget: stop polling */
+    aio_context_set_poll_cpu_budget(ctx, 10, &error_abort);
+    do {} while (aio_poll(ctx, false));
+    ctx->poll_window_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                             AIO_POLL_BUDGET_WINDOW_NS;
+    ctx->poll_window_ns = AIO_POLL_BUDGET_WINDOW_NS;
+    ctx->poll_ns = 100 * SCALE_US;
+    qatomic_set(&poll_test_ready, true);
+    poll_test_run(&timer, SCALE_SEC, false);
+
+    g_assert(ctx->poll_over_budget);
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+    after = aio_context_get_poll_stats(ctx);
+    g_assert(after->poll_over_budget);
+    qapi_free_IOThreadPollStats(after);
+
+    /* Without a budget, polling is no longer limited */
+    aio_context_set_poll_cpu_budget(ctx, 0, &error_abort);
+    do {} while (aio_poll(ctx, false));
+    g_assert(!ctx->poll_over_budget);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    aio_set_event_notifier(ctx, &e, false, NULL, NULL, NULL);
+    event_notifier_cleanup(&e);
+    do {} while (aio_poll(ctx, false));
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -937,6 +1143,11 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/notify/stats",            test_notify_stats);
+    g_test_add_func("/aio/notify/two-waiters",      test_notify_two_waiters);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll/stats",              test_poll_stats);
+#endif
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
@@ -451,6 +451,29 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that coroutines freed by a thread are reused by the same thread
+ */
+static void test_pool_stats(void)
+{
+    CoroutinePoolStats before, after;
+    bool done = false;
+    int i;
+
+    /* Make sure that there is a coroutine in the pool */
+    qemu_coroutine_enter(qemu_coroutine_create(set_and_exit, &done));
+
+    qemu_coroutine_get_pool_stats(&before);
+    for (i = 0; i < 10; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(set_and_exit, &done));
+    }
+    qemu_coroutine_get_pool_stats(&after);
+
+    g_assert_cmpuint(after.reused - before.reused, ==, 10);
+    g_assert_cmpuint(after.created, ==, before.created);
+    g_assert_cmpuint(after.deleted, ==, before.deleted);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -649,6 +672,7 @@ int main(int argc, char **argv)
      */
     if (CONFIG_COROUTINE_POOL) {
         g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
+        g_test_add_func("/basic/pool-stats", test_pool_stats);
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
@@ -251,10 +251,22 @@ static void test_resize(void)
     qht_test(QHT_MODE_AUTO_RESIZE);
 }
 
+static void test_resize_background(void)
+{
+    /*
+     * The resize thread frees old maps after a grace period; stay in a
+     * read-side critical section since we also use the qht as a writer.
+     */
+    rcu_read_lock();
+    qht_test(QHT_MODE_AUTO_RESIZE | QHT_MODE_BACKGROUND_RESIZE);
+    rcu_read_unlock();
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/qht/mode/default", test_default);
     g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/mode/resize-background", test_resize_background);
     return g_test_run();
 }
@@ -0,0 +1,229 @@
+/*
+ * Tests for synchronize_rcu() and its variants
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/notify.h"
+#include "qemu/sys_membarrier.h"
+
+#if defined(CONFIG_MEMBARRIER) && defined(CONFIG_LINUX)
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/membarrier.h>
+#include <linux/seccomp.h>
+#endif
+
+#define N_WRITERS 8
+#define N_SYNCS   4
+
+static bool reader_running;
+static bool reader_leave;
+static bool reader_forced;
+
+/* Stay in a read-side critical section until told to leave it */
+static void reader_wait(void)
+{
+    rcu_read_lock();
+    qatomic_set(&reader_running, true);
+    while (!qatomic_read(&reader_leave)) {
+        g_usleep(1000);
+    }
+    rcu_read_unlock();
+}
+
+static void *reader_thread(void *opaque)
+{
+    rcu_register_thread();
+    reader_wait();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void *writer_thread(void *opaque)
+{
+    int i;
+
+    for (i = 0; i < N_SYNCS; i++) {
+        synchronize_rcu();
+    }
+    return NULL;
+}
+
+static void start_reader(QemuThread *thread, void *(*fn)(void *))
+{
+    qatomic_set(&reader_running, false);
+    qatomic_set(&reader_leave, false);
+    qemu_thread_create(thread, "reader", fn, NULL, QEMU_THREAD_JOINABLE);
+    while (!qatomic_read(&reader_running)) {
+        g_usleep(1000);
+    }
+}
+
+/*
+ * Writers that call synchronize_rcu() while a grace period is waiting for a
+ * reader all need the next grace period; only one of them should run it.
+ */
+static void test_shared_grace_periods(void)
+{
+    QemuThread reader, writers[N_WRITERS];
+    struct rcu_stats before, after;
+    int i;
+
+    rcu_get_stats(&before);
+    start_reader(&reader, reader_thread);
+    for (i = 0; i < N_WRITERS; i++) {
+        qemu_thread_create(&writers[i], "writer", writer_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    /* Let all writers queue up behind the first grace period */
+    g_usleep(100 * 1000);
+    qatomic_set(&reader_leave, true);
+
+    for (i = 0; i < N_WRITERS; i++) {
+        qemu_thread_join(&writers[i]);
+    }
+    qemu_thread_join(&reader);
+    rcu_get_stats(&after);
+
+    /* Each call either ran a grace period or shared one */
+    g_assert_cmpuint((after.grace_periods - before.grace_periods) +
+                     (after.shared_grace_periods -
+                      before.shared_grace_periods), ==,
+                     N_WRITERS * N_SYNCS);
+    g_assert_cmpuint(after.shared_grace_periods, >,
+                     before.shared_grace_periods);
+    g_assert_cmpuint(after.grace_periods - before.grace_periods, <,
+                     N_WRITERS * N_SYNCS);
+    g_assert_cmpuint(after.gp_max_ns, >=, before.gp_max_ns);
+}
+
+static void force_rcu_notify(Notifier *n, void *data)
+{
+    qatomic_set(&reader_forced, true);
+    qatomic_set(&reader_leave, true);
+}
+
+/* Like reader_thread, but leave when an expedited grace period asks to */
+static void *forced_reader_thread(void *opaque)
+{
+    Notifier force_rcu = { .notify = force_rcu_notify };
+
+    rcu_register_thread();
+    rcu_add_force_rcu_notifier(&force_rcu);
+    reader_wait();
+    rcu_remove_force_rcu_notifier(&force_rcu);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_expedited(void)
+{
+    QemuThread reader;
+
+    qatomic_set(&reader_forced, false);
+    start_reader(&reader, forced_reader_thread);
+
+    /* Would wait forever if the reader was not asked to leave */
+    synchronize_rcu_expedited();
+    g_assert(qatomic_read(&reader_forced));
+
+    qemu_thread_join(&reader);
+}
+
+#if defined(CONFIG_MEMBARRIER) && defined(CONFIG_LINUX)
+/*
+ * Reject MEMBARRIER_CMD_PRIVATE_EXPEDITED with EPERM, and also
+ * MEMBARRIER_CMD_SHARED if @shared_fails.
+ */
+static int membarrier_filter(bool shared_fails)
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_membarrier, 0, 5),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, args[0]) +
+                 (HOST_BIG_ENDIAN ? 4 : 0)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                 MEMBARRIER_CMD_PRIVATE_EXPEDITED, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                 MEMBARRIER_CMD_SHARED, 0, 2),
+        BPF_STMT(BPF_RET | BPF_K,
+                 shared_fails ? SECCOMP_RET_ERRNO | EPERM : SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = {
+        .len = ARRAY_SIZE(filter),
+        .filter = filter,
+    };
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
+        return -1;
+    }
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog);
+}
+
+/*
+ * Call smp_mb_global() twice in a child with membarrier_filter() installed.
+ * Returns false if seccomp filters are not available.
+ */
+static bool membarrier_child(bool shared_fails, int *status)
+{
+    pid_t pid;
+
+    pid = fork();
+    g_assert(pid >= 0);
+    if (pid == 0) {
+        if (membarrier_filter(shared_fails) < 0) {
+            _exit(2);
+        }
+        smp_mb_global();
+        smp_mb_global();
+        _exit(0);
+    }
+
+    g_assert(waitpid(pid, status, 0) == pid);
+    return !WIFEXITED(*status) || WEXITSTATUS(*status) != 2;
+}
+
+/*
+ * If the kernel rejects the private expedited command, smp_mb_global() must
+ * fall back to MEMBARRIER_CMD_SHARED, and abort if that fails too.
+ */
+static void test_membarrier_fallback(void)
+{
+    int status;
+
+    if (!membarrier_child(false, &status)) {
+        g_test_skip("seccomp filters are not available");
+        return;
+    }
+    g_assert(WIFEXITED(status));
+    g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+
+    g_assert(membarrier_child(true, &status));
+    g_assert(WIFSIGNALED(status));
+    g_assert_cmpint(WTERMSIG(status), ==, SIGABRT);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/sync/shared", test_shared_grace_periods);
+    g_test_add_func("/rcu/sync/expedited", test_expedited);
+#if defined(CONFIG_MEMBARRIER) && defined(CONFIG_LINUX)
+    g_test_add_func("/rcu/membarrier/fallback", test_membarrier_fallback);
+#endif
+    return g_test_run();
+}
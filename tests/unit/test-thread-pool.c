@@ -3,6 +3,7 @@
 #include "block/thread-pool.h"
 #include "block/block.h"
 #include "qapi/error.h"
+#include "qapi/qapi-types-misc.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -135,6 +136,25 @@ static void test_submit_many(void)
     }
 }
 
+static void test_stats(void)
+{
+    ThreadPoolStats *before, *after;
+
+    before = thread_pool_get_stats(pool);
+    test_submit_many();
+    after = thread_pool_get_stats(pool);
+
+    g_assert_cmpint(after->requests - before->requests, ==, 100);
+    g_assert_cmpint(after->in_flight, ==, 0);
+    g_assert_cmpint(after->queue_depth, ==, 0);
+    g_assert_cmpint(after->max_queue_depth, >=, 1);
+    g_assert_cmpint(after->threads, >=, 1);
+    g_assert_cmpint(after->queue_time_max, >=, after->queue_time_avg);
+
+    qapi_free_ThreadPoolStats(before);
+    qapi_free_ThreadPoolStats(after);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -242,6 +262,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/stats", test_stats);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
@@ -173,6 +173,93 @@ static void test_encode_decode(void)
     }
 }
 
+#define XBZRLE_ACCEL_PAGES 64
+
+static void fill_accel_page(uint8_t *old, uint8_t *new, int n)
+{
+    int i;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int_range(0, 4);
+    }
+    memcpy(new, old, XBZRLE_PAGE_SIZE);
+
+    switch (n % 4) {
+    case 0:
+        /* unchanged */
+        break;
+    case 1:
+        /* sparse: a handful of isolated bytes */
+        for (i = 0; i < 16; i++) {
+            new[g_test_rand_int_range(0, XBZRLE_PAGE_SIZE)] ^= 0xff;
+        }
+        break;
+    case 2:
+        /* a single dirty range of random length and offset */
+        i = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+        memset(new + i, 0x5a,
+               g_test_rand_int_range(1, XBZRLE_PAGE_SIZE - i + 1));
+        break;
+    default:
+        /* dense: short runs of both kinds all over the page */
+        for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+            new[i] = g_test_rand_int_range(0, 4);
+        }
+        break;
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *expected = g_malloc(XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int expected_len[XBZRLE_ACCEL_PAGES];
+    int dlen[XBZRLE_ACCEL_PAGES];
+    bool first = true;
+    int n, rc;
+
+    for (n = 0; n < XBZRLE_ACCEL_PAGES; n++) {
+        fill_accel_page(old + n * XBZRLE_PAGE_SIZE,
+                        new + n * XBZRLE_PAGE_SIZE, n);
+        /* also check that every encoder overflows at the same point */
+        dlen[n] = n & 1 ? g_test_rand_int_range(2, XBZRLE_PAGE_SIZE)
+                        : XBZRLE_PAGE_SIZE;
+    }
+
+    /*
+     * Encode with every accelerator, from the most preferred down to the
+     * generic C implementation, and require bit-identical output.
+     */
+    do {
+        for (n = 0; n < XBZRLE_ACCEL_PAGES; n++) {
+            uint8_t *exp = expected + n * XBZRLE_PAGE_SIZE;
+
+            rc = xbzrle_encode_buffer(old + n * XBZRLE_PAGE_SIZE,
+                                      new + n * XBZRLE_PAGE_SIZE,
+                                      XBZRLE_PAGE_SIZE, compressed, dlen[n]);
+            if (first) {
+                expected_len[n] = rc;
+                if (rc > 0) {
+                    memcpy(exp, compressed, rc);
+                }
+                continue;
+            }
+            g_assert_cmpint(rc, ==, expected_len[n]);
+            if (rc > 0) {
+                g_assert(memcmp(compressed, exp, rc) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(expected);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +272,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
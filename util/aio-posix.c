@@ -14,6 +14,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "block/block.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -97,14 +98,15 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     return true;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        fd_handle_type fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        AioPollFn *io_poll,
-                        IOHandler *io_poll_ready,
-                        void *opaque)
+static void aio_set_fd_handler_common(AioContext *ctx,
+                                      fd_handle_type fd,
+                                      bool is_external,
+                                      bool is_event_notifier,
+                                      IOHandler *io_read,
+                                      IOHandler *io_write,
+                                      AioPollFn *io_poll,
+                                      IOHandler *io_poll_ready,
+                                      void *opaque)
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
@@ -145,6 +147,7 @@ void aio_set_fd_handler(AioContext *ctx,
         new_node->io_poll_ready = io_poll_ready;
         new_node->opaque = opaque;
         new_node->is_external = is_external;
+        new_node->is_event_notifier = is_event_notifier;
 
         if (is_new) {
             new_node->pfd.fd = fd;
@@ -180,6 +183,19 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        fd_handle_type fd,
+                        bool is_external,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioPollFn *io_poll,
+                        IOHandler *io_poll_ready,
+                        void *opaque)
+{
+    aio_set_fd_handler_common(ctx, fd, is_external, false, io_read, io_write,
+                              io_poll, io_poll_ready, opaque);
+}
+
 void aio_set_fd_poll(AioContext *ctx, int fd,
                      IOHandler *io_poll_begin,
                      IOHandler *io_poll_end)
@@ -201,9 +217,9 @@ void aio_set_event_notifier(AioContext *ctx,
                             AioPollFn *io_poll,
                             EventNotifierHandler *io_poll_ready)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier), is_external,
-                       (IOHandler *)io_read, NULL, io_poll,
-                       (IOHandler *)io_poll_ready, notifier);
+    aio_set_fd_handler_common(ctx, event_notifier_get_fd(notifier),
+                              is_external, true, (IOHandler *)io_read, NULL,
+                              io_poll, (IOHandler *)io_poll_ready, notifier);
 }
 
 void aio_set_event_notifier_poll(AioContext *ctx,
@@ -353,6 +369,7 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         poll_ready && revents == 0 &&
         aio_node_check(ctx, node->is_external) &&
         node->io_poll_ready) {
+        stat64_add(&node->poll_ready_count, 1);
         node->io_poll_ready(node->opaque);
 
         /*
@@ -366,6 +383,7 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
         node->io_read) {
+        stat64_add(&node->dispatch_count, 1);
         node->io_read(node->opaque);
 
         /* aio_notify() does not count as progress */
@@ -377,6 +395,7 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         (revents & (G_IO_OUT | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
         node->io_write) {
+        stat64_add(&node->dispatch_count, 1);
         node->io_write(node->opaque);
         progress = true;
     }
@@ -507,6 +526,62 @@ static bool remove_idle_poll_handlers(AioContext *ctx,
     return progress;
 }
 
+/* Record a polling phase of @elapsed_ns in the statistics */
+static void poll_account(AioContext *ctx, int64_t elapsed_ns, bool progress)
+{
+    int64_t limit = 1000;
+    int bucket = 0;
+
+    while (bucket < AIO_POLL_HISTOGRAM_BUCKETS - 1 && elapsed_ns >= limit) {
+        bucket++;
+        limit *= 4;
+    }
+
+    stat64_add(&ctx->poll_count, 1);
+    if (progress) {
+        stat64_add(&ctx->poll_success, 1);
+    }
+    stat64_add(&ctx->poll_time_ns, elapsed_ns);
+    stat64_add(&ctx->poll_histogram[bucket], 1);
+    ctx->poll_window_ns += elapsed_ns;
+}
+
+/*
+ * Check the polling time against ctx->poll_cpu_budget once per window,
+ * and shrink it if it was over the budget.  Polling time does not grow
+ * while over the budget.
+ */
+static void poll_check_budget(AioContext *ctx, int64_t now)
+{
+    int64_t window = now - ctx->poll_window_start;
+    int64_t budget = qatomic_read(&ctx->poll_cpu_budget);
+
+    if (!budget) {
+        ctx->poll_over_budget = false;
+        return;
+    }
+    if (window < AIO_POLL_BUDGET_WINDOW_NS) {
+        return;
+    }
+
+    ctx->poll_over_budget = ctx->poll_window_ns * 100 > window * budget;
+    trace_poll_check_budget(ctx, ctx->poll_window_ns * 100 / window, budget);
+    if (ctx->poll_over_budget) {
+        int64_t old = ctx->poll_ns;
+
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    }
+
+    ctx->poll_window_start = now;
+    ctx->poll_window_ns = 0;
+}
+
 /* run_poll_handlers:
  * @ctx: the AioContext
  * @ready_list: the list to place ready handlers on
@@ -547,6 +622,8 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    poll_account(ctx, elapsed_time, progress);
+
     if (remove_idle_poll_handlers(ctx, ready_list,
                                   start_time + elapsed_time)) {
         *timeout = 0;
@@ -640,6 +717,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
      */
     use_notify_me = timeout != 0;
     if (use_notify_me) {
+        qatomic_set(&ctx->notify_kicked, false);
+        /*
+         * Write notify_kicked before notify_me.  Pairs with smp_rmb in
+         * aio_notify().
+         */
+        smp_wmb();
         qatomic_set(&ctx->notify_me, qatomic_read(&ctx->notify_me) + 2);
         /*
          * Write ctx->notify_me before reading ctx->notified.  Pairs with
@@ -657,7 +740,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
      * system call---a single round of run_poll_handlers_once suffices.
      */
     if (timeout || ctx->fdmon_ops->need_wait(ctx)) {
+        int64_t wait_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
         ctx->fdmon_ops->wait(ctx, &ready_list, timeout);
+
+        stat64_add(&ctx->wait_count, 1);
+        stat64_add(&ctx->wait_time_ns,
+                   qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - wait_start);
     }
 
     if (use_notify_me) {
@@ -670,7 +759,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* Adjust polling time */
     if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        int64_t block_ns = now - start;
+
+        poll_check_budget(ctx, now);
 
         if (block_ns <= ctx->poll_ns) {
             /* This is the sweet spot, no adjustment needed */
@@ -686,7 +778,8 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
             trace_poll_shrink(ctx, old, ctx->poll_ns);
         } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
+                   block_ns < ctx->poll_max_ns &&
+                   !ctx->poll_over_budget) {
             /* There is room to grow, poll longer */
             int64_t old = ctx->poll_ns;
             int64_t grow = ctx->poll_grow;
@@ -753,6 +846,43 @@ void aio_context_use_g_source(AioContext *ctx)
     aio_free_deleted_handlers(ctx);
 }
 
+void aio_context_set_fdmon(AioContext *ctx, const char *name, Error **errp)
+{
+    AioHandler *node;
+
+    if (strcmp(name, "poll") && strcmp(name, "epoll") &&
+        strcmp(name, "io_uring")) {
+        error_setg(errp, "Unknown file descriptor monitoring '%s'", name);
+        return;
+    }
+
+    /* Start from fdmon-poll, which needs no setup */
+    fdmon_io_uring_destroy(ctx);
+    fdmon_epoll_disable(ctx);
+    aio_free_deleted_handlers(ctx);
+
+    if (!strcmp(name, "epoll")) {
+        fdmon_epoll_setup(ctx);
+        if (ctx->epollfd < 0) {
+            error_setg(errp, "epoll is not available");
+        }
+    } else if (!strcmp(name, "io_uring")) {
+        if (!fdmon_io_uring_setup(ctx)) {
+            error_setg(errp, "io_uring is not available");
+            return;
+        }
+
+        /* Monitor the fd handlers that already exist */
+        qemu_lockcnt_lock(&ctx->list_lock);
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!QLIST_IS_INSERTED(node, node_deleted)) {
+                ctx->fdmon_ops->update(ctx, NULL, node);
+            }
+        }
+        qemu_lockcnt_unlock(&ctx->list_lock);
+    }
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
@@ -767,6 +897,43 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     aio_notify(ctx);
 }
 
+void aio_context_set_poll_cpu_budget(AioContext *ctx, int64_t budget,
+                                     Error **errp)
+{
+    if (budget < 0 || budget > 100) {
+        error_setg(errp, "poll-cpu-budget must be in range [0, 100]");
+        return;
+    }
+
+    qatomic_set(&ctx->poll_cpu_budget, budget);
+    aio_notify(ctx);
+}
+
+IOThreadHandlerStatsList *aio_context_get_handler_stats(AioContext *ctx)
+{
+    IOThreadHandlerStatsList *head = NULL, **tail = &head;
+    AioHandler *node;
+
+    /* Keep the handlers from being freed, as aio_poll() does */
+    qemu_lockcnt_inc(&ctx->list_lock);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        IOThreadHandlerStats *stats;
+
+        if (QLIST_IS_INSERTED(node, node_deleted)) {
+            continue;
+        }
+
+        stats = g_new0(IOThreadHandlerStats, 1);
+        stats->fd = node->pfd.fd;
+        stats->dispatched = stat64_get(&node->dispatch_count);
+        stats->polled = stat64_get(&node->poll_ready_count);
+        QAPI_LIST_APPEND(tail, stats);
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+
+    return head;
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp)
 {
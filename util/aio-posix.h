@@ -39,6 +39,11 @@ struct AioHandler {
     int64_t poll_idle_timeout; /* when to stop userspace polling */
     bool poll_ready; /* has polling detected an event? */
     bool is_external;
+    bool is_event_notifier; /* io_read drains the fd, see fdmon-io_uring.c */
+
+    /* Calls of io_read/io_write and of io_poll_ready, for statistics */
+    Stat64 dispatch_count;
+    Stat64 poll_ready_count;
 };
 
 /* Add a handler to a ready list */
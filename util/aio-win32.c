@@ -352,6 +352,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
      * so disable the optimization now.
      */
     if (blocking) {
+        qatomic_set(&ctx->notify_kicked, false);
+        /*
+         * Write notify_kicked before notify_me.  Pairs with smp_rmb in
+         * aio_notify().
+         */
+        smp_wmb();
         qatomic_set(&ctx->notify_me, qatomic_read(&ctx->notify_me) + 2);
         /*
          * Write ctx->notify_me before computing the timeout
@@ -434,6 +440,12 @@ void aio_context_use_g_source(AioContext *ctx)
 {
 }
 
+void aio_context_set_fdmon(AioContext *ctx, const char *name, Error **errp)
+{
+    error_setg(errp, "File descriptor monitoring cannot be selected on "
+               "Windows");
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
@@ -442,6 +454,19 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     }
 }
 
+void aio_context_set_poll_cpu_budget(AioContext *ctx, int64_t budget,
+                                     Error **errp)
+{
+    if (budget) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
+IOThreadHandlerStatsList *aio_context_get_handler_stats(AioContext *ctx)
+{
+    return NULL;
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp)
 {
@@ -255,6 +255,12 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
 {
     AioContext *ctx = (AioContext *) source;
 
+    qatomic_set(&ctx->notify_kicked, false);
+    /*
+     * Write notify_kicked before notify_me.  Pairs with smp_rmb in
+     * aio_notify().
+     */
+    smp_wmb();
     qatomic_set(&ctx->notify_me, qatomic_read(&ctx->notify_me) | 1);
 
     /*
@@ -450,12 +456,40 @@ void aio_notify(AioContext *ctx)
      */
     smp_mb();
     if (qatomic_read(&ctx->notify_me)) {
-        event_notifier_set(&ctx->notifier);
+        /*
+         * Read notify_me before notify_kicked.  Pairs with smp_wmb in
+         * aio_ctx_prepare or aio_poll.
+         */
+        smp_rmb();
+
+        /* Only the first notification of a wait needs to kick it.  */
+        if (!qatomic_read(&ctx->notify_kicked) &&
+            !qatomic_xchg(&ctx->notify_kicked, true)) {
+            event_notifier_set(&ctx->notifier);
+            stat64_add(&ctx->notify_sent, 1);
+            return;
+        }
     }
+
+    /*
+     * The event loop is polling, dispatching, or is already being woken
+     * up: it will see ctx->notified without an event_notifier_set.
+     */
+    stat64_add(&ctx->notify_suppressed, 1);
 }
 
 void aio_notify_accept(AioContext *ctx)
 {
+    /*
+     * Another thread may still be blocked waiting on ctx, and we may have
+     * consumed the kick meant for it too; the next aio_notify() must kick
+     * it again.  Clear notify_kicked before ctx->notified: a notifier that
+     * saw it still set has its notified overwritten here, and its work is
+     * picked up by our caller.  The xchg pairs with smp_mb in aio_notify.
+     */
+    if (qatomic_read(&ctx->notify_kicked)) {
+        qatomic_xchg(&ctx->notify_kicked, false);
+    }
     qatomic_set(&ctx->notified, false);
 
     /*
@@ -465,6 +499,27 @@ void aio_notify_accept(AioContext *ctx)
     smp_mb();
 }
 
+IOThreadPollStats *aio_context_get_poll_stats(AioContext *ctx)
+{
+    IOThreadPollStats *stats = g_new0(IOThreadPollStats, 1);
+    int i;
+
+    stats->poll_ns = ctx->poll_ns;
+    stats->poll_count = stat64_get(&ctx->poll_count);
+    stats->poll_success = stat64_get(&ctx->poll_success);
+    stats->poll_time = stat64_get(&ctx->poll_time_ns);
+    for (i = AIO_POLL_HISTOGRAM_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(stats->poll_histogram,
+                          stat64_get(&ctx->poll_histogram[i]));
+    }
+    stats->poll_over_budget = ctx->poll_over_budget;
+    stats->wait_count = stat64_get(&ctx->wait_count);
+    stats->wait_time = stat64_get(&ctx->wait_time_ns);
+    stats->handlers = aio_context_get_handler_stats(ctx);
+
+    return stats;
+}
+
 static void aio_timerlist_notify(void *opaque, QEMUClockType type)
 {
     aio_notify(opaque);
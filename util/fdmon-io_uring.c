@@ -25,7 +25,13 @@
  *
  * File descriptor monitoring is implemented using the following operations:
  *
- * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.
+ * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.  Event
+ *    notifiers that are not external are monitored with multishot polls
+ *    (IORING_POLL_ADD_MULTI), which stay armed after posting a cqe, because
+ *    their handlers always drain the file descriptor and therefore do not
+ *    need level-triggered semantics.  Other file descriptors, and external
+ *    event notifiers whose events can be dropped while external clients are
+ *    disabled, use one-shot polls that are re-armed each time they complete.
  * 2. IORING_OP_POLL_REMOVE - removes a file descriptor being monitored.  When
  *    the poll mask changes for a file descriptor it is first removed and then
  *    re-added with the new poll mask, so this operation is also used as part
@@ -41,6 +47,12 @@
  * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
  * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
  * and/or IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * With multishot polls the sq ring is usually empty, so fdmon_io_uring_wait()
+ * reaps cqes that are already available without entering the kernel.  The cq
+ * ring is larger than the sq ring because a single multishot poll can post
+ * many cqes, and the ring fd is registered when possible to make
+ * io_uring_enter(2) cheaper.
  */
 
 #include "qemu/osdep.h"
@@ -49,7 +61,8 @@
 #include "aio-posix.h"
 
 enum {
-    FDMON_IO_URING_ENTRIES  = 128, /* sq/cq ring size */
+    FDMON_IO_URING_ENTRIES  = 128, /* sq ring size */
+    FDMON_IO_URING_CQ_ENTRIES = 4096, /* cq ring size */
 
     /* AioHandler::flags */
     FDMON_IO_URING_PENDING  = (1 << 0),
@@ -171,7 +184,23 @@ static void add_poll_add_sqe(AioContext *ctx, AioHandler *node)
     struct io_uring_sqe *sqe = get_sqe(ctx);
     int events = poll_events_from_pfd(node->pfd.events);
 
+#ifdef HAVE_IO_URING_PREP_POLL_MULTISHOT
+    /*
+     * The handlers of external event notifiers are skipped by
+     * aio_dispatch_handler() while external clients are disabled.  A
+     * multishot poll would not post another cqe for the event that was
+     * dropped, while a re-armed one-shot poll completes again as long as
+     * the event notifier is set.
+     */
+    if (node->is_event_notifier && !node->is_external &&
+        ctx->fdmon_io_uring_multishot) {
+        io_uring_prep_poll_multishot(sqe, node->pfd.fd, events);
+    } else {
+        io_uring_prep_poll_add(sqe, node->pfd.fd, events);
+    }
+#else
     io_uring_prep_poll_add(sqe, node->pfd.fd, events);
+#endif
     io_uring_sqe_set_data(sqe, node);
 }
 
@@ -225,6 +254,7 @@ static bool process_cqe(AioContext *ctx,
                         struct io_uring_cqe *cqe)
 {
     AioHandler *node = io_uring_cqe_get_data(cqe);
+    bool more = false;
     unsigned flags;
 
     /* poll_timeout and poll_remove have a zero user_data field */
@@ -232,21 +262,52 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
-    /*
-     * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
-     * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
-     * bit before IORING_OP_POLL_REMOVE is submitted.
-     */
-    flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
-    if (flags & FDMON_IO_URING_REMOVE) {
-        QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node, node_deleted);
-        return false;
+#ifdef HAVE_IO_URING_PREP_POLL_MULTISHOT
+    /* Is this a multishot IORING_OP_POLL_ADD that is still armed? */
+    more = cqe->flags & IORING_CQE_F_MORE;
+#endif
+
+    if (more) {
+        /* The handler can only be freed after the final cqe */
+        if (qatomic_read(&node->flags) & FDMON_IO_URING_REMOVE) {
+            return false;
+        }
+    } else {
+        /*
+         * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we
+         * race with enqueue() here then we can safely clear the
+         * FDMON_IO_URING_REMOVE bit before IORING_OP_POLL_REMOVE is submitted.
+         */
+        flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+        if (flags & FDMON_IO_URING_REMOVE) {
+            QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                  node_deleted);
+            return false;
+        }
+
+        /*
+         * Kernels before Linux 5.13 reject IORING_POLL_ADD_MULTI.  Every
+         * event notifier armed before the first such cqe fails the same
+         * way, so re-arm them all as one-shot polls without dispatching.
+         */
+        if (cqe->res == -EINVAL) {
+            if (node->is_event_notifier) {
+                ctx->fdmon_io_uring_multishot = false;
+            }
+            add_poll_add_sqe(ctx, node);
+            return false;
+        }
     }
 
-    aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
+    /* cqe->res is a negative errno, not a poll mask, if the poll failed */
+    aio_add_ready_handler(ready_list, node,
+                          cqe->res < 0 ? G_IO_ERR :
+                          pfd_events_from_poll(cqe->res));
 
-    /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
-    add_poll_add_sqe(ctx, node);
+    /* One-shot polls, and multishot polls that were terminated, are re-armed */
+    if (!more) {
+        add_poll_add_sqe(ctx, node);
+    }
     return true;
 }
 
@@ -273,6 +334,7 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
 static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
                                int64_t timeout)
 {
+    struct io_uring *ring = &ctx->fdmon_io_uring;
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
     int ret;
 
@@ -281,16 +343,24 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
         return fdmon_poll_ops.wait(ctx, ready_list, timeout);
     }
 
+    fill_sq_ring(ctx);
+
+    /* Reap cqes that are already there without blocking */
+    if (io_uring_cq_ready(ring)) {
+        if (!io_uring_sq_ready(ring)) {
+            return process_cq_ring(ctx, ready_list);
+        }
+        timeout = 0;
+    }
+
     if (timeout == 0) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
         add_timeout_sqe(ctx, timeout);
     }
 
-    fill_sq_ring(ctx);
-
     do {
-        ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, wait_nr);
+        ret = io_uring_submit_and_wait(ring, wait_nr);
     } while (ret == -EINTR);
 
     assert(ret >= 0);
@@ -310,6 +380,13 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
         return true;
     }
 
+#ifdef IORING_SQ_CQ_OVERFLOW
+    /* Did cqes overflow?  The kernel flushes them on the next syscall */
+    if (qatomic_read(ctx->fdmon_io_uring.sq.kflags) & IORING_SQ_CQ_OVERFLOW) {
+        return true;
+    }
+#endif
+
     /* Do we need to process AioHandlers for io_uring changes? */
     if (!QSLIST_EMPTY_RCU(&ctx->submit_list)) {
         return true;
@@ -327,14 +404,38 @@ static const FDMonOps fdmon_io_uring_ops = {
 
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
+#ifdef IORING_SETUP_CQSIZE
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = FDMON_IO_URING_CQ_ENTRIES,
+    };
+#endif
     int ret;
 
+#ifdef IORING_SETUP_CQSIZE
+    ret = io_uring_queue_init_params(FDMON_IO_URING_ENTRIES,
+                                     &ctx->fdmon_io_uring, &params);
+    if (ret == -EINVAL) {
+        /* IORING_SETUP_CQSIZE needs Linux 5.5 */
+        ret = io_uring_queue_init(FDMON_IO_URING_ENTRIES,
+                                  &ctx->fdmon_io_uring, 0);
+    }
+#else
     ret = io_uring_queue_init(FDMON_IO_URING_ENTRIES, &ctx->fdmon_io_uring, 0);
+#endif
     if (ret != 0) {
         return false;
     }
 
+#ifdef HAVE_IO_URING_REGISTER_RING_FD
+    /* Optional, avoids an fd table lookup in each io_uring_enter(2) */
+    io_uring_register_ring_fd(&ctx->fdmon_io_uring);
+#endif
+
     QSLIST_INIT(&ctx->submit_list);
+#ifdef HAVE_IO_URING_PREP_POLL_MULTISHOT
+    ctx->fdmon_io_uring_multishot = true;
+#endif
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
@@ -16,20 +16,25 @@
 #include "trace.h"
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/stats64.h"
 #include "qemu/coroutine.h"
 #include "qemu/coroutine_int.h"
 #include "qemu/coroutine-tls.h"
 #include "block/aio.h"
 
 /**
- * The minimal batch size is always 64, coroutines from the release_pool are
- * reused as soon as there are 64 coroutines in it. The maximum pool size starts
- * with 64 and is increased on demand so that coroutines are not deleted even if
- * they are not immediately reused.
+ * Terminated coroutines first go to the alloc_pool of their thread, where
+ * their stacks are still warm in the cache, and only overflow into the global
+ * release_pool.  A thread whose alloc_pool is empty takes the whole
+ * release_pool, however small, so that bursts of requests reuse coroutines
+ * freed by other threads instead of allocating new stacks.
+ *
+ * The maximum pool size starts with 64 and is increased on demand so that
+ * coroutines are not deleted even if they are not immediately reused.
  */
 enum {
-    POOL_MIN_BATCH_SIZE = 64,
     POOL_INITIAL_MAX_SIZE = 64,
+    POOL_STATS_BATCH = 64, /* reuses counted per thread before flushing */
 };
 
 /** Free list to speed up creation */
@@ -37,11 +42,30 @@ static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int pool_max_size = POOL_INITIAL_MAX_SIZE;
 static unsigned int release_pool_size;
 
+/* See qemu_coroutine_get_pool_stats() */
+static Stat64 created_count;
+static Stat64 reused_count;
+static Stat64 deleted_count;
+
 typedef QSLIST_HEAD(, Coroutine) CoroutineQSList;
 QEMU_DEFINE_STATIC_CO_TLS(CoroutineQSList, alloc_pool);
 QEMU_DEFINE_STATIC_CO_TLS(unsigned int, alloc_pool_size);
+QEMU_DEFINE_STATIC_CO_TLS(unsigned int, alloc_pool_reused);
 QEMU_DEFINE_STATIC_CO_TLS(Notifier, coroutine_pool_cleanup_notifier);
 
+static void coroutine_free(Coroutine *co)
+{
+    stat64_add(&deleted_count, 1);
+    qemu_coroutine_delete(co);
+}
+
+/* Reuses are counted per thread to keep the fast path free of atomics */
+static void coroutine_pool_flush_stats(void)
+{
+    stat64_add(&reused_count, get_alloc_pool_reused());
+    set_alloc_pool_reused(0);
+}
+
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
@@ -50,7 +74,20 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
 
     QSLIST_FOREACH_SAFE(co, alloc_pool, pool_next, tmp) {
         QSLIST_REMOVE_HEAD(alloc_pool, pool_next);
-        qemu_coroutine_delete(co);
+        coroutine_free(co);
+    }
+    set_alloc_pool_size(0);
+    coroutine_pool_flush_stats();
+}
+
+/* Free the alloc_pool when the thread exits */
+static void coroutine_pool_register_cleanup(void)
+{
+    Notifier *notifier = get_ptr_coroutine_pool_cleanup_notifier();
+
+    if (!notifier->notify) {
+        notifier->notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(notifier);
     }
 }
 
@@ -62,32 +99,32 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         CoroutineQSList *alloc_pool = get_ptr_alloc_pool();
 
         co = QSLIST_FIRST(alloc_pool);
-        if (!co) {
-            if (release_pool_size > POOL_MIN_BATCH_SIZE) {
-                /* Slow path; a good place to register the destructor, too.  */
-                Notifier *notifier = get_ptr_coroutine_pool_cleanup_notifier();
-                if (!notifier->notify) {
-                    notifier->notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(notifier);
-                }
-
-                /* This is not exact; there could be a little skew between
-                 * release_pool_size and the actual size of release_pool.  But
-                 * it is just a heuristic, it does not need to be perfect.
-                 */
-                set_alloc_pool_size(qatomic_xchg(&release_pool_size, 0));
-                QSLIST_MOVE_ATOMIC(alloc_pool, &release_pool);
-                co = QSLIST_FIRST(alloc_pool);
-            }
+        if (!co && qatomic_read(&release_pool_size)) {
+            coroutine_pool_register_cleanup();
+
+            /*
+             * This is not exact; there could be a little skew between
+             * release_pool_size and the actual size of release_pool.  But
+             * it is just a heuristic, it does not need to be perfect.
+             */
+            set_alloc_pool_size(qatomic_xchg(&release_pool_size, 0));
+            QSLIST_MOVE_ATOMIC(alloc_pool, &release_pool);
+            co = QSLIST_FIRST(alloc_pool);
+            trace_qemu_coroutine_pool_refill(get_alloc_pool_size());
         }
         if (co) {
             QSLIST_REMOVE_HEAD(alloc_pool, pool_next);
             set_alloc_pool_size(get_alloc_pool_size() - 1);
+            set_alloc_pool_reused(get_alloc_pool_reused() + 1);
+            if (get_alloc_pool_reused() >= POOL_STATS_BATCH) {
+                coroutine_pool_flush_stats();
+            }
         }
     }
 
     if (!co) {
         co = qemu_coroutine_new();
+        stat64_add(&created_count, 1);
     }
 
     co->entry = entry;
@@ -101,19 +138,24 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
+        unsigned int alloc_pool_size = get_alloc_pool_size();
+
+        if (alloc_pool_size < qatomic_read(&pool_max_size)) {
+            if (alloc_pool_size == 0) {
+                coroutine_pool_register_cleanup();
+            }
+            QSLIST_INSERT_HEAD(get_ptr_alloc_pool(), co, pool_next);
+            set_alloc_pool_size(alloc_pool_size + 1);
+            return;
+        }
         if (release_pool_size < qatomic_read(&pool_max_size) * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             qatomic_inc(&release_pool_size);
             return;
         }
-        if (get_alloc_pool_size() < qatomic_read(&pool_max_size)) {
-            QSLIST_INSERT_HEAD(get_ptr_alloc_pool(), co, pool_next);
-            set_alloc_pool_size(get_alloc_pool_size() + 1);
-            return;
-        }
     }
 
-    qemu_coroutine_delete(co);
+    coroutine_free(co);
 }
 
 void qemu_aio_coroutine_enter(AioContext *ctx, Coroutine *co)
@@ -225,5 +267,34 @@ void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size)
 
 void qemu_coroutine_dec_pool_size(unsigned int removing_pool_size)
 {
-    qatomic_sub(&pool_max_size, removing_pool_size);
+    CoroutineQSList list;
+    Coroutine *co;
+    unsigned int keep;
+
+    keep = qatomic_sub_fetch(&pool_max_size, removing_pool_size) * 2;
+
+    /* Give back the stacks that the smaller release_pool no longer holds */
+    qatomic_xchg(&release_pool_size, 0);
+    QSLIST_MOVE_ATOMIC(&list, &release_pool);
+    while ((co = QSLIST_FIRST(&list))) {
+        QSLIST_REMOVE_HEAD(&list, pool_next);
+        if (keep) {
+            keep--;
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+            qatomic_inc(&release_pool_size);
+        } else {
+            coroutine_free(co);
+        }
+    }
+}
+
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats)
+{
+    coroutine_pool_flush_stats();
+
+    stats->created = stat64_get(&created_count);
+    stats->reused = stat64_get(&reused_count);
+    stats->deleted = stat64_get(&deleted_count);
+    stats->pool_max_size = qatomic_read(&pool_max_size);
+    stats->release_pool_size = qatomic_read(&release_pool_size);
 }
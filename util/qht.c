@@ -22,8 +22,10 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold, or if chains grow too long. Resizing is done
+ *   concurrently with readers; writes are serialized with the resize
+ *   operation. The resize can be offloaded to a separate thread so that
+ *   the writer that triggers it does not stall.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -70,6 +72,7 @@
 #include "qemu/atomic.h"
 #include "qemu/rcu.h"
 #include "qemu/memalign.h"
+#include "qemu/host-utils.h"
 
 //#define QHT_DEBUG
 
@@ -160,6 +163,7 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @long_chain: set when an insertion had to walk too long a chain.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -169,11 +173,20 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    bool long_chain;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
+/*
+ * Also trigger a resize when an insertion extends a chain beyond this many
+ * buckets, provided that the map is at least a quarter of the way to the
+ * threshold above. The latter condition keeps a handful of colliding hashes
+ * from growing the table over and over.
+ */
+#define QHT_LONG_CHAIN_BUCKETS 4
+
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
                                 bool reset);
 static void qht_grow_maybe(struct qht *ht);
@@ -342,7 +355,7 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
 static inline bool qht_map_needs_resize(const struct qht_map *map)
 {
     return qatomic_read(&map->n_added_buckets) >
-           map->n_added_buckets_threshold;
+           map->n_added_buckets_threshold || qatomic_read(&map->long_chain);
 }
 
 static inline void qht_chain_destroy(const struct qht_bucket *head)
@@ -379,6 +392,7 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
+    map->long_chain = false;
     map->n_added_buckets_threshold = n_buckets /
         QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV;
 
@@ -404,7 +418,12 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
     g_assert(cmp);
     ht->cmp = cmp;
     ht->mode = mode;
+    ht->resize_thread_started = false;
+    ht->resize_pending = false;
+    ht->resize_exit = false;
+    ht->n_resizes = 0;
     qemu_mutex_init(&ht->lock);
+    qemu_cond_init(&ht->resize_cond);
     map = qht_map_create(n_buckets);
     qatomic_rcu_set(&ht->map, map);
 }
@@ -412,6 +431,14 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->resize_thread_started) {
+        qht_lock(ht);
+        ht->resize_exit = true;
+        qemu_cond_signal(&ht->resize_cond);
+        qht_unlock(ht);
+        qemu_thread_join(&ht->resize_thread);
+    }
+    qemu_cond_destroy(&ht->resize_cond);
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -485,26 +512,63 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     return !!new;
 }
 
+/*
+ * Return a bitmap of the entries of @b whose hash is @hash.
+ *
+ * Comparing all the hashes of a bucket at once avoids a branch per entry.
+ * A concurrent writer can make the result stale, which the caller detects
+ * through the bucket's seqlock; TSan would not see it that way, so stick
+ * to atomic accesses there.
+ */
+static inline unsigned int qht_bucket_match(const struct qht_bucket *b,
+                                            uint32_t hash)
+{
+#if QHT_BUCKET_ENTRIES == 4 && !defined(CONFIG_TSAN)
+    typedef uint32_t qht_hash_vec __attribute__((vector_size(16)));
+    typedef int32_t qht_mask_vec __attribute__((vector_size(16)));
+    qht_hash_vec h;
+    qht_mask_vec m;
+    unsigned int match;
+
+    memcpy(&h, b->hashes, sizeof(h));
+    m = h == (qht_hash_vec){ hash, hash, hash, hash };
+    match = (m[0] & 1) | (m[1] & 2) | (m[2] & 4) | (m[3] & 8);
+    return match;
+#else
+    unsigned int match = 0;
+    int i;
+
+    for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+        if (qatomic_read(&b->hashes[i]) == hash) {
+            match |= 1u << i;
+        }
+    }
+    return match;
+#endif
+}
+
 static inline
 void *qht_do_lookup(const struct qht_bucket *head, qht_lookup_func_t func,
                     const void *userp, uint32_t hash)
 {
     const struct qht_bucket *b = head;
-    int i;
 
     do {
-        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
-            if (qatomic_read(&b->hashes[i]) == hash) {
-                /* The pointer is dereferenced before seqlock_read_retry,
-                 * so (unlike qht_insert__locked) we need to use
-                 * qatomic_rcu_read here.
-                 */
-                void *p = qatomic_rcu_read(&b->pointers[i]);
-
-                if (likely(p) && likely(func(p, userp))) {
-                    return p;
-                }
+        unsigned int match = qht_bucket_match(b, hash);
+
+        while (match) {
+            int i = ctz32(match);
+            /*
+             * The pointer is dereferenced before seqlock_read_retry,
+             * so (unlike qht_insert__locked) we need to use
+             * qatomic_rcu_read here.
+             */
+            void *p = qatomic_rcu_read(&b->pointers[i]);
+
+            if (likely(p) && likely(func(p, userp))) {
+                return p;
             }
+            match &= match - 1;
         }
         b = qatomic_rcu_read(&b->next);
     } while (b);
@@ -565,9 +629,11 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     struct qht_bucket *b = head;
     struct qht_bucket *prev = NULL;
     struct qht_bucket *new = NULL;
+    unsigned int chain = 0;
     int i;
 
     do {
+        chain++;
         for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
             if (b->pointers[i]) {
                 if (unlikely(b->hashes[i] == hash &&
@@ -587,6 +653,11 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     new = b;
     i = 0;
     qatomic_inc(&map->n_added_buckets);
+    if (needs_resize && unlikely(chain >= QHT_LONG_CHAIN_BUCKETS) &&
+        qatomic_read(&map->n_added_buckets) >
+        map->n_added_buckets_threshold / 4) {
+        qatomic_set(&map->long_chain, true);
+    }
     if (unlikely(qht_map_needs_resize(map)) && needs_resize) {
         *needs_resize = true;
     }
@@ -604,10 +675,39 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     return NULL;
 }
 
-static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
+/* call with ht->lock held */
+static void qht_grow__locked(struct qht *ht)
 {
-    struct qht_map *map;
+    struct qht_map *map = ht->map;
 
+    /* another thread might have just performed the resize we were after */
+    if (qht_map_needs_resize(map)) {
+        struct qht_map *new = qht_map_create(map->n_buckets * 2);
+
+        qht_do_resize(ht, new);
+    }
+}
+
+/* The worker of QHT_MODE_BACKGROUND_RESIZE, see qht_grow_maybe() */
+static void *qht_resize_thread(void *arg)
+{
+    struct qht *ht = arg;
+
+    qht_lock(ht);
+    while (!ht->resize_exit) {
+        if (ht->resize_pending) {
+            qht_grow__locked(ht);
+            ht->resize_pending = false;
+        } else {
+            qemu_cond_wait(&ht->resize_cond, &ht->lock);
+        }
+    }
+    qht_unlock(ht);
+    return NULL;
+}
+
+static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
+{
     /*
      * If the lock is taken it probably means there's an ongoing resize,
      * so bail out.
@@ -615,12 +715,16 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
     if (qht_trylock(ht)) {
         return;
     }
-    map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
-
-        qht_do_resize(ht, new);
+    if (!(ht->mode & QHT_MODE_BACKGROUND_RESIZE)) {
+        qht_grow__locked(ht);
+    } else if (!ht->resize_pending && qht_map_needs_resize(ht->map)) {
+        if (!ht->resize_thread_started) {
+            ht->resize_thread_started = true;
+            qemu_thread_create(&ht->resize_thread, "qht-resize",
+                               qht_resize_thread, ht, QEMU_THREAD_JOINABLE);
+        }
+        ht->resize_pending = true;
+        qemu_cond_signal(&ht->resize_cond);
     }
     qht_unlock(ht);
 }
@@ -879,6 +983,7 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     qht_map_debug__all_locked(new);
 
     qatomic_rcu_set(&ht->map, new);
+    qatomic_set(&ht->n_resizes, ht->n_resizes + 1);
     qht_map_unlock_buckets(old);
     call_rcu(old, qht_map_destroy, rcu);
 }
@@ -911,6 +1016,7 @@ void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
 
     stats->used_head_buckets = 0;
     stats->entries = 0;
+    stats->resizes = qatomic_read(&ht->n_resizes);
     qdist_init(&stats->chain);
     qdist_init(&stats->occupancy);
     /* bail out if the qht has not yet been initialized */
@@ -32,6 +32,8 @@
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
 #include "qemu/lockable.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #if defined(CONFIG_MALLOC_TRIM)
 #include <malloc.h>
 #endif
@@ -46,10 +48,23 @@
 unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
 
 QemuEvent rcu_gp_event;
-static int in_drain_call_rcu;
+static int rcu_expedited;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/*
+ * Grace period sequence number, odd while synchronize_rcu() is waiting
+ * for readers.  Written under rcu_sync_lock.
+ */
+static unsigned long rcu_gp_seq;
+
+static Stat64 rcu_gp_count;
+static Stat64 rcu_gp_shared;
+static Stat64 rcu_gp_total_ns;
+static Stat64 rcu_gp_max_ns;
+static Stat64 rcu_cb_queued;
+static Stat64 rcu_cb_invoked;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -108,7 +123,7 @@ static void wait_for_readers(void)
                  * get some extra futex wakeups.
                  */
                 qatomic_set(&index->waiting, false);
-            } else if (qatomic_read(&in_drain_call_rcu)) {
+            } else if (qatomic_read(&rcu_expedited)) {
                 notifier_list_notify(&index->force_rcu, NULL);
             }
         }
@@ -145,7 +160,26 @@ static void wait_for_readers(void)
 
 void synchronize_rcu(void)
 {
+    unsigned long snap;
+    int64_t start, ns;
+
+    /*
+     * Any grace period that starts after this point also covers our
+     * caller, so round up to the end of the next one.  The barrier orders
+     * the caller's updates before the read of rcu_gp_seq.
+     */
+    smp_mb();
+    snap = (qatomic_read(&rcu_gp_seq) + 3) & ~1UL;
+
     QEMU_LOCK_GUARD(&rcu_sync_lock);
+    if ((long)(rcu_gp_seq - snap) >= 0) {
+        /* Someone else did the work while we waited for rcu_sync_lock */
+        stat64_add(&rcu_gp_shared, 1);
+        return;
+    }
+
+    start = get_clock();
+    qatomic_set(&rcu_gp_seq, rcu_gp_seq + 1);
 
     /* Write RCU-protected pointers before reading p_rcu_reader->ctr.
      * Pairs with smp_mb_placeholder() in rcu_read_lock().
@@ -173,11 +207,42 @@ void synchronize_rcu(void)
 
         wait_for_readers();
     }
+
+    qatomic_set(&rcu_gp_seq, rcu_gp_seq + 1);
+
+    ns = get_clock() - start;
+    stat64_add(&rcu_gp_count, 1);
+    stat64_add(&rcu_gp_total_ns, ns);
+    stat64_max(&rcu_gp_max_ns, ns);
+}
+
+void synchronize_rcu_expedited(void)
+{
+    qatomic_inc(&rcu_expedited);
+    synchronize_rcu();
+    qatomic_dec(&rcu_expedited);
+}
+
+void rcu_get_stats(struct rcu_stats *stats)
+{
+    stats->grace_periods = stat64_get(&rcu_gp_count);
+    stats->shared_grace_periods = stat64_get(&rcu_gp_shared);
+    stats->gp_total_ns = stat64_get(&rcu_gp_total_ns);
+    stats->gp_max_ns = stat64_get(&rcu_gp_max_ns);
+    stats->callbacks_queued = stat64_get(&rcu_cb_queued);
+    stats->callbacks_invoked = stat64_get(&rcu_cb_invoked);
 }
 
 
 #define RCU_CALL_MIN_SIZE        30
 
+/*
+ * With this many callbacks waiting, for example because memory map changes
+ * keep freeing FlatViews and their dispatch tables during boot or hotplug,
+ * do not let them pile up further behind a slow reader.
+ */
+#define RCU_CALL_EXPEDITE_SIZE   1000
+
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
  */
@@ -245,11 +310,14 @@ static void *call_rcu_thread(void *opaque)
         int tries = 0;
         int n = qatomic_read(&rcu_call_count);
 
-        /* Heuristically wait for a decent number of callbacks to pile up.
+        /*
+         * Heuristically wait for a decent number of callbacks to pile up,
+         * unless somebody is waiting for them in drain_call_rcu().
          * Fetch rcu_call_count now, we only must process elements that were
          * added before synchronize_rcu() starts.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                          !qatomic_read(&rcu_expedited))) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
@@ -265,7 +333,11 @@ static void *call_rcu_thread(void *opaque)
         }
 
         qatomic_sub(&rcu_call_count, n);
-        synchronize_rcu();
+        if (n >= RCU_CALL_EXPEDITE_SIZE) {
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
         qemu_mutex_lock_iothread();
         while (n > 0) {
             node = try_dequeue();
@@ -282,6 +354,7 @@ static void *call_rcu_thread(void *opaque)
 
             n--;
             node->func(node);
+            stat64_add(&rcu_cb_invoked, 1);
         }
         qemu_mutex_unlock_iothread();
     }
@@ -292,6 +365,7 @@ void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
     node->func = func;
     enqueue(node);
+    stat64_add(&rcu_cb_queued, 1);
     qatomic_inc(&rcu_call_count);
     qemu_event_set(&rcu_call_ready_event);
 }
@@ -342,10 +416,10 @@ void drain_call_rcu(void)
      * assumed.
      */
 
-    qatomic_inc(&in_drain_call_rcu);
+    qatomic_inc(&rcu_expedited);
     call_rcu1(&rcu_drain.rcu, drain_rcu_callback);
     qemu_event_wait(&rcu_drain.drain_complete_event);
-    qatomic_dec(&in_drain_call_rcu);
+    qatomic_dec(&rcu_expedited);
 
     if (locked) {
         qemu_mutex_lock_iothread();
@@ -8,6 +8,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/sys_membarrier.h"
+#include "qemu/atomic.h"
 #include "qemu/error-report.h"
 
 #ifdef CONFIG_LINUX
@@ -19,6 +20,13 @@ membarrier(int cmd, int flags)
 {
     return syscall(__NR_membarrier, cmd, flags);
 }
+
+/*
+ * The private expedited command only interrupts CPUs that are running
+ * threads of this process, and does not wait for a scheduler grace period
+ * like MEMBARRIER_CMD_SHARED does.
+ */
+static int membarrier_cmd = MEMBARRIER_CMD_SHARED;
 #endif
 
 void smp_mb_global(void)
@@ -26,7 +34,22 @@ void smp_mb_global(void)
 #if defined CONFIG_WIN32
     FlushProcessWriteBuffers();
 #elif defined CONFIG_LINUX
-    membarrier(MEMBARRIER_CMD_SHARED, 0);
+    int cmd = qatomic_read(&membarrier_cmd);
+
+    if (membarrier(cmd, 0) == 0) {
+        return;
+    }
+    if (cmd != MEMBARRIER_CMD_SHARED) {
+        /* e.g. a seccomp filter rejects it; stick to the shared command */
+        qatomic_set(&membarrier_cmd, MEMBARRIER_CMD_SHARED);
+        if (membarrier(MEMBARRIER_CMD_SHARED, 0) == 0) {
+            return;
+        }
+    }
+
+    /* Without the barrier, RCU readers could see freed memory */
+    error_report("membarrier failed: %s", strerror(errno));
+    abort();
 #else
 #error --enable-membarrier is not supported on this operating system.
 #endif
@@ -41,10 +64,15 @@ void smp_mb_global_init(void)
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    /* Needed even with the private command, as a fallback if it fails */
     if (!(ret & MEMBARRIER_CMD_SHARED)) {
         error_report("This QEMU binary requires MEMBARRIER_CMD_SHARED support.");
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    if ((ret & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        membarrier_cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+    }
 #endif
 }
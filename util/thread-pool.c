@@ -18,6 +18,8 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -25,6 +27,10 @@
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolQueue ThreadPoolQueue;
+
+/* Maximum number of request queues in a pool */
+#define THREAD_POOL_MAX_QUEUES 16
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -35,21 +41,41 @@ enum ThreadState {
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
+    ThreadPoolQueue *queue;
     ThreadPoolFunc *func;
     void *arg;
+    int64_t submit_ns;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /*
+     * Moving state out of THREAD_QUEUED is protected by the lock of
+     * the queue.  After that, only the worker thread can write to it.
+     * ret is passed to the completion BH through completed_list, whose
+     * atomic operations order it.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by the lock of the queue.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Completed requests, pushed by the worker threads.  */
+    QSLIST_ENTRY(ThreadPoolElement) completed;
+
     /* Access to this list is protected by the global mutex.  */
-    QLIST_ENTRY(ThreadPoolElement) all;
+    QSIMPLEQ_ENTRY(ThreadPoolElement) done;
+};
+
+/*
+ * Requests are spread over several queues, so that submitting a request
+ * and picking it up do not all go through a single lock.  Each worker
+ * thread has a home queue and takes requests from the others when it is
+ * empty.
+ */
+struct ThreadPoolQueue {
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /* Number of requests in request_list, read without the lock */
+    unsigned int len;
 };
 
 struct ThreadPool {
@@ -61,64 +87,175 @@ struct ThreadPool {
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
-    QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) done_list;
+    unsigned int next_queue;
+    unsigned int in_flight;
+
+    /* Requests completed by the worker threads, not yet seen by the BH. */
+    QSLIST_HEAD(, ThreadPoolElement) completed_list;
+
+    ThreadPoolQueue *queues;
+    unsigned int nr_queues;
+    /*
+     * Number of requests in all the queues.  A worker can take a request
+     * before its submitter counts it, so this can briefly be negative.
+     */
+    int queued;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    unsigned int next_home;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
     int max_threads;
+
+    /* Statistics, see thread_pool_get_stats().  */
+    Stat64 requests;
+    Stat64 steals;
+    Stat64 max_queue_depth;
+    Stat64 queue_ns;
+    Stat64 max_queue_ns;
+    Stat64 run_ns;
 };
 
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    /*
+     * The BH takes all the completed requests at once, so a burst of
+     * completions is handled by a single run of it.
+     */
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->completed_list, req, completed);
+    qemu_bh_schedule(pool->completion_bh);
+}
+
+/*
+ * Take the oldest request from the home queue of a worker, or from the
+ * next non-empty queue.  The oldest request is also the one taken from
+ * the other queues, because a queue may have no worker thread at all.
+ */
+static ThreadPoolElement *thread_pool_dequeue(ThreadPool *pool,
+                                              unsigned int home)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool->nr_queues; i++) {
+        ThreadPoolQueue *queue = &pool->queues[(home + i) % pool->nr_queues];
+        ThreadPoolElement *req;
+
+        if (!qatomic_read(&queue->len)) {
+            continue;
+        }
+
+        qemu_mutex_lock(&queue->lock);
+        req = QTAILQ_FIRST(&queue->request_list);
+        if (req) {
+            QTAILQ_REMOVE(&queue->request_list, req, reqs);
+            qatomic_set(&queue->len, queue->len - 1);
+            req->state = THREAD_ACTIVE;
+        }
+        qemu_mutex_unlock(&queue->lock);
+
+        if (req) {
+            qatomic_dec(&pool->queued);
+            if (i) {
+                stat64_add(&pool->steals, 1);
+            }
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void thread_pool_run(ThreadPool *pool, ThreadPoolElement *req)
+{
+    int64_t start = get_clock();
+    int ret;
+
+    stat64_add(&pool->queue_ns, start - req->submit_ns);
+    stat64_max(&pool->max_queue_ns, start - req->submit_ns);
+
+    ret = req->func(req->arg);
+
+    stat64_add(&pool->run_ns, get_clock() - start);
+    stat64_add(&pool->requests, 1);
+
+    req->ret = ret;
+    req->state = THREAD_DONE;
+
+    thread_pool_complete(pool, req);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    unsigned int home;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    home = pool->next_home++ % pool->nr_queues;
 
     while (pool->cur_threads <= pool->max_threads) {
         ThreadPoolElement *req;
         int ret;
 
-        if (QTAILQ_EMPTY(&pool->request_list)) {
-            pool->idle_threads++;
-            ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
-            pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
-                pool->cur_threads > pool->min_threads) {
-                /* Timed out + no work to do + no need for warm threads = exit.  */
+        qemu_mutex_unlock(&pool->lock);
+        while ((req = thread_pool_dequeue(pool, home))) {
+            thread_pool_run(pool, req);
+            if (qatomic_read(&pool->cur_threads) >
+                qatomic_read(&pool->max_threads)) {
                 break;
             }
-            /*
-             * Even if there was some work to do, check if there aren't
-             * too many worker threads before picking it up.
-             */
+        }
+        qemu_mutex_lock(&pool->lock);
+        if (req) {
             continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
-
-        ret = req->func(req->arg);
-
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
-
-        qemu_bh_schedule(pool->completion_bh);
-        qemu_mutex_lock(&pool->lock);
+        /*
+         * Submitters only take the lock to wake us up if they see us
+         * idle, so check again for requests after becoming idle.
+         */
+        qatomic_set(&pool->idle_threads, pool->idle_threads + 1);
+        /* Pairs with qatomic_fetch_inc() in thread_pool_submit_aio() */
+        smp_mb();
+        if (qatomic_read(&pool->queued) > 0) {
+            qatomic_set(&pool->idle_threads, pool->idle_threads - 1);
+            continue;
+        }
+        ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
+        qatomic_set(&pool->idle_threads, pool->idle_threads - 1);
+        /*
+         * Order the decrement before reading queued: a submitter that
+         * still sees us idle does not create a thread for its request.
+         */
+        smp_mb();
+        if (ret == 0 &&
+            qatomic_read(&pool->queued) <= 0 &&
+            pool->cur_threads > pool->min_threads) {
+            /*
+             * Timed out + no work to do + no need for warm threads = exit.
+             * Stop counting ourselves before the last check, so that a
+             * submitter whose request we miss creates a new thread.
+             */
+            qatomic_set(&pool->cur_threads, pool->cur_threads - 1);
+            /* Pairs with qatomic_fetch_inc() in thread_pool_submit_aio() */
+            smp_mb();
+            if (qatomic_read(&pool->queued) <= 0) {
+                goto stopped;
+            }
+            qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
+        }
+        /*
+         * Even if there was some work to do, check if there aren't
+         * too many worker threads before picking it up.
+         */
     }
 
-    pool->cur_threads--;
+    qatomic_set(&pool->cur_threads, pool->cur_threads - 1);
+stopped:
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
 
@@ -156,7 +293,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
+    qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -170,26 +307,43 @@ static void spawn_thread(ThreadPool *pool)
     }
 }
 
+/*
+ * Take the next completed request, moving the requests completed by the
+ * worker threads in the meanwhile to done_list if it is empty.
+ */
+static ThreadPoolElement *thread_pool_next_done(ThreadPool *pool)
+{
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+    ThreadPoolElement *elem;
+
+    if (QSIMPLEQ_EMPTY(&pool->done_list)) {
+        /* completed_list is in reverse order of completion */
+        QSLIST_MOVE_ATOMIC(&completed, &pool->completed_list);
+        while ((elem = QSLIST_FIRST(&completed))) {
+            QSLIST_REMOVE_HEAD(&completed, completed);
+            QSIMPLEQ_INSERT_HEAD(&pool->done_list, elem, done);
+        }
+    }
+
+    elem = QSIMPLEQ_FIRST(&pool->done_list);
+    if (elem) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->done_list, done);
+    }
+    return elem;
+}
+
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
-        }
-
+    while ((elem = thread_pool_next_done(pool))) {
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
-        QLIST_REMOVE(elem, all);
+        qatomic_set(&pool->in_flight, pool->in_flight - 1);
 
         if (elem->common.cb) {
-            /* Read state before ret.  */
-            smp_rmb();
-
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
@@ -200,16 +354,12 @@ restart:
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we go on with the
+             * remaining requests anyway.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -218,16 +368,19 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *queue = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
+    QEMU_LOCK_GUARD(&queue->lock);
     if (elem->state == THREAD_QUEUED) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        QTAILQ_REMOVE(&queue->request_list, elem, reqs);
+        qatomic_set(&queue->len, queue->len - 1);
+        qatomic_dec(&pool->queued);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_complete(pool, elem);
     }
 
 }
@@ -250,24 +403,48 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolQueue *queue;
+    int depth;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
-    QLIST_INSERT_HEAD(&pool->head, req, all);
+    queue = &pool->queues[pool->next_queue++ % pool->nr_queues];
+    req->queue = queue;
+    qatomic_set(&pool->in_flight, pool->in_flight + 1);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    qemu_mutex_lock(&queue->lock);
+    QTAILQ_INSERT_TAIL(&queue->request_list, req, reqs);
+    qatomic_set(&queue->len, queue->len + 1);
+    qemu_mutex_unlock(&queue->lock);
+
+    /* Also orders the queueing before reading idle_threads.  */
+    depth = qatomic_fetch_inc(&pool->queued) + 1;
+    if (depth > 0) {
+        stat64_max(&pool->max_queue_depth, depth);
+    }
+
+    /*
+     * The lock is only needed to wake up an idle thread, or to create a
+     * new one when all of them are busy.  The idle thread seen here may
+     * have timed out in the meanwhile, so check again under the lock.
+     */
+    if (qatomic_read(&pool->idle_threads) ||
+        qatomic_read(&pool->cur_threads) < qatomic_read(&pool->max_threads)) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->idle_threads) {
+            qemu_cond_signal(&pool->request_cond);
+        } else if (pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_cond_signal(&pool->request_cond);
     return &req->common;
 }
 
@@ -328,6 +505,8 @@ void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    unsigned int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -340,8 +519,16 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_cond_init(&pool->request_cond);
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
-    QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSIMPLEQ_INIT(&pool->done_list);
+    QSLIST_INIT(&pool->completed_list);
+
+    pool->nr_queues = MIN(ctx->thread_pool_max, THREAD_POOL_MAX_QUEUES);
+    pool->nr_queues = MAX(pool->nr_queues, 1);
+    pool->queues = g_new0(ThreadPoolQueue, pool->nr_queues);
+    for (i = 0; i < pool->nr_queues; i++) {
+        qemu_mutex_init(&pool->queues[i].lock);
+        QTAILQ_INIT(&pool->queues[i].request_list);
+    }
 
     thread_pool_update_params(pool, ctx);
 }
@@ -355,11 +542,13 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    unsigned int i;
+
     if (!pool) {
         return;
     }
 
-    assert(QLIST_EMPTY(&pool->head));
+    assert(!pool->in_flight);
 
     qemu_mutex_lock(&pool->lock);
 
@@ -378,8 +567,31 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
+    for (i = 0; i < pool->nr_queues; i++) {
+        qemu_mutex_destroy(&pool->queues[i].lock);
+    }
+    g_free(pool->queues);
     qemu_cond_destroy(&pool->request_cond);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
 }
+
+ThreadPoolStats *thread_pool_get_stats(ThreadPool *pool)
+{
+    ThreadPoolStats *stats = g_new0(ThreadPoolStats, 1);
+    uint64_t requests = stat64_get(&pool->requests);
+
+    stats->threads = qatomic_read(&pool->cur_threads);
+    stats->in_flight = qatomic_read(&pool->in_flight);
+    stats->queue_depth = MAX(qatomic_read(&pool->queued), 0);
+    stats->max_queue_depth = stat64_get(&pool->max_queue_depth);
+    stats->requests = requests;
+    stats->steals = stat64_get(&pool->steals);
+    if (requests) {
+        stats->queue_time_avg = stat64_get(&pool->queue_ns) / requests;
+        stats->run_time_avg = stat64_get(&pool->run_ns) / requests;
+    }
+    stats->queue_time_max = stat64_get(&pool->max_queue_ns);
+    return stats;
+}